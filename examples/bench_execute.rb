@@ -0,0 +1,40 @@
+# Measures how Canvas#execute scales with threads: on a large canvas, e.g.
+#
+#   bin/mruby examples/bench_execute.rb [max threads] [size]
+#
+# Needs Array#pack (mruby-pack) to build the command buffer.
+
+def bench(name, runs)
+  runs.times { yield } # warm up
+  start = Time.now
+  runs.times { yield }
+  elapsed = Time.now - start
+  puts "%-40s %8.3f ms/run" % [name, elapsed * 1000.0 / runs]
+  elapsed / runs
+end
+
+max_threads = (ARGV[0] || 8).to_i
+size = (ARGV[1] || 2048).to_i
+runs = 10
+
+ops = Waah::Commands
+buf = ''
+2000.times do |i|
+  x = (i * 7919) % size
+  y = (i * 104729) % size
+  r = 8 + (i * 31) % 120
+  buf << ops::COLOR.chr << [(i * 53) % 256, (i * 97) % 256, (i * 193) % 256, 0.6].pack('f*')
+  buf << ops::CIRCLE.chr << [x, y, r].pack('f*') << ops::FILL_PRESERVE.chr
+  buf << ops::COLOR.chr << [0, 0, 0, 1].pack('f*')
+  buf << ops::LINE_WIDTH.chr << [2].pack('f') << ops::STROKE.chr
+end
+
+c = Waah::Canvas.new size, size
+serial = nil
+(1..max_threads).each do |n|
+  before = Waah::Commands.stats[:fallbacks]
+  t = bench("#{size}x#{size}, threads: #{n}", runs) { c.execute buf, threads: n }
+  serial ||= t
+  fallback = Waah::Commands.stats[:fallbacks] > before ? ' (ran serially)' : ''
+  puts "%-40s %8.2fx#{fallback}" % ['', serial / t]
+end
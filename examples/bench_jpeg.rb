@@ -0,0 +1,24 @@
+# Measures how fast JPEGs are decoded. Build mruby with the gem before and
+# after a change to the decoder and run this with both to compare, e.g.
+#
+#   bin/mruby examples/bench_jpeg.rb test/bg.jpg large_photo.jpg
+
+def bench(name, runs)
+  runs.times { yield } # warm up
+  start = Time.now
+  runs.times { yield }
+  elapsed = Time.now - start
+  puts "%-40s %8.3f ms/run" % [name, elapsed * 1000.0 / runs]
+  elapsed / runs
+end
+
+files = ARGV.empty? ? ['test/bg.jpg'] : ARGV
+
+files.each do |file|
+  img = Waah::Image.load file
+  pixels = img.width * img.height
+  runs = [2, 20_000_000 / pixels].max
+
+  t = bench("#{file} (#{img.width}x#{img.height})", runs) { Waah::Image.load file }
+  puts "%-40s %8.1f Mpixel/s" % ['', pixels / t / 1_000_000.0]
+end
@@ -0,0 +1,51 @@
+# Measures how fast short labels are drawn: as a path with #text and #fill,
+# directly with #draw_text, and from a shaped Waah::TextRun, e.g.
+#
+#   bin/mruby examples/bench_text.rb [font file]
+
+def bench(name, runs)
+  runs.times { yield } # warm up
+  start = Time.now
+  runs.times { yield }
+  elapsed = Time.now - start
+  puts "%-40s %8.3f ms/run" % [name, elapsed * 1000.0 / runs]
+  elapsed / runs
+end
+
+font = Waah::Font.load(ARGV[0] || 'test/Tuffy.ttf')
+labels = Array.new(100) { |i| "Label number #{i}" }
+runs = 50
+
+c = Waah::Canvas.new 800, 600
+c.font font
+c.font_size 14.0
+c.color 0, 0, 0
+
+path = bench('text + fill', runs) do
+  labels.each_with_index do |label, i|
+    c.text 10.0, 6.0 * i, label
+    c.fill
+  end
+end
+
+direct = bench('draw_text', runs) do
+  labels.each_with_index do |label, i|
+    c.draw_text 10.0, 6.0 * i, label
+  end
+end
+
+text_runs = labels.map { |label| Waah::TextRun.new font, 14.0, label }
+shaped = bench('text_run (shaped once)', runs) do
+  text_runs.each_with_index do |run, i|
+    c.text_run run, 10.0, 6.0 * i
+  end
+end
+
+cached = bench('TextRun.new + text_run (cached)', runs) do
+  labels.each_with_index do |label, i|
+    c.text_run Waah::TextRun.new(font, 14.0, label), 10.0, 6.0 * i
+  end
+end
+
+puts "draw_text is %.1fx, text_run %.1fx, cached runs %.1fx as fast as text + fill" %
+     [path / direct, path / shaped, path / cached]
@@ -4,35 +4,161 @@
 #include <cairo/cairo-ft.h>
 
 
+/* Read-only view of a file mapped into memory */
+typedef struct waah_file_map_s {
+  unsigned char *data;
+  size_t len;
+} waah_file_map_t;
+
+struct waah_image_s;
+typedef struct waah_image_cache_s waah_image_cache_t;
+
 typedef struct waah_canvas_s {
   cairo_t *cr;
   cairo_surface_t *surface;
   int width;
   int height;
   void (*free_func)(mrb_state *, void *ptr);
+  /* Snapshots still sharing surface (see _waah_canvas_detach_snapshots) */
+  struct waah_image_s *snapshots;
 } waah_canvas_t;
 
 typedef struct waah_image_s {
-  unsigned char *data;
+  /* Pixels decoded by the loaders are owned by the surface, as Pixels
+   * views may keep it beyond the image */
   cairo_surface_t *surface;
+  /* Set while surface is shared with a canvas, links all snapshots of it */
+  waah_canvas_t *snapshot_of;
+  struct waah_image_s *snapshot_prev;
+  struct waah_image_s *snapshot_next;
+  /* Optional size limits (0 = unlimited); loaders may use them to decode
+   * at reduced resolution */
+  int max_width;
+  int max_height;
+  /* Set for grayscale images, whose A8 surface holds luminance rather
+   * than alpha */
+  int gray;
+  waah_file_map_t map;
+  /* Lazy images keep only their encoded data (map or a private copy in
+   * encoded) and are decoded on use. Decoded ones are linked into the
+   * interpreter's cache, which may drop their pixels again. */
+  waah_image_cache_t *cache;
+  struct waah_image_s *lru_prev;
+  struct waah_image_s *lru_next;
+  size_t cached_bytes;
+  unsigned char *encoded;
+  size_t encoded_len;
+  int width;
+  int height;
 } waah_image_t;
 
+typedef struct waah_ft_lib_s waah_ft_lib_t;
+typedef struct waah_face_s waah_face_t;
+
 typedef struct waah_font_s {
   FT_Face ft_face;
+  /* Library ft_face belongs to */
+  waah_ft_lib_t *ft_lib;
+  /* Shared face of a file or pattern, owns ft_face if set */
+  waah_face_t *face;
   cairo_font_face_t *cr_face;
+  /* Backing memory of ft_face if loaded from a file */
+  waah_file_map_t map;
 #ifdef CAIRO_HAS_FC_FONT
   FcPattern *fc_pattern;
 #endif
 } waah_font_t;
 
 typedef struct waah_path_s {
+  /* Path data, built from cr on demand */
   cairo_path_t *cr_path;
+  /* Scratch context the path is constructed in */
+  cairo_t *cr;
 } waah_path_t;
 
+/* View of the pixel data of a canvas or image surface */
+typedef struct waah_pixels_s {
+  cairo_surface_t *surface;
+} waah_pixels_t;
+
 typedef struct waah_pattern_s {
   cairo_pattern_t *cr_pattern;
 } waah_pattern_t;
 
+/* Drawing recorded once for replay (see Picture.record) */
+typedef struct waah_picture_s {
+  cairo_surface_t *surface;
+  double width;
+  double height;
+} waah_picture_t;
+
+/* Glyphs of a string, shaped once for a font face and size (see TextRun).
+ * Shared by TextRun objects and the shaping cache of the interpreter. */
+typedef struct waah_text_run_s {
+  cairo_font_face_t *face;
+  cairo_glyph_t *glyphs;
+  int n_glyphs;
+  cairo_text_extents_t extents;
+  char *text;
+  size_t text_len;
+  double size;
+  int refs;
+} waah_text_run_t;
+
+/* Opcodes of the binary command buffer run by Canvas#execute. Each opcode
+ * is one byte, followed by its operands: f = float (32 bit IEEE 754),
+ * b = byte, i = index into the resources array (uint32),
+ * s = uint32 length and that many bytes, the last of which is NUL.
+ * All multibyte values are little endian. */
+enum waah_op {
+  WAAH_OP_NOP = 0x00,             /* */
+  WAAH_OP_MOVE_TO = 0x01,         /* f x, f y */
+  WAAH_OP_REL_MOVE_TO = 0x02,     /* f dx, f dy */
+  WAAH_OP_LINE_TO = 0x03,         /* f x, f y */
+  WAAH_OP_REL_LINE_TO = 0x04,     /* f dx, f dy */
+  WAAH_OP_HLINE_TO = 0x05,        /* f x */
+  WAAH_OP_REL_HLINE_TO = 0x06,    /* f dx */
+  WAAH_OP_VLINE_TO = 0x07,        /* f y */
+  WAAH_OP_REL_VLINE_TO = 0x08,    /* f dy */
+  WAAH_OP_CURVE_TO = 0x09,        /* f x1, f y1, f x2, f y2, f x3, f y3 */
+  WAAH_OP_REL_CURVE_TO = 0x0a,    /* f dx1, f dy1, f dx2, f dy2, f dx3, f dy3 */
+  WAAH_OP_ARC = 0x0b,             /* f cx, f cy, f r, f angle1, f angle2 */
+  WAAH_OP_ARC_NEGATIVE = 0x0c,    /* f cx, f cy, f r, f angle1, f angle2 */
+  WAAH_OP_CLOSE_PATH = 0x0d,      /* */
+  WAAH_OP_NEW_PATH = 0x0e,        /* */
+  WAAH_OP_RECT = 0x0f,            /* f x, f y, f w, f h */
+  WAAH_OP_CIRCLE = 0x10,          /* f cx, f cy, f r */
+  WAAH_OP_ELLIPSE = 0x11,         /* f cx, f cy, f w, f h */
+  WAAH_OP_ROUNDED_RECT = 0x12,    /* f x, f y, f w, f h, f r */
+  WAAH_OP_PATH = 0x13,            /* i Path */
+  WAAH_OP_TEXT = 0x14,            /* f x, f y, s text */
+
+  WAAH_OP_COLOR = 0x20,           /* f r, f g, f b (0..255), f a (0..1) */
+  WAAH_OP_PATTERN = 0x21,         /* i Pattern */
+  WAAH_OP_IMAGE = 0x22,           /* i Image, f x, f y */
+  WAAH_OP_CANVAS = 0x23,          /* i Canvas, f x, f y */
+  WAAH_OP_LINE_WIDTH = 0x24,      /* f width */
+  WAAH_OP_LINE_CAP = 0x25,        /* b cairo_line_cap_t */
+  WAAH_OP_LINE_JOIN = 0x26,       /* b cairo_line_join_t */
+  WAAH_OP_FONT = 0x27,            /* i Font or String (family name) */
+  WAAH_OP_FONT_SIZE = 0x28,       /* f size */
+
+  WAAH_OP_TRANSLATE = 0x30,       /* f x, f y */
+  WAAH_OP_SCALE = 0x31,           /* f x, f y */
+  WAAH_OP_ROTATE = 0x32,          /* f angle */
+  WAAH_OP_PUSH = 0x33,            /* */
+  WAAH_OP_POP = 0x34,             /* */
+
+  WAAH_OP_FILL = 0x40,            /* */
+  WAAH_OP_FILL_PRESERVE = 0x41,   /* */
+  WAAH_OP_STROKE = 0x42,          /* */
+  WAAH_OP_STROKE_PRESERVE = 0x43, /* */
+  WAAH_OP_CLIP = 0x44,            /* */
+  WAAH_OP_CLIP_PRESERVE = 0x45,   /* */
+  WAAH_OP_CLEAR = 0x46,           /* */
+  WAAH_OP_PICTURE = 0x47,         /* i Picture, f x, f y */
+  WAAH_OP_DRAW_TEXT = 0x48        /* f x, f y, s text */
+};
 
 struct waah_img_buf {
   unsigned char *data;
@@ -47,8 +173,25 @@ _waah_image_load(mrb_state *mrb, mrb_value self, int (*png)(mrb_state *, waah_im
 int
 _waah_load_jpeg_from_file(mrb_state *mrb, waah_image_t *image, FILE *file);
 
+int
+_waah_load_jpeg_from_buffer(mrb_state *mrb, waah_image_t *image, unsigned char *data, size_t len);
+
+int
+_waah_load_image_from_buffer(mrb_state *mrb, waah_image_t *image, unsigned char *data, size_t len);
+
 int
 _waah_load_png_from_buffer(mrb_state *mrb, waah_image_t *image, unsigned char *data, size_t len);
 
+/* Must be called before drawing to canvas->surface. Snapshots share the
+ * canvas' pixels until then and get their own copy here. */
+void
+_waah_canvas_detach_snapshots(waah_canvas_t *canvas);
+
+int
+_waah_file_map(const char *filename, waah_file_map_t *map);
+
+void
+_waah_file_unmap(waah_file_map_t *map);
+
 int
 _waah_font_load_from_buffer(mrb_state *mrb, waah_font_t *font, unsigned char *data, size_t len);
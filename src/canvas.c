@@ -5,6 +5,8 @@
 #include <mruby/value.h>
 #include <mruby/variable.h>
 #include <mruby/string.h>
+#include <mruby/hash.h>
+#include <mruby/error.h>
 
 #include "waah-canvas.h"
 
@@ -14,37 +16,880 @@
 #include <math.h>
 #include <time.h>
 #include <assert.h>
+#include <setjmp.h>
+#include <stdint.h>
 #include <jpeglib.h>
+#include <jerror.h>
+#include <png.h>
+#include <zlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#define WAAH_HAVE_THREADS
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <cairo.h>
 #include <cairo/cairo-ft.h>
+#include FT_ADVANCES_H
+
+#ifdef WAAH_HAVE_HARFBUZZ
+#include <hb.h>
+#include <hb-ft.h>
+#endif
 
-static mrb_sym id_instance_eval;
-static mrb_sym id_normal;
-static mrb_sym id_italic;
-static mrb_sym id_oblique;
-static mrb_sym id_bold;
-static mrb_sym id_round;
-static mrb_sym id_butt;
-static mrb_sym id_square;
-static mrb_sym id_miter;
-static mrb_sym id_bevel;
 
+/* Classes of the most recently initialized interpreter, kept for
+ * embedders. Internally, classes are looked up through waah_state(). */
 struct RClass *mWaah;
 struct RClass *cCanvas;
 struct RClass *cImage;
 struct RClass *cFont;
 struct RClass *cPath;
 struct RClass *cPattern;
-
-static FT_Library ft_lib;
+struct RClass *cPixels;
+struct RClass *cPicture;
+struct RClass *cFuture;
+struct RClass *cTextRun;
+struct RClass *mCommands;
+
+#define WAAH_SYMBOLS(X) \
+  X(instance_eval) \
+  X(normal) \
+  X(italic) \
+  X(oblique) \
+  X(bold) \
+  X(round) \
+  X(butt) \
+  X(square) \
+  X(miter) \
+  X(bevel) \
+  X(max_width) \
+  X(max_height) \
+  X(level) \
+  X(filter) \
+  X(strategy) \
+  X(fast) \
+  X(none) \
+  X(sub) \
+  X(up) \
+  X(avg) \
+  X(paeth) \
+  X(all) \
+  X(default) \
+  X(filtered) \
+  X(huffman) \
+  X(rle) \
+  X(fixed) \
+  X(quality) \
+  X(subsampling) \
+  X(progressive) \
+  X(png) \
+  X(jpeg) \
+  X(format) \
+  X(limit) \
+  X(bytes) \
+  X(buffers) \
+  X(hits) \
+  X(misses) \
+  X(discarded) \
+  X(argb32) \
+  X(rgb24) \
+  X(a8) \
+  X(a1) \
+  X(rgb16_565) \
+  X(rgb30) \
+  X(double) \
+  X(fill) \
+  X(stroke) \
+  X(each) \
+  X(close) \
+  X(threads) \
+  X(parallel) \
+  X(fallbacks) \
+  X(lazy) \
+  X(images) \
+  X(evictions) \
+  X(family) \
+  X(style) \
+  X(lang) \
+  X(runs) \
+  X(antialias) \
+  X(hinting) \
+  X(hint_metrics) \
+  X(gray) \
+  X(subpixel) \
+  X(good) \
+  X(best) \
+  X(slight) \
+  X(medium) \
+  X(full) \
+  X(align) \
+  X(left) \
+  X(center) \
+  X(right) \
+  X(line_height) \
+  X(ellipsis)
+
+#define FACE_BUCKETS 64
+
+/* FreeType objects must not be used from several threads at once, so every
+ * interpreter has a library of its own, along with the faces opened in it
+ * (see face_from_file). Fonts keep it alive, since mrb_close may free them
+ * after the interpreter's state. */
+struct waah_ft_lib_s {
+  FT_Library lib;
+  waah_face_t *faces[FACE_BUCKETS];
+  int refs;
+};
+
+/* Decoded lazy images of an interpreter, most recently used first. Once
+ * they take more than limit bytes the least recently used are evicted.
+ * Kept alive by the images like the FreeType library by fonts. */
+struct waah_image_cache_s {
+  waah_image_t *head;
+  waah_image_t *tail;
+  size_t limit;
+  size_t bytes;
+  size_t images;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  int refs;
+};
+
+#define IMAGE_CACHE_DEFAULT_LIMIT (64 * 1024 * 1024)
+
+/* TextRuns shaped by an interpreter, by font face, size and text. The
+ * least recently used are dropped once there are more than
+ * TEXT_CACHE_MAX. */
+#define TEXT_CACHE_BUCKETS 256
+#define TEXT_CACHE_MAX 1024
+
+struct text_cache_entry {
+  waah_text_run_t *run;
+  unsigned int hash;
+  struct text_cache_entry *next;
+  struct text_cache_entry *lru_prev;
+  struct text_cache_entry *lru_next;
+};
+
+typedef struct text_cache_s {
+  struct text_cache_entry *buckets[TEXT_CACHE_BUCKETS];
+  struct text_cache_entry *head;
+  struct text_cache_entry *tail;
+  size_t runs;
+  unsigned long hits;
+  unsigned long misses;
+} text_cache_t;
+
+/* Symbols and classes are specific to an interpreter, so they cannot be
+ * shared through globals */
+typedef struct waah_state_s {
+  waah_ft_lib_t *ft_lib;
+  waah_image_cache_t *image_cache;
+  text_cache_t text_cache;
+  /* Canvas#execute calls with threads: > 1 that ran in bands, and those
+   * that had to run serially */
+  unsigned long parallel_runs;
+  unsigned long parallel_fallbacks;
+  struct RClass *mWaah;
+  struct RClass *cCanvas;
+  struct RClass *cImage;
+  struct RClass *cFont;
+  struct RClass *cPath;
+  struct RClass *cPattern;
+  struct RClass *cPixels;
+  struct RClass *cPicture;
+  struct RClass *cFuture;
+  struct RClass *cTextRun;
+  struct RClass *mCommands;
+#define X(name) mrb_sym id_##name;
+  WAAH_SYMBOLS(X)
+#undef X
+} waah_state_t;
+
+/* Bumped whenever an interpreter is closed, as another one may be opened
+ * at the same address afterwards */
+static volatile unsigned long state_epoch = 1;
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+/* Serializes fontconfig calls, which older versions of it require */
+#ifdef WAAH_HAVE_THREADS
+static pthread_mutex_t fc_lock = PTHREAD_MUTEX_INITIALIZER;
+#define FC_LOCK() pthread_mutex_lock(&fc_lock)
+#define FC_UNLOCK() pthread_mutex_unlock(&fc_lock)
+#else
+#define FC_LOCK()
+#define FC_UNLOCK()
+#endif
+
+/* Serializes opening and closing faces, and with them the references on
+ * their libraries. FreeType requires this per library, and cairo may drop
+ * the last reference on a face from any thread. */
+#ifdef WAAH_HAVE_THREADS
+static pthread_mutex_t ft_lock = PTHREAD_MUTEX_INITIALIZER;
+#define FT_LOCK() pthread_mutex_lock(&ft_lock)
+#define FT_UNLOCK() pthread_mutex_unlock(&ft_lock)
+#else
+#define FT_LOCK()
+#define FT_UNLOCK()
+#endif
+
+static waah_ft_lib_t *
+ft_lib_ref(waah_ft_lib_t *ft_lib) {
+  FT_LOCK();
+  ft_lib->refs++;
+  FT_UNLOCK();
+  return ft_lib;
+}
+
+static void
+ft_lib_unref(waah_ft_lib_t *ft_lib) {
+  int unused;
+
+  FT_LOCK();
+  unused = --ft_lib->refs == 0;
+  FT_UNLOCK();
+  if(unused) {
+    FT_Done_FreeType(ft_lib->lib);
+    free(ft_lib);
+  }
+}
+
+static void
+text_run_unref(mrb_state *mrb, waah_text_run_t *run) {
+  if(--run->refs == 0) {
+    cairo_glyph_free(run->glyphs);
+    if(run->face != NULL) {
+      cairo_font_face_destroy(run->face);
+    }
+    mrb_free(mrb, run->text);
+    mrb_free(mrb, run);
+  }
+}
+
+static void
+state_free(mrb_state *mrb, void *ptr) {
+  waah_state_t *state = (waah_state_t *) ptr;
+  struct text_cache_entry *entry, *next;
+
+  for(entry = state->text_cache.head; entry != NULL; entry = next) {
+    next = entry->lru_next;
+    text_run_unref(mrb, entry->run);
+    free(entry);
+  }
+
+  if(state->ft_lib != NULL) {
+    ft_lib_unref(state->ft_lib);
+  }
+  if(state->image_cache != NULL && --state->image_cache->refs == 0) {
+    free(state->image_cache);
+  }
+  mrb_free(mrb, ptr);
+}
+
+/* Faces of font files and fontconfig patterns, shared by the fonts of an
+ * interpreter. Loading a font again gives the same FT_Face and cairo face,
+ * so cairo's glyph caches stay warm. Faces stay with the library of their
+ * interpreter, only the mapped contents of font files are shared by all
+ * interpreters. */
+
+/* Identifies a font file, including its version */
+typedef struct face_file_id_s {
+#ifdef _WIN32
+  char path[MAX_PATH];
+#else
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+#endif
+} face_file_id_t;
+
+/* A mapped font file, read by the faces of any number of libraries */
+typedef struct font_file_s {
+  face_file_id_t id;
+  unsigned int bucket;
+  waah_file_map_t map;
+  int refs;
+  struct font_file_s *next;
+} font_file_t;
+
+struct waah_face_s {
+  /* Key, the file or (if set) the pattern the face was created for */
+  face_file_id_t file;
+#ifdef CAIRO_HAS_FC_FONT
+  FcPattern *fc_pattern;
+  FcChar32 fc_hash;
+#endif
+  unsigned int bucket;
+  /* Only for faces of files, which are opened in ft_lib */
+  font_file_t *data;
+  waah_ft_lib_t *ft_lib;
+  FT_Face ft_face;
+  cairo_font_face_t *cr_face;
+  int refs;
+  struct waah_face_s *next;
+};
+
+static font_file_t *font_files[FACE_BUCKETS];
+
+#ifdef WAAH_HAVE_THREADS
+static pthread_mutex_t font_file_lock = PTHREAD_MUTEX_INITIALIZER;
+#define FONT_FILE_LOCK() pthread_mutex_lock(&font_file_lock)
+#define FONT_FILE_UNLOCK() pthread_mutex_unlock(&font_file_lock)
+#else
+#define FONT_FILE_LOCK()
+#define FONT_FILE_UNLOCK()
+#endif
+
+static cairo_user_data_key_t face_key;
+
+static int
+face_file_id(const char *filename, face_file_id_t *id) {
+  memset(id, 0, sizeof(face_file_id_t));
+#ifdef _WIN32
+  DWORD len = GetFullPathNameA(filename, MAX_PATH, id->path, NULL);
+  return len > 0 && len < MAX_PATH;
+#else
+  struct stat st;
+
+  if(stat(filename, &st) != 0) {
+    return FALSE;
+  }
+  id->dev = st.st_dev;
+  id->ino = st.st_ino;
+  id->size = st.st_size;
+  id->mtime = st.st_mtime;
+  return TRUE;
+#endif
+}
+
+static unsigned int
+face_file_bucket(face_file_id_t *id) {
+#ifdef _WIN32
+  unsigned int hash = 5381;
+  const char *c;
+
+  for(c = id->path; *c != '\0'; c++) {
+    hash = hash * 33 + (unsigned char) tolower(*c);
+  }
+  return hash % FACE_BUCKETS;
+#else
+  return (unsigned int) (id->ino ^ id->dev) % FACE_BUCKETS;
+#endif
+}
+
+/* Returns a new reference to the mapped file with the given id. Must be
+ * called with font_file_lock held. */
+static font_file_t *
+font_file_find(face_file_id_t *id, unsigned int bucket) {
+  font_file_t *file;
+
+  for(file = font_files[bucket]; file != NULL; file = file->next) {
+    if(memcmp(&file->id, id, sizeof(face_file_id_t)) == 0) {
+      file->refs++;
+      return file;
+    }
+  }
+  return NULL;
+}
+
+/* Returns a reference to the mapped contents of a font file, NULL if it
+ * cannot be mapped */
+static font_file_t *
+font_file_open(const char *filename, face_file_id_t *id, unsigned int bucket) {
+  font_file_t *file, *found;
+
+  FONT_FILE_LOCK();
+  file = font_file_find(id, bucket);
+  FONT_FILE_UNLOCK();
+  if(file != NULL) {
+    return file;
+  }
+
+  file = (font_file_t *) malloc(sizeof(font_file_t));
+  if(file == NULL) {
+    return NULL;
+  }
+  file->id = *id;
+  file->bucket = bucket;
+  file->refs = 1;
+  if(!_waah_file_map(filename, &file->map)) {
+    free(file);
+    return NULL;
+  }
+
+  /* Another thread may have mapped it meanwhile */
+  FONT_FILE_LOCK();
+  found = font_file_find(id, bucket);
+  if(found == NULL) {
+    file->next = font_files[bucket];
+    font_files[bucket] = file;
+  }
+  FONT_FILE_UNLOCK();
+
+  if(found != NULL) {
+    _waah_file_unmap(&file->map);
+    free(file);
+    return found;
+  }
+  return file;
+}
+
+static void
+font_file_unref(font_file_t *file) {
+  font_file_t **p;
+  int unused;
+
+  FONT_FILE_LOCK();
+  unused = --file->refs == 0;
+  if(unused) {
+    for(p = &font_files[file->bucket]; *p != file; p = &(*p)->next);
+    *p = file->next;
+  }
+  FONT_FILE_UNLOCK();
+
+  if(unused) {
+    _waah_file_unmap(&file->map);
+    free(file);
+  }
+}
+
+static int
+face_equal(waah_face_t *a, waah_face_t *b) {
+#ifdef CAIRO_HAS_FC_FONT
+  if(a->fc_pattern != NULL || b->fc_pattern != NULL) {
+    int equal;
+
+    if(a->fc_pattern == NULL || b->fc_pattern == NULL || a->fc_hash != b->fc_hash) {
+      return FALSE;
+    }
+    FC_LOCK();
+    equal = FcPatternEqual(a->fc_pattern, b->fc_pattern);
+    FC_UNLOCK();
+    return equal;
+  }
+#endif
+  return memcmp(&a->file, &b->file, sizeof(face_file_id_t)) == 0;
+}
+
+/* Returns a new reference to the face equal to key, if any */
+static waah_face_t *
+face_find(waah_ft_lib_t *ft_lib, waah_face_t *key) {
+  waah_face_t *face;
+
+  for(face = ft_lib->faces[key->bucket]; face != NULL; face = face->next) {
+    if(face_equal(face, key)) {
+      face->refs++;
+      return face;
+    }
+  }
+  return NULL;
+}
+
+static void
+face_insert(waah_ft_lib_t *ft_lib, waah_face_t *face) {
+  face->next = ft_lib->faces[face->bucket];
+  ft_lib->faces[face->bucket] = face;
+}
+
+/* Destroy hook of the cairo faces of files, which may outlive their
+ * registry entry in cairo's font caches. May run on any thread. */
+static void
+face_destroy(void *data) {
+  waah_face_t *face = (waah_face_t *) data;
+
+  FT_LOCK();
+  FT_Done_Face(face->ft_face);
+  FT_UNLOCK();
+  font_file_unref(face->data);
+  ft_lib_unref(face->ft_lib);
+  free(face);
+}
+
+static void
+face_unref(waah_face_t *face) {
+  waah_face_t **p;
+
+  if(--face->refs > 0) {
+    return;
+  }
+  for(p = &face->ft_lib->faces[face->bucket]; *p != face; p = &(*p)->next);
+  *p = face->next;
+
+#ifdef CAIRO_HAS_FC_FONT
+  if(face->fc_pattern != NULL) {
+    cairo_font_face_destroy(face->cr_face);
+    FC_LOCK();
+    FcPatternDestroy(face->fc_pattern);
+    FC_UNLOCK();
+    free(face);
+    return;
+  }
+#endif
+  /* Calls face_destroy once cairo is done with it */
+  cairo_font_face_destroy(face->cr_face);
+}
+
+/* Returns a reference to the face of a font file in ft_lib, NULL if it
+ * cannot be loaded */
+static waah_face_t *
+face_from_file(waah_ft_lib_t *ft_lib, const char *filename) {
+  waah_face_t key, *face;
+  FT_Open_Args args;
+  int ok;
+
+  memset(&key, 0, sizeof(waah_face_t));
+  if(!face_file_id(filename, &key.file)) {
+    return NULL;
+  }
+  key.bucket = face_file_bucket(&key.file);
+
+  face = face_find(ft_lib, &key);
+  if(face != NULL) {
+    return face;
+  }
+
+  face = (waah_face_t *) malloc(sizeof(waah_face_t));
+  if(face == NULL) {
+    return NULL;
+  }
+  *face = key;
+  face->refs = 1;
+
+  /* FreeType reads the face from the mapping for as long as it lives */
+  face->data = font_file_open(filename, &key.file, key.bucket);
+  if(face->data == NULL) {
+    free(face);
+    return NULL;
+  }
+
+  args.flags = FT_OPEN_MEMORY;
+  args.memory_base = face->data->map.data;
+  args.memory_size = face->data->map.len;
+  FT_LOCK();
+  ok = FT_Open_Face(ft_lib->lib, &args, 0, &face->ft_face) == FT_Err_Ok;
+  FT_UNLOCK();
+  if(!ok) {
+    font_file_unref(face->data);
+    free(face);
+    return NULL;
+  }
+  face->ft_lib = ft_lib_ref(ft_lib);
+
+  face->cr_face = cairo_ft_font_face_create_for_ft_face(face->ft_face, 0);
+  if(cairo_font_face_set_user_data(face->cr_face, &face_key, face, face_destroy) != CAIRO_STATUS_SUCCESS) {
+    cairo_font_face_destroy(face->cr_face);
+    face_destroy(face);
+    return NULL;
+  }
+
+  face_insert(ft_lib, face);
+  return face;
+}
+
+#ifdef CAIRO_HAS_FC_FONT
+/* Returns a reference to the face of a (matched or listed) pattern. These
+ * are opened by cairo, in a library of its own. */
+static waah_face_t *
+face_from_pattern(waah_ft_lib_t *ft_lib, FcPattern *pattern) {
+  waah_face_t key, *face;
+
+  memset(&key, 0, sizeof(waah_face_t));
+  key.fc_pattern = pattern;
+  FC_LOCK();
+  key.fc_hash = FcPatternHash(pattern);
+  FC_UNLOCK();
+  key.bucket = key.fc_hash % FACE_BUCKETS;
+
+  face = face_find(ft_lib, &key);
+  if(face != NULL) {
+    return face;
+  }
+
+  face = (waah_face_t *) malloc(sizeof(waah_face_t));
+  if(face == NULL) {
+    return NULL;
+  }
+  *face = key;
+  face->refs = 1;
+  face->ft_lib = ft_lib;
+
+  FC_LOCK();
+  FcPatternReference(pattern);
+  face->cr_face = cairo_ft_font_face_create_for_pattern(pattern);
+  FC_UNLOCK();
+
+  face_insert(ft_lib, face);
+  return face;
+}
+#endif
+
+static void
+snapshot_unlink(waah_image_t *image) {
+  if(image->snapshot_prev != NULL) {
+    image->snapshot_prev->snapshot_next = image->snapshot_next;
+  } else if(image->snapshot_of != NULL) {
+    image->snapshot_of->snapshots = image->snapshot_next;
+  }
+  if(image->snapshot_next != NULL) {
+    image->snapshot_next->snapshot_prev = image->snapshot_prev;
+  }
+  image->snapshot_of = NULL;
+  image->snapshot_prev = NULL;
+  image->snapshot_next = NULL;
+}
+
+/* Returns a copy of an image surface with pixels of its own. The stride of
+ * surface may be larger than cairo's (e.g. framebuffers). */
+static cairo_surface_t *
+surface_copy(cairo_surface_t *surface) {
+  cairo_surface_t *copy;
+  unsigned char *src, *dst;
+  int src_stride, dst_stride, row_len, y;
+  int height = cairo_image_surface_get_height(surface);
+
+  cairo_surface_flush(surface);
+  copy = cairo_image_surface_create(cairo_image_surface_get_format(surface),
+                                    cairo_image_surface_get_width(surface), height);
+  src = cairo_image_surface_get_data(surface);
+  dst = cairo_image_surface_get_data(copy);
+  src_stride = cairo_image_surface_get_stride(surface);
+  dst_stride = cairo_image_surface_get_stride(copy);
+  row_len = MIN(src_stride, dst_stride);
+
+  if(src != NULL && dst != NULL) {
+    for(y = 0; y < height; y++) {
+      memcpy(dst + (size_t) y * dst_stride, src + (size_t) y * src_stride, row_len);
+    }
+    cairo_surface_mark_dirty(copy);
+  }
+
+  return copy;
+}
+
+/* Returns a copy of an image surface converted to format. Alpha is dropped
+ * by compositing over black. */
+static cairo_surface_t *
+surface_convert(cairo_surface_t *surface, cairo_format_t format) {
+  cairo_surface_t *converted;
+  cairo_t *cr;
+
+  converted = cairo_image_surface_create(format,
+                                         cairo_image_surface_get_width(surface),
+                                         cairo_image_surface_get_height(surface));
+  cr = cairo_create(converted);
+  cairo_set_source_surface(cr, surface, 0, 0);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_paint(cr);
+  cairo_destroy(cr);
+  cairo_surface_flush(converted);
+
+  return converted;
+}
+
+void
+_waah_canvas_detach_snapshots(waah_canvas_t *canvas) {
+  cairo_surface_t *copy;
+
+  if(canvas->snapshots == NULL) {
+    return;
+  }
+
+  copy = surface_copy(canvas->surface);
+
+  /* All snapshots taken since the last draw share the same pixels */
+  while(canvas->snapshots != NULL) {
+    waah_image_t *image = canvas->snapshots;
+    cairo_surface_destroy(image->surface);
+    image->surface = cairo_surface_reference(copy);
+    snapshot_unlink(image);
+  }
+
+  cairo_surface_destroy(copy);
+}
+
+/* Pixel buffers of canvases, kept for reuse after the canvas is gone.
+ * Buffers are bucketed by size (four buckets per power of two), so one
+ * fits any canvas up to its size. A buffer is returned to the pool only
+ * when the last surface using it is destroyed, which may be a snapshot
+ * outliving its canvas. The pool is shared by all interpreters. */
+#define POOL_MIN_SIZE (64 * 1024)
+#define POOL_N_BUCKETS 64
+#define POOL_DEFAULT_LIMIT (64 * 1024 * 1024)
+/* Keeps the pixels following the header 16 byte aligned */
+#define POOL_HEADER_SIZE 32
+
+struct pool_buffer {
+  struct pool_buffer *next;
+  size_t size;
+};
+
+#define POOL_DATA(buf) ((unsigned char *) (buf) + POOL_HEADER_SIZE)
+
+static struct {
+  struct pool_buffer *buckets[POOL_N_BUCKETS];
+  /* Maximum size of the idle buffers */
+  size_t limit;
+  size_t bytes;
+  size_t buffers;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long discarded;
+} surface_pool = {{NULL}, POOL_DEFAULT_LIMIT, 0, 0, 0, 0, 0};
+
+#ifdef WAAH_HAVE_THREADS
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#define POOL_LOCK() pthread_mutex_lock(&pool_lock)
+#define POOL_UNLOCK() pthread_mutex_unlock(&pool_lock)
+#else
+#define POOL_LOCK()
+#define POOL_UNLOCK()
+#endif
+
+static cairo_user_data_key_t pool_key;
+
+static size_t
+pool_bucket_size(int bucket) {
+  return ((size_t) POOL_MIN_SIZE << (bucket / 4)) / 4 * (4 + bucket % 4);
+}
+
+/* Smallest bucket holding size bytes, -1 if it is too large for the pool */
+static int
+pool_bucket(size_t size) {
+  int bucket;
+  for(bucket = 0; bucket < POOL_N_BUCKETS; bucket++) {
+    if(pool_bucket_size(bucket) >= size) {
+      return bucket;
+    }
+  }
+  return -1;
+}
+
+/* Frees idle buffers, largest first, until they fit into limit. Must be
+ * called with the pool locked. */
+static void
+pool_trim(size_t limit) {
+  int bucket;
+  for(bucket = POOL_N_BUCKETS - 1; bucket >= 0 && surface_pool.bytes > limit; bucket--) {
+    while(surface_pool.buckets[bucket] != NULL && surface_pool.bytes > limit) {
+      struct pool_buffer *buf = surface_pool.buckets[bucket];
+      surface_pool.buckets[bucket] = buf->next;
+      surface_pool.bytes -= buf->size;
+      surface_pool.buffers--;
+      free(buf);
+    }
+  }
+}
+
+static struct pool_buffer *
+pool_acquire(size_t size) {
+  int bucket = pool_bucket(size);
+  struct pool_buffer *buf = NULL;
+
+  if(bucket < 0) {
+    return NULL;
+  }
+
+  POOL_LOCK();
+  if(surface_pool.limit == 0) {
+    POOL_UNLOCK();
+    return NULL;
+  }
+  if(surface_pool.buckets[bucket] != NULL) {
+    buf = surface_pool.buckets[bucket];
+    surface_pool.buckets[bucket] = buf->next;
+    surface_pool.bytes -= buf->size;
+    surface_pool.buffers--;
+    surface_pool.hits++;
+  } else {
+    surface_pool.misses++;
+  }
+  POOL_UNLOCK();
+
+  if(buf == NULL) {
+    buf = (struct pool_buffer *) malloc(POOL_HEADER_SIZE + pool_bucket_size(bucket));
+    if(buf != NULL) {
+      buf->size = pool_bucket_size(bucket);
+    }
+  }
+
+  return buf;
+}
+
+/* Destroy callback of pooled surfaces */
+static void
+pool_release(void *data) {
+  struct pool_buffer *buf = (struct pool_buffer *) data;
+
+  POOL_LOCK();
+  if(surface_pool.bytes + buf->size <= surface_pool.limit) {
+    int bucket = pool_bucket(buf->size);
+    buf->next = surface_pool.buckets[bucket];
+    surface_pool.buckets[bucket] = buf;
+    surface_pool.bytes += buf->size;
+    surface_pool.buffers++;
+    buf = NULL;
+  } else {
+    surface_pool.discarded++;
+  }
+  POOL_UNLOCK();
+
+  free(buf);
+}
+
+/* Like cairo_image_surface_create, but takes the pixels from the pool.
+ * Small surfaces are left to cairo. */
+static cairo_surface_t *
+surface_pool_create(cairo_format_t format, int width, int height) {
+  int stride = cairo_format_stride_for_width(format, width);
+  size_t size = (size_t) stride * height;
+  struct pool_buffer *buf;
+  cairo_surface_t *surface;
+
+  if(stride <= 0 || height <= 0 || size < POOL_MIN_SIZE || (buf = pool_acquire(size)) == NULL) {
+    return cairo_image_surface_create(format, width, height);
+  }
+
+  memset(POOL_DATA(buf), 0, size);
+  surface = cairo_image_surface_create_for_data(POOL_DATA(buf), format, width, height, stride);
+  if(cairo_surface_set_user_data(surface, &pool_key, buf, pool_release) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(surface);
+    pool_release(buf);
+    return cairo_image_surface_create(format, width, height);
+  }
+
+  return surface;
+}
 
 static void
 canvas_free(mrb_state *mrb, void *ptr) {
   waah_canvas_t *canvas = (waah_canvas_t *) ptr;
 
+  /* Snapshots keep their reference to the surface, nothing draws to it anymore */
+  while(canvas->snapshots != NULL) {
+    snapshot_unlink(canvas->snapshots);
+  }
+
   if(canvas->cr != NULL) {
     cairo_destroy(canvas->cr);
   }
@@ -61,15 +906,82 @@ canvas_free(mrb_state *mrb, void *ptr) {
 
 }
 
+static void
+image_cache_remove(waah_image_cache_t *cache, waah_image_t *image) {
+  if(image->lru_prev != NULL) {
+    image->lru_prev->lru_next = image->lru_next;
+  } else {
+    cache->head = image->lru_next;
+  }
+  if(image->lru_next != NULL) {
+    image->lru_next->lru_prev = image->lru_prev;
+  } else {
+    cache->tail = image->lru_prev;
+  }
+  image->lru_prev = NULL;
+  image->lru_next = NULL;
+}
+
+static void
+image_cache_push(waah_image_cache_t *cache, waah_image_t *image) {
+  image->lru_prev = NULL;
+  image->lru_next = cache->head;
+  if(cache->head != NULL) {
+    cache->head->lru_prev = image;
+  } else {
+    cache->tail = image;
+  }
+  cache->head = image;
+}
+
+/* Lazy images are in the cache exactly while they have a surface */
+static void
+image_cache_drop(mrb_state *mrb, waah_image_t *image) {
+  waah_image_cache_t *cache = image->cache;
+
+  image_cache_remove(cache, image);
+  cache->bytes -= image->cached_bytes;
+  cache->images--;
+  image->cached_bytes = 0;
+
+  cairo_surface_destroy(image->surface);
+  image->surface = NULL;
+}
+
+/* Evicts the least recently used images but keep until the cache fits
+ * into its limit. Surfaces referenced elsewhere, e.g. as the source of a
+ * canvas, are in use and stay. */
+static void
+image_cache_trim(mrb_state *mrb, waah_image_cache_t *cache, waah_image_t *keep) {
+  waah_image_t *image = cache->tail;
+
+  while(image != NULL && cache->bytes > cache->limit) {
+    waah_image_t *prev = image->lru_prev;
+    if(image != keep && cairo_surface_get_reference_count(image->surface) == 1) {
+      image_cache_drop(mrb, image);
+      cache->evictions++;
+    }
+    image = prev;
+  }
+}
+
 static void
 image_free(mrb_state *mrb, void *ptr) {
   waah_image_t *image = (waah_image_t *) ptr;
+  snapshot_unlink(image);
+  if(image->cache != NULL) {
+    if(image->surface != NULL) {
+      image_cache_drop(mrb, image);
+    }
+    if(--image->cache->refs == 0) {
+      free(image->cache);
+    }
+  }
   if(image->surface != NULL) {
     cairo_surface_destroy(image->surface);
   }
-  if(image->data != NULL) {
-    mrb_free(mrb, image->data);
-  }
+  free(image->encoded);
+  _waah_file_unmap(&image->map);
   mrb_free(mrb, ptr);
 }
 
@@ -80,13 +992,23 @@ font_free(mrb_state *mrb, void *ptr) {
   if(font->cr_face != NULL) {
     cairo_font_face_destroy(font->cr_face);
   }
-  if(font->ft_face != NULL) {
+  if(font->face != NULL) {
+    face_unref(font->face);
+  } else if(font->ft_face != NULL) {
+    FT_LOCK();
     FT_Done_Face(font->ft_face);
+    FT_UNLOCK();
   }
+  if(font->ft_lib != NULL) {
+    ft_lib_unref(font->ft_lib);
+  }
+  _waah_file_unmap(&font->map);
 
 #ifdef CAIRO_HAS_FC_FONT
   if(font->fc_pattern != NULL) {
+    FC_LOCK();
     FcPatternDestroy(font->fc_pattern);
+    FC_UNLOCK();
   }
 #endif
   mrb_free(mrb, ptr);
@@ -102,6 +1024,33 @@ pattern_free(mrb_state *mrb, void *ptr) {
   mrb_free(mrb, ptr);
 }
 
+static void
+pixels_free(mrb_state *mrb, void *ptr) {
+  waah_pixels_t *pixels = (waah_pixels_t *) ptr;
+
+  if(pixels->surface != NULL) {
+    cairo_surface_destroy(pixels->surface);
+  }
+  mrb_free(mrb, ptr);
+}
+
+static void
+picture_free(mrb_state *mrb, void *ptr) {
+  waah_picture_t *picture = (waah_picture_t *) ptr;
+
+  if(picture->surface != NULL) {
+    cairo_surface_destroy(picture->surface);
+  }
+  mrb_free(mrb, ptr);
+}
+
+static void
+text_run_free(mrb_state *mrb, void *ptr) {
+  if(ptr != NULL) {
+    text_run_unref(mrb, (waah_text_run_t *) ptr);
+  }
+}
+
 static void
 path_free(mrb_state *mrb, void *ptr) {
   waah_path_t *path = (waah_path_t *) ptr;
@@ -109,6 +1058,9 @@ path_free(mrb_state *mrb, void *ptr) {
   if(path->cr_path != NULL) {
     cairo_path_destroy(path->cr_path);
   }
+  if(path->cr != NULL) {
+    cairo_destroy(path->cr);
+  }
   mrb_free(mrb, ptr);
 }
 
@@ -120,15 +1072,54 @@ path_free(mrb_state *mrb, void *ptr) {
 
 #define CANVAS_DEFAULT_DECL_INITS \
   Data_Get_Struct(mrb, self, &_waah_canvas_type_info, canvas);\
-  cr = canvas->cr;
+  cr = canvas_cr(mrb, canvas);
+
+
 
+/* The canvas a Picture was recorded with has no context anymore */
+static cairo_t *
+canvas_cr(mrb_state *mrb, waah_canvas_t *canvas) {
+  if(canvas->cr == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "picture recording has finished");
+  }
+  return canvas->cr;
+}
 
+/* Path construction methods are shared by Canvas and Path */
+#define PATH_DEFAULT_DECLS \
+  cairo_t *cr;
+
+#define PATH_DEFAULT_DECL_INITS \
+  cr = path_target_cr(mrb, self);
 
 struct mrb_data_type _waah_canvas_type_info = {"Canvas", canvas_free};
 struct mrb_data_type _waah_image_type_info = {"Image", image_free};
 struct mrb_data_type _waah_font_type_info = {"Font", font_free};
 struct mrb_data_type _waah_pattern_type_info = {"Pattern", pattern_free};
 struct mrb_data_type _waah_path_type_info = {"Path", path_free};
+struct mrb_data_type _waah_pixels_type_info = {"Pixels", pixels_free};
+struct mrb_data_type _waah_picture_type_info = {"Picture", picture_free};
+struct mrb_data_type _waah_text_run_type_info = {"TextRun", text_run_free};
+static struct mrb_data_type _waah_state_type_info = {"WaahState", state_free};
+
+static waah_state_t *
+waah_state(mrb_state *mrb) {
+  /* Interpreters are mostly used from a single thread each */
+  static __thread mrb_state *cached_mrb;
+  static __thread waah_state_t *cached_state;
+  static __thread unsigned long cached_epoch;
+
+  if(cached_mrb != mrb || cached_epoch != state_epoch) {
+    mrb_value mod = mrb_obj_value(mrb_module_get(mrb, "Waah"));
+    mrb_value data = mrb_iv_get(mrb, mod, mrb_intern_lit(mrb, "__state__"));
+
+    cached_state = (waah_state_t *) mrb_data_get_ptr(mrb, data, &_waah_state_type_info);
+    cached_mrb = mrb;
+    cached_epoch = state_epoch;
+  }
+
+  return cached_state;
+}
 
 static int raise_cairo_status(mrb_state *mrb, cairo_status_t status) {
   switch(status) {
@@ -153,11 +1144,148 @@ static int raise_cairo_status(mrb_state *mrb, cairo_status_t status) {
   return TRUE;
 }
 
-
-static mrb_value
+/* Maps a file read-only, so that loaders read from the (shared) page cache
+ * instead of private buffers. Returns FALSE if the file cannot be mapped. */
+int
+_waah_file_map(const char *filename, waah_file_map_t *map) {
+#ifdef _WIN32
+  HANDLE file, mapping;
+  LARGE_INTEGER size;
+
+  file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(file == INVALID_HANDLE_VALUE) {
+    return FALSE;
+  }
+
+  if(!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return FALSE;
+  }
+
+  mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(file);
+  if(mapping == NULL) {
+    return FALSE;
+  }
+
+  /* The view keeps the mapping object alive */
+  map->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if(map->data == NULL) {
+    return FALSE;
+  }
+  map->len = (size_t) size.QuadPart;
+#else
+  struct stat st;
+  void *addr;
+  int fd = open(filename, O_RDONLY);
+
+  if(fd < 0) {
+    return FALSE;
+  }
+
+  if(fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return FALSE;
+  }
+
+  addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(addr == MAP_FAILED) {
+    return FALSE;
+  }
+
+  map->data = addr;
+  map->len = st.st_size;
+#endif
+  return TRUE;
+}
+
+void
+_waah_file_unmap(waah_file_map_t *map) {
+  if(map->data == NULL) {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(map->data);
+#else
+  munmap(map->data, map->len);
+#endif
+  map->data = NULL;
+  map->len = 0;
+}
+
+static mrb_int
+opt_int(mrb_state *mrb, mrb_value opts, mrb_sym key, mrb_int def) {
+  mrb_value val;
+
+  if(mrb_nil_p(opts)) {
+    return def;
+  }
+
+  val = mrb_hash_get(mrb, opts, mrb_symbol_value(key));
+  switch(mrb_type(val)) {
+    case MRB_TT_FIXNUM:
+      return mrb_fixnum(val);
+    case MRB_TT_FLOAT:
+      return (mrb_int) mrb_float(val);
+    default:
+      if(!mrb_nil_p(val)) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid %S option", mrb_symbol_value(key));
+      }
+      return def;
+  }
+}
+
+static mrb_sym
+opt_sym(mrb_state *mrb, mrb_value opts, mrb_sym key) {
+  mrb_value val;
+
+  if(mrb_nil_p(opts)) {
+    return 0;
+  }
+
+  val = mrb_hash_get(mrb, opts, mrb_symbol_value(key));
+  if(mrb_nil_p(val)) {
+    return 0;
+  }
+  if(!mrb_symbol_p(val)) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid %S option", mrb_symbol_value(key));
+  }
+  return mrb_symbol(val);
+}
+
+static mrb_bool
+opt_bool(mrb_state *mrb, mrb_value opts, mrb_sym key) {
+  if(mrb_nil_p(opts)) {
+    return FALSE;
+  }
+  return mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(key)));
+}
+
+static const char *
+opt_str(mrb_state *mrb, mrb_value opts, mrb_sym key) {
+  mrb_value val;
+
+  if(mrb_nil_p(opts)) {
+    return NULL;
+  }
+
+  val = mrb_hash_get(mrb, opts, mrb_symbol_value(key));
+  if(mrb_nil_p(val)) {
+    return NULL;
+  }
+  if(!mrb_string_p(val)) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid %S option", mrb_symbol_value(key));
+  }
+  return mrb_str_to_cstr(mrb, val);
+}
+
+static mrb_value
 image_new(mrb_state *mrb, waah_image_t **rimage) {
   waah_image_t *image = (waah_image_t *) mrb_calloc(mrb, sizeof(waah_image_t), 1);
-  mrb_value mrb_image = mrb_class_new_instance(mrb, 0, NULL, cImage);
+  mrb_value mrb_image = mrb_class_new_instance(mrb, 0, NULL, waah_state(mrb)->cImage);
 
   DATA_PTR(mrb_image) = image;
   DATA_TYPE(mrb_image) = &_waah_image_type_info;
@@ -170,20 +1298,62 @@ image_new(mrb_state *mrb, waah_image_t **rimage) {
 mrb_value
 font_new(mrb_state *mrb, waah_font_t **rfont) {
   waah_font_t *font = (waah_font_t *) mrb_calloc(mrb, sizeof(waah_font_t), 1);
-  mrb_value mrb_font = mrb_class_new_instance(mrb, 0, NULL, cFont);
+  mrb_value mrb_font = mrb_class_new_instance(mrb, 0, NULL, waah_state(mrb)->cFont);
 
   DATA_PTR(mrb_font) = font;
   DATA_TYPE(mrb_font) = &_waah_font_type_info;
+  /* Also keeps the faces of the font's library around */
+  font->ft_lib = ft_lib_ref(waah_state(mrb)->ft_lib);
 
   *rfont = font;
 
   return mrb_font;
 }
 
+static mrb_value
+pixels_new(mrb_state *mrb, cairo_surface_t *surface) {
+  waah_pixels_t *pixels = (waah_pixels_t *) mrb_calloc(mrb, sizeof(waah_pixels_t), 1);
+  mrb_value mrb_pixels = mrb_class_new_instance(mrb, 0, NULL, waah_state(mrb)->cPixels);
+
+  DATA_PTR(mrb_pixels) = pixels;
+  DATA_TYPE(mrb_pixels) = &_waah_pixels_type_info;
+
+  cairo_surface_flush(surface);
+  pixels->surface = cairo_surface_reference(surface);
+
+  return mrb_pixels;
+}
+
+static cairo_format_t
+format_from_sym(mrb_state *mrb, mrb_sym sym) {
+  if(sym == waah_state(mrb)->id_argb32) return CAIRO_FORMAT_ARGB32;
+  else if(sym == waah_state(mrb)->id_rgb24) return CAIRO_FORMAT_RGB24;
+  else if(sym == waah_state(mrb)->id_a8) return CAIRO_FORMAT_A8;
+  else if(sym == waah_state(mrb)->id_a1) return CAIRO_FORMAT_A1;
+  else if(sym == waah_state(mrb)->id_rgb16_565) return CAIRO_FORMAT_RGB16_565;
+  else if(sym == waah_state(mrb)->id_rgb30) return CAIRO_FORMAT_RGB30;
+
+  mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid format");
+  return CAIRO_FORMAT_INVALID;
+}
+
+static mrb_value
+format_to_sym(mrb_state *mrb, cairo_format_t format) {
+  switch(format) {
+    case CAIRO_FORMAT_ARGB32: return mrb_symbol_value(waah_state(mrb)->id_argb32);
+    case CAIRO_FORMAT_RGB24: return mrb_symbol_value(waah_state(mrb)->id_rgb24);
+    case CAIRO_FORMAT_A8: return mrb_symbol_value(waah_state(mrb)->id_a8);
+    case CAIRO_FORMAT_A1: return mrb_symbol_value(waah_state(mrb)->id_a1);
+    case CAIRO_FORMAT_RGB16_565: return mrb_symbol_value(waah_state(mrb)->id_rgb16_565);
+    case CAIRO_FORMAT_RGB30: return mrb_symbol_value(waah_state(mrb)->id_rgb30);
+    default: return mrb_nil_value();
+  }
+}
+
 static mrb_value
 pattern_new(mrb_state *mrb, waah_pattern_t **rpattern) {
   waah_pattern_t *pattern = (waah_pattern_t *) mrb_calloc(mrb, sizeof(waah_pattern_t), 1);
-  mrb_value mrb_pattern = mrb_class_new_instance(mrb, 0, NULL, cPattern);
+  mrb_value mrb_pattern = mrb_class_new_instance(mrb, 0, NULL, waah_state(mrb)->cPattern);
 
   DATA_PTR(mrb_pattern) = pattern;
   DATA_TYPE(mrb_pattern) = &_waah_pattern_type_info;
@@ -201,1195 +1371,6404 @@ read_png_from_buffer (void *closure,
                       unsigned int length) {
   struct waah_img_buf *buf = (struct waah_img_buf *) closure;
 
-  if(buf->off < buf->len) {
-    size_t l = MIN(length, buf->len - buf->off);
-    memcpy(data, buf->data + buf->off, l);
-    buf->off += l;
+  if(buf->len - buf->off < length) {
+    return CAIRO_STATUS_READ_ERROR;
   }
+
+  memcpy(data, buf->data + buf->off, length);
+  buf->off += length;
   return CAIRO_STATUS_SUCCESS;
 }
 
-int
-_waah_load_png_from_buffer(mrb_state *mrb, waah_image_t *image, unsigned char *data, size_t len) {
-  struct waah_img_buf buf = {.data = data, .len = len, .off = 0};
-  image->surface = cairo_image_surface_create_from_png_stream(read_png_from_buffer, &buf);
-  cairo_status_t status = cairo_surface_status(image->surface);
-  if(raise_cairo_status(mrb, status)) {
-    return FALSE;
+/* Size of the buffers libpng and libjpeg messages are formatted into, by
+ * the decoders as well as the encoders */
+#define ERROR_MSG_LEN 256
+
+/* libpng error handler, the error pointer is a buffer of ERROR_MSG_LEN */
+static void
+png_error_handler(png_structp png, png_const_charp msg) {
+  char *error = (char *) png_get_error_ptr(png);
+  snprintf(error, ERROR_MSG_LEN, "png error: %s", msg);
+  longjmp(png_jmpbuf(png), 1);
+}
+
+static void
+png_warning_handler(png_structp png, png_const_charp msg) {
+}
+
+static void
+png_read_from_buffer(png_structp png, png_bytep data, png_size_t length) {
+  if(read_png_from_buffer(png_get_io_ptr(png), data, length) != CAIRO_STATUS_SUCCESS) {
+    png_error(png, "read error");
   }
-  return TRUE;
 }
 
+static cairo_user_data_key_t pixels_key;
 
-static int
-load_png(mrb_state *mrb, waah_image_t *image, const char *filename) {
-  image->surface = cairo_image_surface_create_from_png(filename);
+/* Creates a surface owning pixels allocated with malloc, which are freed
+ * along with it rather than with the image. The surface may well outlive
+ * the image, e.g. in a Pixels view or as the source of a canvas. Frees
+ * pixels and returns NULL if out of memory. */
+static cairo_surface_t *
+surface_owning_pixels(unsigned char *pixels, cairo_format_t format, int w, int h, int stride) {
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(pixels, format, w, h, stride);
 
-  cairo_status_t status = cairo_surface_status(image->surface);
-  if(raise_cairo_status(mrb, status)) {
-    return FALSE;
+  if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+    free(pixels);
+    return surface;
+  }
+  if(cairo_surface_set_user_data(surface, &pixels_key, pixels, free) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(surface);
+    free(pixels);
+    return NULL;
   }
 
-  return TRUE;
+  return surface;
 }
 
+/* Grayscale PNGs without transparency are decoded into A8 surfaces holding
+ * luminance (see image_source_surface), a quarter of the memory cairo's
+ * loader would use. Returns FALSE, leaving the PNG to cairo, for all
+ * other images. */
+static int
+decode_gray_png(mrb_state *mrb, waah_image_t *image, unsigned char *data, size_t len) {
+  struct waah_img_buf buf = {.data = data, .len = len, .off = 0};
+  char error[ERROR_MSG_LEN];
+  png_structp png;
+  png_infop info;
+  unsigned char * volatile pixels = NULL;
+  int w, h, stride, passes, pass, y;
+
+  /* Color type of the IHDR chunk, which has to come first */
+  if(len < 33 || memcmp(data + 12, "IHDR", 4) != 0 || data[25] != PNG_COLOR_TYPE_GRAY) {
+    return FALSE;
+  }
 
-int
-_waah_load_jpeg_from_file(mrb_state *mrb, waah_image_t *image, FILE *file) {
+  png = png_create_read_struct(PNG_LIBPNG_VER_STRING, error, png_error_handler, png_warning_handler);
+  info = png == NULL ? NULL : png_create_info_struct(png);
+  if(info == NULL) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
+  }
 
-  if(file == NULL) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "file not found");
+  /* Failures from here on go through png_error, raising would skip the
+   * cleanup */
+  if(setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    free(pixels);
+    mrb_raise(mrb, E_RUNTIME_ERROR, error);
+  }
+
+  png_set_read_fn(png, &buf, png_read_from_buffer);
+  png_read_info(png, info);
+
+  if(png_get_valid(png, info, PNG_INFO_tRNS)) {
+    png_destroy_read_struct(&png, &info, NULL);
     return FALSE;
   }
 
-  struct jpeg_decompress_struct info;
-  struct jpeg_error_mgr err;
-  int w, h, n_channels, stride, offset = 0;
-  JSAMPARRAY row_buffer;
+  if(png_get_bit_depth(png, info) < 8) {
+    png_set_expand_gray_1_2_4_to_8(png);
+  } else if(png_get_bit_depth(png, info) == 16) {
+    png_set_strip_16(png);
+  }
+  passes = png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+
+  w = png_get_image_width(png, info);
+  h = png_get_image_height(png, info);
+  stride = cairo_format_stride_for_width(CAIRO_FORMAT_A8, w);
+  pixels = (unsigned char *) malloc((size_t) stride * h);
+  if(pixels == NULL) {
+    png_error(png, "out of memory");
+  }
 
-  info.err = jpeg_std_error(&err);     
-  jpeg_create_decompress(&info); 
+  for(pass = 0; pass < passes; pass++) {
+    for(y = 0; y < h; y++) {
+      png_read_row(png, pixels + (size_t) y * stride, NULL);
+    }
+  }
 
-  jpeg_stdio_src(&info, file);
-  jpeg_read_header(&info, TRUE);
+  png_read_end(png, NULL);
+  png_destroy_read_struct(&png, &info, NULL);
 
-  jpeg_start_decompress(&info);
+  image->surface = surface_owning_pixels(pixels, CAIRO_FORMAT_A8, w, h, stride);
+  if(image->surface == NULL) {
+    raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
+  }
+  image->gray = TRUE;
 
-  w = info.output_width;
-  h = info.output_height;
-  n_channels = info.num_components;
-  
-  stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, w);
-  image->data  = mrb_malloc(mrb, stride * h);
+  return TRUE;
+}
 
-  row_buffer = (JSAMPARRAY)mrb_malloc(mrb, sizeof(JSAMPROW));
-  row_buffer[0] = (JSAMPROW)mrb_malloc(mrb, sizeof(JSAMPLE) * info.output_width * n_channels);
+int
+_waah_load_png_from_buffer(mrb_state *mrb, waah_image_t *image, unsigned char *data, size_t len) {
+  struct waah_img_buf buf = {.data = data, .len = len, .off = 0};
 
-  assert(info.output_width * n_channels <= stride);
+  if(decode_gray_png(mrb, image, data, len)) {
+    return TRUE;
+  }
 
-  while(info.output_scanline < info.output_height) {
-    int i;
+  cairo_surface_t *surface = cairo_image_surface_create_from_png_stream(read_png_from_buffer, &buf);
+  cairo_status_t status = cairo_surface_status(surface);
+  /* No error surface is left behind, lazy images are decoded again as
+   * long as they have none */
+  if(status != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(surface);
+    raise_cairo_status(mrb, status);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "png error: %S",
+               mrb_str_new_cstr(mrb, cairo_status_to_string(status)));
+    return FALSE;
+  }
+  image->surface = surface;
+  return TRUE;
+}
 
-    jpeg_read_scanlines(&info, row_buffer, 1);
-    for(i = 0; i < w; i++) {
-      image->data[offset + 4 * i + 2] = row_buffer[0][n_channels * i];
-      image->data[offset + 4 * i + 1] = row_buffer[0][n_channels * i + MIN(n_channels - 1, 1)];
-      image->data[offset + 4 * i + 0] = row_buffer[0][n_channels * i + MIN(n_channels - 1, 2)];
-      image->data[offset + 4 * i + 3] = 255;
-    }
-    offset += stride;
 
+/* CAIRO_FORMAT_RGB24 pixels are native endian 32-bit xRGB words, i.e.
+ * B, G, R, X in memory on little endian machines. libjpeg-turbo can write
+ * that layout directly, saving us the swizzle pass. */
+#ifdef JCS_EXTENSIONS
+#  if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#    ifdef JCS_ALPHA_EXTENSIONS
+#      define JPEG_CAIRO_COLOR_SPACE JCS_EXT_ARGB
+#    else
+#      define JPEG_CAIRO_COLOR_SPACE JCS_EXT_XRGB
+#    endif
+#  else
+#    ifdef JCS_ALPHA_EXTENSIONS
+#      define JPEG_CAIRO_COLOR_SPACE JCS_EXT_BGRA
+#    else
+#      define JPEG_CAIRO_COLOR_SPACE JCS_EXT_BGRX
+#    endif
+#  endif
+#endif
+
+/* Number of scanlines decoded per batch when we have to swizzle ourselves */
+#define JPEG_SCANLINE_BATCH 16
+
+static void
+swizzle_rgb_to_xrgb32(unsigned char *dst, const unsigned char *src, int w) {
+  int i = 0;
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#if defined(__SSSE3__)
+  const __m128i mask = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                                     8, 7, 6, -1, 11, 10, 9, -1);
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+
+  /* 16 byte loads, but only 12 bytes (4 pixels) consumed per iteration */
+  for(; i + 6 <= w; i += 4) {
+    __m128i rgb = _mm_loadu_si128((const __m128i *)(src + 3 * i));
+    _mm_storeu_si128((__m128i *)(dst + 4 * i),
+                     _mm_or_si128(_mm_shuffle_epi8(rgb, mask), alpha));
+  }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+  for(; i + 16 <= w; i += 16) {
+    uint8x16x3_t rgb = vld3q_u8(src + 3 * i);
+    uint8x16x4_t bgra;
+    bgra.val[0] = rgb.val[2];
+    bgra.val[1] = rgb.val[1];
+    bgra.val[2] = rgb.val[0];
+    bgra.val[3] = vdupq_n_u8(255);
+    vst4q_u8(dst + 4 * i, bgra);
   }
+#endif
+#endif
 
-  mrb_free(mrb, row_buffer[0]);
-  mrb_free(mrb, row_buffer);
+  for(; i < w; i++) {
+    uint32_t p = 0xff000000u |
+                 ((uint32_t) src[3 * i] << 16) |
+                 ((uint32_t) src[3 * i + 1] << 8) |
+                 (uint32_t) src[3 * i + 2];
+    memcpy(dst + 4 * i, &p, 4);
+  }
+}
 
-  image->surface = cairo_image_surface_create_for_data(image->data, CAIRO_FORMAT_RGB24, w, h, stride);
+static void
+swizzle_gray_to_xrgb32(unsigned char *dst, const unsigned char *src, int w) {
+  int i;
+  for(i = 0; i < w; i++) {
+    uint32_t p = 0xff000000u | ((uint32_t) src[i] * 0x010101u);
+    memcpy(dst + 4 * i, &p, 4);
+  }
+}
 
-  jpeg_finish_decompress(&info);
-  jpeg_destroy_decompress(&info);
-  fclose(file);
+/* Drops the pad byte of native endian xRGB words, giving RGB bytes */
+static void
+swizzle_xrgb32_to_rgb(unsigned char *dst, const unsigned char *src, int w) {
+  int i = 0;
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#if defined(__SSSE3__)
+  const __m128i mask = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+                                     8, 14, 13, 12, -1, -1, -1, -1);
+
+  /* 16 byte stores, but only 12 bytes (4 pixels) produced per iteration */
+  for(; i + 6 <= w; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+    _mm_storeu_si128((__m128i *)(dst + 3 * i), _mm_shuffle_epi8(p, mask));
+  }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+  for(; i + 16 <= w; i += 16) {
+    uint8x16x4_t p = vld4q_u8(src + 4 * i);
+    uint8x16x3_t rgb;
+    rgb.val[0] = p.val[2];
+    rgb.val[1] = p.val[1];
+    rgb.val[2] = p.val[0];
+    vst3q_u8(dst + 3 * i, rgb);
+  }
+#endif
+#endif
 
-  return TRUE;
+  for(; i < w; i++) {
+    uint32_t p;
+    memcpy(&p, src + 4 * i, 4);
+    dst[3 * i + 0] = p >> 16;
+    dst[3 * i + 1] = p >> 8;
+    dst[3 * i + 2] = p;
+  }
 }
 
-static int
-load_jpeg(mrb_state *mrb, waah_image_t *image, const char *filename) {
-  FILE *file = fopen(filename, "rb" );
-  return _waah_load_jpeg_from_file(mrb, image, file);
+/* unpremultiply_table[a] = ceil(2^24 / a), which makes UNPREMULTIPLY
+ * give the same results as cairo's (c * 255 + a / 2) / a */
+static uint32_t unpremultiply_table[256];
+
+#define UNPREMULTIPLY(c, a) \
+  ((unsigned char) ((((uint64_t) (c) * 255 + (a) / 2) * unpremultiply_table[a]) >> 24))
+
+static void
+init_unpremultiply_table(void) {
+  uint32_t a;
+  for(a = 1; a < 256; a++) {
+    unpremultiply_table[a] = ((1u << 24) + a - 1) / a;
+  }
 }
 
-mrb_value
-_waah_image_load(mrb_state *mrb, mrb_value self, int (*png)(mrb_state *, waah_image_t *, const char *),
-                                                int (*jpeg)(mrb_state *, waah_image_t *, const char *)) {
+static void
+unpremultiply_argb32_to_rgba_scalar(unsigned char *dst, const unsigned char *src, int w) {
+  int i;
+  for(i = 0; i < w; i++) {
+    uint32_t p;
+    uint32_t a, r, g, b;
+
+    memcpy(&p, src + 4 * i, 4);
+    a = p >> 24;
+    r = (p >> 16) & 0xff;
+    g = (p >> 8) & 0xff;
+    b = p & 0xff;
+
+    if(a == 0) {
+      r = g = b = 0;
+    } else if(a != 255) {
+      r = UNPREMULTIPLY(r, a);
+      g = UNPREMULTIPLY(g, a);
+      b = UNPREMULTIPLY(b, a);
+    }
 
-  waah_image_t *image;
-  mrb_value mrb_image = image_new(mrb, &image);
+    dst[4 * i + 0] = r;
+    dst[4 * i + 1] = g;
+    dst[4 * i + 2] = b;
+    dst[4 * i + 3] = a;
+  }
+}
 
-  char *filename;
-  mrb_int len;
+/* Converts premultiplied native endian ARGB words (CAIRO_FORMAT_ARGB32) to
+ * straight RGBA bytes. Runs of opaque pixels only need a byte swap, which
+ * is done in SIMD registers. */
+static void
+unpremultiply_argb32_to_rgba(unsigned char *dst, const unsigned char *src, int w) {
+  int i = 0;
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#if defined(__SSE2__)
+  const __m128i amask = _mm_set1_epi32(0xff000000);
+  const __m128i agmask = _mm_set1_epi32(0xff00ff00);
+  const __m128i lomask = _mm_set1_epi32(0xff);
+
+  for(; i + 4 <= w; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(p, amask), amask)) != 0xffff) {
+      unpremultiply_argb32_to_rgba_scalar(dst + 4 * i, src + 4 * i, 4);
+      continue;
+    }
+    p = _mm_or_si128(_mm_and_si128(p, agmask),
+                     _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), lomask),
+                                  _mm_slli_epi32(_mm_and_si128(p, lomask), 16)));
+    _mm_storeu_si128((__m128i *)(dst + 4 * i), p);
+  }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+  for(; i + 16 <= w; i += 16) {
+    uint8x16x4_t p = vld4q_u8(src + 4 * i);
+    uint8x8_t a = vand_u8(vget_low_u8(p.val[3]), vget_high_u8(p.val[3]));
+    uint8x16_t b;
+
+    if(vget_lane_u64(vreinterpret_u64_u8(a), 0) != UINT64_MAX) {
+      unpremultiply_argb32_to_rgba_scalar(dst + 4 * i, src + 4 * i, 16);
+      continue;
+    }
+    b = p.val[0];
+    p.val[0] = p.val[2];
+    p.val[2] = b;
+    vst4q_u8(dst + 4 * i, p);
+  }
+#endif
+#endif
 
-  mrb_get_args(mrb, "s", &filename, &len);
-  
-  if(len > 4 &&
-     filename[len - 4] == '.' &&
-     tolower(filename[len - 3]) == 'p' &&
-     tolower(filename[len - 2]) == 'n' &&
-     tolower(filename[len - 1]) == 'g') {
+  unpremultiply_argb32_to_rgba_scalar(dst + 4 * i, src + 4 * i, w - i);
+}
 
-      if(!((*png)(mrb, image, filename))) {
-        goto error;
+static void
+read_jpeg_scanlines(struct jpeg_decompress_struct *info, unsigned char *data, int stride, unsigned char *buffer) {
+  int w = info->output_width;
+  int h = info->output_height;
+  int n_channels = info->output_components;
+  JSAMPROW rows[JPEG_SCANLINE_BATCH];
+  size_t row_size = (size_t) w * n_channels;
+  int i;
+
+  if(buffer == NULL) {
+    /* Decode straight into the surface, handing libjpeg as many rows as it wants */
+    while(info->output_scanline < info->output_height) {
+      int n = MIN(JPEG_SCANLINE_BATCH, h - (int) info->output_scanline);
+      for(i = 0; i < n; i++) {
+        rows[i] = data + (size_t) (info->output_scanline + i) * stride;
       }
-  } else if( (len > 4 &&
-              filename[len - 4] == '.' &&
-              tolower(filename[len - 3]) == 'j' &&
-              tolower(filename[len - 2]) == 'p' &&
-              tolower(filename[len - 1]) == 'g') ||
-              (len > 5 &&
-              filename[len - 5] == '.' &&
-              tolower(filename[len - 4]) == 'j' &&
-              tolower(filename[len - 3]) == 'p' &&
-              tolower(filename[len - 2]) == 'e' &&
-              tolower(filename[len - 1]) == 'g'
-             )) {
-    if(!((*jpeg)(mrb, image, filename))) {
-      goto error;
+      jpeg_read_scanlines(info, rows, n);
     }
-  } else {
-    mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown image format");
-    return mrb_nil_value();
+    return;
   }
 
-  return mrb_image;
-
-error:
-  return mrb_nil_value();
+  for(i = 0; i < JPEG_SCANLINE_BATCH; i++) {
+    rows[i] = buffer + i * row_size;
+  }
 
+  while(info->output_scanline < info->output_height) {
+    int y = info->output_scanline;
+    int n = jpeg_read_scanlines(info, rows, MIN(JPEG_SCANLINE_BATCH, h - y));
+
+    for(i = 0; i < n; i++) {
+      unsigned char *dst = data + (size_t) (y + i) * stride;
+      if(n_channels == 3) {
+        swizzle_rgb_to_xrgb32(dst, rows[i], w);
+      } else if(n_channels == 1) {
+        swizzle_gray_to_xrgb32(dst, rows[i], w);
+      } else {
+        int x;
+        for(x = 0; x < w; x++) {
+          dst[4 * x + 2] = rows[i][n_channels * x];
+          dst[4 * x + 1] = rows[i][n_channels * x + MIN(n_channels - 1, 1)];
+          dst[4 * x + 0] = rows[i][n_channels * x + MIN(n_channels - 1, 2)];
+          dst[4 * x + 3] = 255;
+        }
+      }
+    }
+  }
 }
 
-static mrb_value
-image_load(mrb_state *mrb, mrb_value self) {
-  return _waah_image_load(mrb, self, load_png, load_jpeg);
-}
+/* Computes the size an image of w x h has to be scaled to in order to fit
+ * into image->max_width x image->max_height (keeping the aspect ratio).
+ * Returns FALSE if no scaling is necessary. */
+static int
+image_target_size(waah_image_t *image, int w, int h, int *tw, int *th) {
+  double s = 1.0;
 
-int
-_waah_font_load_from_filename(mrb_state *mrb, waah_font_t *font, const char *filename) {
-  if(FT_New_Face(ft_lib,
-                 filename,
-                 0,
-                 &font->ft_face) != FT_Err_Ok) {
+  if(image->max_width > 0 && w > image->max_width) {
+    s = (double) image->max_width / w;
+  }
+  if(image->max_height > 0 && h > image->max_height) {
+    s = MIN(s, (double) image->max_height / h);
+  }
+
+  *tw = w;
+  *th = h;
+
+  if(s >= 1.0) {
     return FALSE;
   }
+
+  *tw = (int) MAX(1, floor(w * s + 0.5));
+  *th = (int) MAX(1, floor(h * s + 0.5));
   return TRUE;
 }
 
-int
-_waah_font_load_from_buffer(mrb_state *mrb, waah_font_t *font, unsigned char *buf, size_t len) {
-  FT_Open_Args args;
+/* Replaces the image's surface by a resampled copy of size w x h */
+static void
+image_resample(mrb_state *mrb, waah_image_t *image, int w, int h) {
+  cairo_surface_t *src = image->surface;
+  cairo_surface_t *dst;
+  cairo_pattern_t *pattern;
+  cairo_t *cr;
+
+  dst = cairo_image_surface_create(cairo_image_surface_get_format(src), w, h);
+  /* Only happens while loading, the image is left without pixels as if
+   * decoding failed */
+  if(cairo_surface_status(dst) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(dst);
+    cairo_surface_destroy(src);
+    image->surface = NULL;
+    raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
+  }
+  cr = cairo_create(dst);
+  cairo_scale(cr, (double) w / cairo_image_surface_get_width(src),
+                  (double) h / cairo_image_surface_get_height(src));
+  cairo_set_source_surface(cr, src, 0, 0);
+  pattern = cairo_get_source(cr);
+  cairo_pattern_set_filter(pattern, CAIRO_FILTER_GOOD);
+  cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_paint(cr);
+  cairo_destroy(cr);
 
-  args.flags = FT_OPEN_MEMORY;
-  args.memory_base = buf;
-  args.memory_size = len;
-  if(FT_Open_Face(ft_lib,
-                  &args,
-                  0,
-                  &font->ft_face) != FT_Err_Ok) {
+  cairo_surface_destroy(src);
+  image->surface = dst;
+}
+
+/* Picks the largest DCT scaling (1/2, 1/4 or 1/8) that still yields an
+ * image at least as large as the requested size; the remainder is done by
+ * image_resample. The target size is computed from the header, so that it
+ * matches the size of a full decode. Returns FALSE if no scaling is
+ * necessary. */
+static int
+jpeg_scale_to_target(waah_image_t *image, struct jpeg_decompress_struct *info, int *tw, int *th) {
+  unsigned int denom;
+
+  if(!image_target_size(image, info->image_width, info->image_height, tw, th)) {
     return FALSE;
   }
+
+  for(denom = 8; denom > 1; denom /= 2) {
+    if((info->image_width + denom - 1) / denom >= (unsigned int) *tw &&
+       (info->image_height + denom - 1) / denom >= (unsigned int) *th) {
+      break;
+    }
+  }
+
+  info->scale_num = 1;
+  info->scale_denom = denom;
   return TRUE;
 }
 
-static mrb_value
-font_load(mrb_state *mrb, mrb_value self) {
-  char *filename;
-  waah_font_t *font;
-  mrb_value mrb_font = font_new(mrb, &font);
-  mrb_int len;
-  mrb_get_args(mrb, "s", &filename, &len);
+/* libjpeg's default error handler calls exit(), so we jump back into
+ * decode_jpeg and raise from there instead */
+struct jpeg_error_handler {
+  struct jpeg_error_mgr mgr;
+  jmp_buf jmp;
+};
 
-  if(!_waah_font_load_from_filename(mrb, font, filename)) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR, "font loading failed");
-    return mrb_nil_value();
-  } else {
-    return mrb_font;
-  }
+static void
+jpeg_error_exit(j_common_ptr info) {
+  struct jpeg_error_handler *err = (struct jpeg_error_handler *) info->err;
+  longjmp(err->jmp, 1);
 }
 
+/* Source manager reading from a memory buffer (jpeg_mem_src is not
+ * available in older libjpeg versions) */
+static void
+jpeg_buffer_init_source(j_decompress_ptr info) {
+}
 
-static mrb_value
-font_find(mrb_state *mrb, mrb_value self) {
-#ifdef CAIRO_HAS_FC_FONT
-  char *name;
-  waah_font_t *font;
+static boolean
+jpeg_buffer_fill_input_buffer(j_decompress_ptr info) {
+  static const JOCTET eoi[2] = {0xFF, JPEG_EOI};
+
+  /* Premature end of data, insert a fake EOI marker like jpeg_stdio_src does */
+  info->src->next_input_byte = eoi;
+  info->src->bytes_in_buffer = 2;
+  return TRUE;
+}
+
+static void
+jpeg_buffer_skip_input_data(j_decompress_ptr info, long n) {
+  struct jpeg_source_mgr *src = info->src;
+
+  if(n <= 0) {
+    return;
+  }
+
+  if((size_t) n > src->bytes_in_buffer) {
+    jpeg_buffer_fill_input_buffer(info);
+  } else {
+    src->next_input_byte += n;
+    src->bytes_in_buffer -= n;
+  }
+}
+
+static void
+jpeg_buffer_term_source(j_decompress_ptr info) {
+}
+
+static void
+jpeg_buffer_src(struct jpeg_decompress_struct *info, struct jpeg_source_mgr *src,
+                const unsigned char *data, size_t len) {
+  src->init_source = jpeg_buffer_init_source;
+  src->fill_input_buffer = jpeg_buffer_fill_input_buffer;
+  src->skip_input_data = jpeg_buffer_skip_input_data;
+  src->resync_to_restart = jpeg_resync_to_restart;
+  src->term_source = jpeg_buffer_term_source;
+  src->next_input_byte = data;
+  src->bytes_in_buffer = len;
+  info->src = src;
+}
+
+/* Decodes from either file or data */
+static int
+decode_jpeg(mrb_state *mrb, waah_image_t *image, FILE *file, const unsigned char *data, size_t len) {
+  struct jpeg_decompress_struct info;
+  struct jpeg_error_handler err;
+  struct jpeg_source_mgr src;
+  unsigned char * volatile buffer = NULL;
+  unsigned char * volatile pixels = NULL;
+  int w, h, tw, th, stride, gray, resize;
+  cairo_format_t format;
+
+  info.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpeg_error_exit;
+
+  if(setjmp(err.jmp)) {
+    char msg[JMSG_LENGTH_MAX];
+
+    (*info.err->format_message)((j_common_ptr) &info, msg);
+    jpeg_destroy_decompress(&info);
+    free(pixels);
+    if(buffer != NULL) {
+      mrb_free(mrb, buffer);
+    }
+    if(file != NULL) {
+      fclose(file);
+    }
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "jpeg error: %S", mrb_str_new_cstr(mrb, msg));
+    return FALSE;
+  }
+
+  jpeg_create_decompress(&info);
+
+  if(file != NULL) {
+    jpeg_stdio_src(&info, file);
+  } else {
+    jpeg_buffer_src(&info, &src, data, len);
+  }
+
+  jpeg_read_header(&info, TRUE);
+  resize = jpeg_scale_to_target(image, &info, &tw, &th);
+
+  /* Grayscale scans are decoded into A8 holding luminance, see
+   * image_source_surface */
+  gray = info.jpeg_color_space == JCS_GRAYSCALE;
+  if(gray) {
+    info.out_color_space = JCS_GRAYSCALE;
+  }
+#ifdef JPEG_CAIRO_COLOR_SPACE
+  else if(info.jpeg_color_space == JCS_YCbCr ||
+          info.jpeg_color_space == JCS_RGB) {
+    info.out_color_space = JPEG_CAIRO_COLOR_SPACE;
+  }
+#endif
+
+  jpeg_start_decompress(&info);
+
+  w = info.output_width;
+  h = info.output_height;
+
+  format = gray ? CAIRO_FORMAT_A8 : CAIRO_FORMAT_RGB24;
+  stride = cairo_format_stride_for_width(format, w);
+  /* mrb_malloc would raise past the decompressor, out of memory is
+   * reported through the error handler instead */
+  pixels = (unsigned char *) malloc((size_t) stride * h);
+  if(pixels == NULL) {
+    ERREXIT(&info, JERR_OUT_OF_MEMORY);
+  }
+
+  if(!gray
+#ifdef JPEG_CAIRO_COLOR_SPACE
+     && info.out_color_space != JPEG_CAIRO_COLOR_SPACE
+#endif
+    ) {
+    buffer = mrb_malloc_simple(mrb, (size_t) w * info.output_components * JPEG_SCANLINE_BATCH);
+    if(buffer == NULL) {
+      ERREXIT(&info, JERR_OUT_OF_MEMORY);
+    }
+  }
+
+  read_jpeg_scanlines(&info, pixels, stride, buffer);
+
+  jpeg_finish_decompress(&info);
+  jpeg_destroy_decompress(&info);
+
+  if(buffer != NULL) {
+    mrb_free(mrb, buffer);
+  }
+  if(file != NULL) {
+    fclose(file);
+  }
+
+  image->surface = surface_owning_pixels(pixels, format, w, h, stride);
+  if(image->surface == NULL) {
+    raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
+  }
+  image->gray = gray;
+
+  /* Scales the rest of the way, image_fit_to_target then has nothing left
+   * to do */
+  if(resize && (w != tw || h != th)) {
+    image_resample(mrb, image, tw, th);
+  }
+
+  return TRUE;
+}
+
+int
+_waah_load_jpeg_from_file(mrb_state *mrb, waah_image_t *image, FILE *file) {
+
+  if(file == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "file not found");
+    return FALSE;
+  }
+
+  return decode_jpeg(mrb, image, file, NULL, 0);
+}
+
+int
+_waah_load_jpeg_from_buffer(mrb_state *mrb, waah_image_t *image, unsigned char *data, size_t len) {
+  return decode_jpeg(mrb, image, NULL, data, len);
+}
+
+enum {
+  IMAGE_FORMAT_UNKNOWN,
+  IMAGE_FORMAT_PNG,
+  IMAGE_FORMAT_JPEG
+};
+
+/* Number of leading bytes needed by sniff_image_format */
+#define IMAGE_MAGIC_LEN 8
+
+static int
+sniff_image_format(const unsigned char *data, size_t len) {
+  static const unsigned char png_magic[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  static const unsigned char jpeg_magic[] = {0xff, 0xd8, 0xff};
+
+  if(len >= sizeof(png_magic) && !memcmp(data, png_magic, sizeof(png_magic))) {
+    return IMAGE_FORMAT_PNG;
+  }
+  if(len >= sizeof(jpeg_magic) && !memcmp(data, jpeg_magic, sizeof(jpeg_magic))) {
+    return IMAGE_FORMAT_JPEG;
+  }
+  return IMAGE_FORMAT_UNKNOWN;
+}
+
+/* Fallback for files we cannot peek into (e.g. platform asset paths) */
+static int
+image_format_from_extension(const char *filename, size_t len) {
+  if(len > 4 &&
+     filename[len - 4] == '.' &&
+     tolower(filename[len - 3]) == 'p' &&
+     tolower(filename[len - 2]) == 'n' &&
+     tolower(filename[len - 1]) == 'g') {
+    return IMAGE_FORMAT_PNG;
+  } else if( (len > 4 &&
+              filename[len - 4] == '.' &&
+              tolower(filename[len - 3]) == 'j' &&
+              tolower(filename[len - 2]) == 'p' &&
+              tolower(filename[len - 1]) == 'g') ||
+              (len > 5 &&
+              filename[len - 5] == '.' &&
+              tolower(filename[len - 4]) == 'j' &&
+              tolower(filename[len - 3]) == 'p' &&
+              tolower(filename[len - 2]) == 'e' &&
+              tolower(filename[len - 1]) == 'g'
+             )) {
+    return IMAGE_FORMAT_JPEG;
+  }
+  return IMAGE_FORMAT_UNKNOWN;
+}
+
+int
+_waah_load_image_from_buffer(mrb_state *mrb, waah_image_t *image, unsigned char *data, size_t len) {
+  switch(sniff_image_format(data, len)) {
+    case IMAGE_FORMAT_PNG:
+      return _waah_load_png_from_buffer(mrb, image, data, len);
+    case IMAGE_FORMAT_JPEG:
+      return _waah_load_jpeg_from_buffer(mrb, image, data, len);
+    default:
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown image format");
+      return FALSE;
+  }
+}
+
+/* Size of the JPEG in data, from its header only */
+static void
+probe_jpeg(mrb_state *mrb, const unsigned char *data, size_t len, int *w, int *h) {
+  struct jpeg_decompress_struct info;
+  struct jpeg_error_handler err;
+  struct jpeg_source_mgr src;
+
+  info.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpeg_error_exit;
+
+  if(setjmp(err.jmp)) {
+    char msg[JMSG_LENGTH_MAX];
+
+    (*info.err->format_message)((j_common_ptr) &info, msg);
+    jpeg_destroy_decompress(&info);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "jpeg error: %S", mrb_str_new_cstr(mrb, msg));
+  }
+
+  jpeg_create_decompress(&info);
+  jpeg_buffer_src(&info, &src, data, len);
+  jpeg_read_header(&info, TRUE);
+
+  *w = info.image_width;
+  *h = info.image_height;
+
+  jpeg_destroy_decompress(&info);
+}
+
+/* The largest width or height of an image surface cairo supports */
+#define IMAGE_MAX_SIZE 32767
+
+/* Makes image lazy, data has to stay valid for its lifetime. Only the size
+ * is read now, decoding is left to image_surface. */
+static void
+image_make_lazy(mrb_state *mrb, waah_image_t *image, const unsigned char *data, size_t len) {
+  int w, h;
+
+  switch(sniff_image_format(data, len)) {
+    case IMAGE_FORMAT_PNG: {
+      uint32_t pw, ph;
+
+      /* IHDR has to be the first chunk */
+      if(len < 24 || memcmp(data + 12, "IHDR", 4) != 0) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "png error: missing IHDR");
+      }
+      pw = ((uint32_t) data[16] << 24) | ((uint32_t) data[17] << 16) | ((uint32_t) data[18] << 8) | data[19];
+      ph = ((uint32_t) data[20] << 24) | ((uint32_t) data[21] << 16) | ((uint32_t) data[22] << 8) | data[23];
+      /* Checked now, as decoding would only fail on first use */
+      if(pw == 0 || ph == 0 || pw > IMAGE_MAX_SIZE || ph > IMAGE_MAX_SIZE) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "png error: invalid image size");
+      }
+      w = (int) pw;
+      h = (int) ph;
+      break;
+    }
+    case IMAGE_FORMAT_JPEG:
+      probe_jpeg(mrb, data, len, &w, &h);
+      if(w > IMAGE_MAX_SIZE || h > IMAGE_MAX_SIZE) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "jpeg error: invalid image size");
+      }
+      break;
+    default:
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown image format");
+      return;
+  }
+
+  image_target_size(image, w, h, &image->width, &image->height);
+  image->cache = waah_state(mrb)->image_cache;
+  image->cache->refs++;
+}
+
+static void
+image_parse_opts(mrb_state *mrb, waah_image_t *image, mrb_value opts) {
+  image->max_width = opt_int(mrb, opts, waah_state(mrb)->id_max_width, 0);
+  image->max_height = opt_int(mrb, opts, waah_state(mrb)->id_max_height, 0);
+}
+
+static void
+image_fit_to_target(mrb_state *mrb, waah_image_t *image) {
+  int tw, th;
+
+  if(image_target_size(image,
+                       cairo_image_surface_get_width(image->surface),
+                       cairo_image_surface_get_height(image->surface),
+                       &tw, &th)) {
+    image_resample(mrb, image, tw, th);
+  }
+}
+
+/* Returns the surface of image, decoding lazy images first if needed. This
+ * may evict other lazy images, so their surfaces have to be fetched again
+ * unless a reference on them is held. */
+static cairo_surface_t *
+image_surface(mrb_state *mrb, waah_image_t *image) {
+  waah_image_cache_t *cache = image->cache;
+
+  if(cache == NULL) {
+    return image->surface;
+  }
+
+  if(image->surface != NULL) {
+    cache->hits++;
+    if(cache->head != image) {
+      image_cache_remove(cache, image);
+      image_cache_push(cache, image);
+    }
+    return image->surface;
+  }
+
+  cache->misses++;
+  image->gray = FALSE;
+  if(image->encoded != NULL) {
+    _waah_load_image_from_buffer(mrb, image, image->encoded, image->encoded_len);
+  } else {
+    _waah_load_image_from_buffer(mrb, image, image->map.data, image->map.len);
+  }
+  image_fit_to_target(mrb, image);
+
+  image->cached_bytes = (size_t) cairo_image_surface_get_stride(image->surface) *
+                        cairo_image_surface_get_height(image->surface);
+  image_cache_push(cache, image);
+  cache->bytes += image->cached_bytes;
+  cache->images++;
+  image_cache_trim(mrb, cache, image);
+
+  return image->surface;
+}
+
+mrb_value
+_waah_image_load(mrb_state *mrb, mrb_value self, int (*png)(mrb_state *, waah_image_t *, const char *),
+                                                int (*jpeg)(mrb_state *, waah_image_t *, const char *)) {
+
+  waah_image_t *image;
+  mrb_value mrb_image = image_new(mrb, &image);
+
+  char *filename;
+  mrb_int len;
+  mrb_value opts = mrb_nil_value();
+  int format = IMAGE_FORMAT_UNKNOWN;
+  FILE *file;
+
+  mrb_get_args(mrb, "s|H", &filename, &len, &opts);
+  image_parse_opts(mrb, image, opts);
+
+  file = fopen(filename, "rb");
+  if(file != NULL) {
+    unsigned char magic[IMAGE_MAGIC_LEN];
+    size_t n = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+    format = sniff_image_format(magic, n);
+  } else {
+    format = image_format_from_extension(filename, len);
+  }
+
+  switch(format) {
+    case IMAGE_FORMAT_PNG:
+      if(!((*png)(mrb, image, filename))) {
+        goto error;
+      }
+      break;
+    case IMAGE_FORMAT_JPEG:
+      if(!((*jpeg)(mrb, image, filename))) {
+        goto error;
+      }
+      break;
+    default:
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown image format");
+      return mrb_nil_value();
+  }
+
+  image_fit_to_target(mrb, image);
+
+  return mrb_image;
+
+error:
+  return mrb_nil_value();
+
+}
+
+static mrb_value
+image_load(mrb_state *mrb, mrb_value self) {
+  waah_image_t *image;
+  mrb_value mrb_image = image_new(mrb, &image);
+  char *filename;
+  mrb_value opts = mrb_nil_value();
+
+  mrb_get_args(mrb, "z|H", &filename, &opts);
+  image_parse_opts(mrb, image, opts);
+
+  /* The mapping is owned by the image, so it is released by image_free
+   * even if decoding raises */
+  if(!_waah_file_map(filename, &image->map)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "file not found");
+    return mrb_nil_value();
+  }
+
+  /* lazy: true keeps the mapping and decodes on use */
+  if(opt_bool(mrb, opts, waah_state(mrb)->id_lazy)) {
+    image_make_lazy(mrb, image, image->map.data, image->map.len);
+    return mrb_image;
+  }
+
+  if(!_waah_load_image_from_buffer(mrb, image, image->map.data, image->map.len)) {
+    return mrb_nil_value();
+  }
+
+  /* Decoded pixels are private, the file is not needed anymore */
+  _waah_file_unmap(&image->map);
+
+  image_fit_to_target(mrb, image);
+
+  return mrb_image;
+}
+
+static mrb_value
+image_decode(mrb_state *mrb, mrb_value self) {
+  waah_image_t *image;
+  mrb_value mrb_image = image_new(mrb, &image);
+  mrb_value str;
+  mrb_value opts = mrb_nil_value();
+
+  mrb_get_args(mrb, "S|H", &str, &opts);
+  image_parse_opts(mrb, image, opts);
+
+  /* The String may change, so lazy images keep a copy */
+  if(opt_bool(mrb, opts, waah_state(mrb)->id_lazy)) {
+    image->encoded_len = RSTRING_LEN(str);
+    image->encoded = (unsigned char *) malloc(MAX(image->encoded_len, 1));
+    if(image->encoded == NULL) {
+      raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
+    }
+    memcpy(image->encoded, RSTRING_PTR(str), image->encoded_len);
+    image_make_lazy(mrb, image, image->encoded, image->encoded_len);
+    return mrb_image;
+  }
+
+  if(!_waah_load_image_from_buffer(mrb, image, (unsigned char *) RSTRING_PTR(str), RSTRING_LEN(str))) {
+    return mrb_nil_value();
+  }
+
+  image_fit_to_target(mrb, image);
+
+  return mrb_image;
+}
+
+int
+_waah_font_load_from_filename(mrb_state *mrb, waah_font_t *font, const char *filename) {
+  font->face = face_from_file(font->ft_lib, filename);
+  if(font->face == NULL) {
+    return FALSE;
+  }
+
+  font->ft_face = font->face->ft_face;
+  font->cr_face = cairo_font_face_reference(font->face->cr_face);
+  return TRUE;
+}
+
+int
+_waah_font_load_from_buffer(mrb_state *mrb, waah_font_t *font, unsigned char *buf, size_t len) {
+  FT_Open_Args args;
+  int ok;
+
+  args.flags = FT_OPEN_MEMORY;
+  args.memory_base = buf;
+  args.memory_size = len;
+  FT_LOCK();
+  ok = FT_Open_Face(font->ft_lib->lib,
+                    &args,
+                    0,
+                    &font->ft_face) == FT_Err_Ok;
+  FT_UNLOCK();
+  return ok;
+}
+
+static mrb_value
+font_load(mrb_state *mrb, mrb_value self) {
+  char *filename;
+  waah_font_t *font;
   mrb_value mrb_font = font_new(mrb, &font);
   mrb_int len;
-  FcConfig* config;
-  FcPattern* pat;
-  FcResult result;
+  mrb_get_args(mrb, "s", &filename, &len);
+
+  if(!_waah_font_load_from_filename(mrb, font, filename)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "font loading failed");
+    return mrb_nil_value();
+  } else {
+    return mrb_font;
+  }
+}
+
+
+#ifdef CAIRO_HAS_FC_FONT
+/* Catalog of the system fonts, listed once per process on first use. The
+ * first fontconfig call loads its configuration, which is slow, so it may
+ * be built ahead of time on a thread of its own (Font.preload). Entries
+ * are sorted by family and style, so queries need neither fontconfig nor
+ * Font objects for the fonts they skip. */
+struct font_catalog_entry {
+  FcPattern *pattern;
+  const char *family;
+  const char *style;
+};
+
+/* Results of Font.find, by name */
+struct font_match {
+  char *name;
+  FcPattern *pattern;
+  struct font_match *next;
+};
+
+#define FONT_MATCH_BUCKETS 64
+#define FONT_MATCH_MAX 256
+
+/* Protected by fc_lock */
+static struct {
+  int built;
+  int preloading;
+  FcFontSet *set;
+  struct font_catalog_entry *entries;
+  int n_entries;
+  struct font_match *matches[FONT_MATCH_BUCKETS];
+  int n_matches;
+} font_catalog;
+
+static int
+font_name_cmp(const char *a, const char *b) {
+  if(a == NULL || b == NULL) {
+    return (a != NULL) - (b != NULL);
+  }
+  for(; *a != '\0' && tolower((unsigned char) *a) == tolower((unsigned char) *b); a++, b++);
+  return tolower((unsigned char) *a) - tolower((unsigned char) *b);
+}
+
+static int
+font_catalog_entry_cmp(const void *a, const void *b) {
+  const struct font_catalog_entry *x = a, *y = b;
+  int cmp = font_name_cmp(x->family, y->family);
+
+  return cmp != 0 ? cmp : font_name_cmp(x->style, y->style);
+}
+
+/* Must be called with fc_lock held */
+static void
+font_catalog_build(void) {
+  FcPattern *pattern;
+  FcObjectSet *os;
+  FcConfig *config;
+  int i;
+
+  if(font_catalog.built) {
+    return;
+  }
+  font_catalog.built = TRUE;
+
+  config = FcConfigGetCurrent();
+  pattern = FcPatternCreate();
+  os = FcObjectSetBuild(FC_FAMILY, FC_STYLE, FC_LANG, (char *) 0);
+  font_catalog.set = FcFontList(config, pattern, os);
+  FcObjectSetDestroy(os);
+  FcPatternDestroy(pattern);
+
+  if(font_catalog.set == NULL || font_catalog.set->nfont == 0) {
+    return;
+  }
+
+  font_catalog.entries = (struct font_catalog_entry *)
+    malloc(font_catalog.set->nfont * sizeof(struct font_catalog_entry));
+  if(font_catalog.entries == NULL) {
+    return;
+  }
+
+  for(i = 0; i < font_catalog.set->nfont; i++) {
+    struct font_catalog_entry *entry = &font_catalog.entries[i];
+    entry->pattern = font_catalog.set->fonts[i];
+    if(FcPatternGetString(entry->pattern, FC_FAMILY, 0, (FcChar8 **) &entry->family) != FcResultMatch) {
+      entry->family = NULL;
+    }
+    if(FcPatternGetString(entry->pattern, FC_STYLE, 0, (FcChar8 **) &entry->style) != FcResultMatch) {
+      entry->style = NULL;
+    }
+  }
+  font_catalog.n_entries = font_catalog.set->nfont;
+  qsort(font_catalog.entries, font_catalog.n_entries, sizeof(struct font_catalog_entry),
+        font_catalog_entry_cmp);
+}
+
+static void
+font_catalog_get(void) {
+  FC_LOCK();
+  font_catalog_build();
+  FC_UNLOCK();
+}
+
+#ifdef WAAH_HAVE_THREADS
+static void *
+font_catalog_preload(void *arg) {
+  font_catalog_get();
+  return NULL;
+}
+#endif
+
+/* Returns the first entry of family, or of the whole catalog if NULL */
+static int
+font_catalog_find(const char *family, int *end) {
+  int lo = 0, hi = font_catalog.n_entries;
+
+  *end = font_catalog.n_entries;
+  if(family == NULL) {
+    return 0;
+  }
+
+  while(lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if(font_name_cmp(font_catalog.entries[mid].family, family) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  for(*end = lo; *end < font_catalog.n_entries &&
+                 font_name_cmp(font_catalog.entries[*end].family, family) == 0; (*end)++);
+  return lo;
+}
+
+static unsigned int
+font_match_bucket(const char *name) {
+  unsigned int hash = 5381;
+
+  for(; *name != '\0'; name++) {
+    hash = hash * 33 + (unsigned char) *name;
+  }
+  return hash % FONT_MATCH_BUCKETS;
+}
+
+/* Returns a new reference to the best match for name. Must be called with
+ * fc_lock held. */
+static FcPattern *
+font_match(const char *name) {
+  unsigned int bucket = font_match_bucket(name);
+  struct font_match *match;
+  FcConfig *config;
+  FcPattern *pat, *result_pattern;
+  FcResult result;
+  int i;
+
+  for(match = font_catalog.matches[bucket]; match != NULL; match = match->next) {
+    if(strcmp(match->name, name) == 0) {
+      FcPatternReference(match->pattern);
+      return match->pattern;
+    }
+  }
+
+  config = FcConfigGetCurrent();
+  pat = FcNameParse((const FcChar8*)name);
+  if(pat == NULL) {
+    return NULL;
+  }
+  FcConfigSubstitute(config, pat, FcMatchPattern);
+  FcDefaultSubstitute(pat);
+  result_pattern = FcFontMatch(config, pat, &result);
+  FcPatternDestroy(pat);
+  if(result_pattern == NULL) {
+    return NULL;
+  }
+
+  /* Starts over rather than tracking use, names are usually few */
+  if(font_catalog.n_matches >= FONT_MATCH_MAX) {
+    for(i = 0; i < FONT_MATCH_BUCKETS; i++) {
+      while(font_catalog.matches[i] != NULL) {
+        match = font_catalog.matches[i];
+        font_catalog.matches[i] = match->next;
+        FcPatternDestroy(match->pattern);
+        free(match->name);
+        free(match);
+      }
+    }
+    font_catalog.n_matches = 0;
+  }
+
+  match = (struct font_match *) malloc(sizeof(struct font_match));
+  if(match != NULL) {
+    match->name = strdup(name);
+    if(match->name != NULL) {
+      match->pattern = result_pattern;
+      FcPatternReference(result_pattern);
+      match->next = font_catalog.matches[bucket];
+      font_catalog.matches[bucket] = match;
+      font_catalog.n_matches++;
+    } else {
+      free(match);
+    }
+  }
+
+  return result_pattern;
+}
+#endif
+
+static mrb_value
+font_find(mrb_state *mrb, mrb_value self) {
+#ifdef CAIRO_HAS_FC_FONT
+  char *name;
+  waah_font_t *font;
+  mrb_value mrb_font = font_new(mrb, &font);
+  mrb_int len;
+
+  mrb_get_args(mrb, "s", &name, &len);
+  FC_LOCK();
+  font->fc_pattern = font_match(name);
+  FC_UNLOCK();
+
+  return mrb_font;
+
+#else
+  return mrb_nil_value();
+#endif
+}
+
+/* Fonts of the system, optionally restricted to a family, style and
+ * language (case-insensitive) */
+static mrb_value
+font_list(mrb_state *mrb, mrb_value self) {
+  mrb_value ary = mrb_ary_new(mrb);
+#ifdef CAIRO_HAS_FC_FONT
+  mrb_value opts = mrb_nil_value();
+  const char *family, *style, *lang;
+  int i, end;
+
+  mrb_get_args(mrb, "|H", &opts);
+  family = opt_str(mrb, opts, waah_state(mrb)->id_family);
+  style = opt_str(mrb, opts, waah_state(mrb)->id_style);
+  lang = opt_str(mrb, opts, waah_state(mrb)->id_lang);
+
+  font_catalog_get();
+  for(i = font_catalog_find(family, &end); i < end; i++) {
+    struct font_catalog_entry *entry = &font_catalog.entries[i];
+    waah_font_t *font;
+
+    if(style != NULL && font_name_cmp(entry->style, style) != 0) {
+      continue;
+    }
+    if(lang != NULL) {
+      FcLangSet *lang_set;
+      int has_lang;
+      FC_LOCK();
+      has_lang = FcPatternGetLangSet(entry->pattern, FC_LANG, 0, &lang_set) == FcResultMatch &&
+                 FcLangSetHasLang(lang_set, (const FcChar8 *) lang) != FcLangDifferentLang;
+      FC_UNLOCK();
+      if(!has_lang) {
+        continue;
+      }
+    }
+
+    mrb_ary_push(mrb, ary, font_new(mrb, &font));
+    FC_LOCK();
+    font->fc_pattern = entry->pattern;
+    FcPatternReference(font->fc_pattern);
+    FC_UNLOCK();
+  }
+#endif
+
+  return ary;
+}
+
+/* Names of the font families of the system, without creating fonts */
+static mrb_value
+font_families(mrb_state *mrb, mrb_value self) {
+  mrb_value ary = mrb_ary_new(mrb);
+#ifdef CAIRO_HAS_FC_FONT
+  int i;
+
+  font_catalog_get();
+  for(i = 0; i < font_catalog.n_entries; i++) {
+    const char *family = font_catalog.entries[i].family;
+    if(family != NULL && (i == 0 || font_name_cmp(font_catalog.entries[i - 1].family, family) != 0)) {
+      mrb_ary_push(mrb, ary, mrb_str_new_cstr(mrb, family));
+    }
+  }
+#endif
+
+  return ary;
+}
+
+/* Builds the font catalog in the background, so that the first Font.find
+ * or Font.list does not have to wait for fontconfig */
+static mrb_value
+font_preload(mrb_state *mrb, mrb_value self) {
+#ifdef CAIRO_HAS_FC_FONT
+#ifdef WAAH_HAVE_THREADS
+  pthread_t thread;
+  int start;
+
+  FC_LOCK();
+  start = !font_catalog.built && !font_catalog.preloading;
+  font_catalog.preloading = TRUE;
+  FC_UNLOCK();
+
+  if(start) {
+    if(pthread_create(&thread, NULL, font_catalog_preload, NULL) == 0) {
+      pthread_detach(thread);
+    } else {
+      font_catalog_get();
+    }
+  }
+#else
+  font_catalog_get();
+#endif
+#endif
+
+  return mrb_nil_value();
+}
+
+static mrb_value
+font_name(mrb_state *mrb, mrb_value self) {
+  waah_font_t *font;
+  mrb_value retval;
+  char *name = NULL;
+  int free_name = FALSE;
+
+  Data_Get_Struct(mrb, self, &_waah_font_type_info, font);
+
+  if(font->ft_face != NULL) {
+    name = (char *) FT_Get_Postscript_Name(font->ft_face);
+  }
+
+#ifdef CAIRO_HAS_FC_FONT
+  else if(font->fc_pattern != NULL) {
+    FC_LOCK();
+    name = (char *) FcNameUnparse(font->fc_pattern);
+    FC_UNLOCK();
+    free_name = TRUE;
+  }
+#endif
+
+  if(name != NULL) {
+    retval = mrb_str_new_cstr(mrb, name);
+  } else {
+    retval = mrb_nil_value();
+  }
+
+  if(free_name) {
+    free(name);
+  }
+
+  return retval;
+}
+
+
+
+
+static mrb_value
+font_get_prop(mrb_state *mrb, mrb_value self, const char *prop) {
+  waah_font_t *font;
+  mrb_value retval;
+  char *name = NULL;
+  int free_name = FALSE;
+
+  Data_Get_Struct(mrb, self, &_waah_font_type_info, font);
+
+#ifdef CAIRO_HAS_FC_FONT
+  if(font->fc_pattern != NULL) {
+    FC_LOCK();
+    if(FcPatternGetString(font->fc_pattern,
+          prop, 0, (FcChar8 **)&name) != FcResultMatch) {
+      name = NULL;
+    }
+    FC_UNLOCK();
+    free_name = FALSE;
+  }
+#endif
+
+  if(name != NULL) {
+    retval = mrb_str_new_cstr(mrb, name);
+  } else {
+    retval = mrb_nil_value();
+  }
+
+  if(free_name) {
+    free(name);
+  }
+
+  return retval;
+}
+
+static mrb_value
+font_family(mrb_state *mrb, mrb_value self) {
+#ifdef CAIRO_HAS_FC_FONT
+  return font_get_prop(mrb, self, FC_FAMILY);
+#else
+  return mrb_nil_value();
+#endif
+}
+
+static mrb_value
+font_style(mrb_state *mrb, mrb_value self) {
+#ifdef CAIRO_HAS_FC_FONT
+  return font_get_prop(mrb, self, FC_STYLE);
+#else
+  return mrb_nil_value();
+#endif
+}
+
+static mrb_value
+path_initialize(mrb_state *mrb, mrb_value self) {
+  waah_path_t *path = (waah_path_t *) mrb_calloc(mrb, sizeof(waah_path_t), 1);
+
+  DATA_PTR(self) = path;
+  DATA_TYPE(self) = &_waah_path_type_info;
+
+  return self;
+}
+
+static mrb_value
+path_new(mrb_state *mrb, waah_path_t **rpath) {
+  mrb_value mrb_path = mrb_class_new_instance(mrb, 0, NULL, waah_state(mrb)->cPath);
+  Data_Get_Struct(mrb, mrb_path, &_waah_path_type_info, *rpath);
+  return mrb_path;
+}
+
+/* Returns the path's scratch context for reading only, keeping the cached
+ * path data */
+static cairo_t *
+path_read_cr(waah_path_t *path) {
+  if(path->cr == NULL) {
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_A8, 0, 0);
+    path->cr = cairo_create(surface);
+    cairo_surface_destroy(surface);
+  }
+
+  return path->cr;
+}
+
+/* Returns the path's scratch context, invalidating the cached path data */
+static cairo_t *
+path_cr(waah_path_t *path) {
+  if(path->cr_path != NULL) {
+    cairo_path_destroy(path->cr_path);
+    path->cr_path = NULL;
+  }
+
+  return path_read_cr(path);
+}
+
+static cairo_path_t *
+path_get_cr_path(waah_path_t *path) {
+  if(path->cr_path == NULL) {
+    path->cr_path = cairo_copy_path(path_read_cr(path));
+  }
+  return path->cr_path;
+}
+
+static cairo_t *
+path_target_cr(mrb_state *mrb, mrb_value self) {
+  waah_path_t *path = (waah_path_t *) mrb_data_check_get_ptr(mrb, self, &_waah_path_type_info);
+  waah_canvas_t *canvas;
+
+  if(path != NULL) {
+    return path_cr(path);
+  }
+
+  Data_Get_Struct(mrb, self, &_waah_canvas_type_info, canvas);
+  return canvas_cr(mrb, canvas);
+}
+
+static void
+path_apply_matrix(waah_path_t *path, const cairo_matrix_t *matrix) {
+  cairo_path_t *cr_path = path_get_cr_path(path);
+  cairo_t *cr;
+  int i, j;
+
+  for(i = 0; i < cr_path->num_data; i += cr_path->data[i].header.length) {
+    for(j = 1; j < cr_path->data[i].header.length; j++) {
+      cairo_matrix_transform_point(matrix,
+                                   &cr_path->data[i + j].point.x,
+                                   &cr_path->data[i + j].point.y);
+    }
+  }
+
+  /* path_cr drops cr_path, so take it over before rebuilding */
+  path->cr_path = NULL;
+  cr = path_cr(path);
+  cairo_new_path(cr);
+  cairo_append_path(cr, cr_path);
+  path->cr_path = cr_path;
+}
+
+static mrb_value
+path_translate(mrb_state *mrb, mrb_value self) {
+  waah_path_t *path;
+  mrb_float x, y;
+  cairo_matrix_t matrix;
+  Data_Get_Struct(mrb, self, &_waah_path_type_info, path);
+
+  mrb_get_args(mrb, "ff", &x, &y);
+  cairo_matrix_init_translate(&matrix, x, y);
+  path_apply_matrix(path, &matrix);
+
+  return self;
+}
+
+static mrb_value
+path_scale(mrb_state *mrb, mrb_value self) {
+  waah_path_t *path;
+  mrb_float x, y;
+  cairo_matrix_t matrix;
+  Data_Get_Struct(mrb, self, &_waah_path_type_info, path);
+
+  mrb_get_args(mrb, "ff", &x, &y);
+  cairo_matrix_init_scale(&matrix, x, y);
+  path_apply_matrix(path, &matrix);
+
+  return self;
+}
+
+static mrb_value
+path_rotate(mrb_state *mrb, mrb_value self) {
+  waah_path_t *path;
+  mrb_float r;
+  cairo_matrix_t matrix;
+  Data_Get_Struct(mrb, self, &_waah_path_type_info, path);
+
+  mrb_get_args(mrb, "f", &r);
+  cairo_matrix_init_rotate(&matrix, r);
+  path_apply_matrix(path, &matrix);
+
+  return self;
+}
+
+static mrb_value
+path_transform(mrb_state *mrb, mrb_value self) {
+  waah_path_t *path;
+  mrb_float xx, yx, xy, yy, x0, y0;
+  cairo_matrix_t matrix;
+  Data_Get_Struct(mrb, self, &_waah_path_type_info, path);
+
+  mrb_get_args(mrb, "ffffff", &xx, &yx, &xy, &yy, &x0, &y0);
+  cairo_matrix_init(&matrix, xx, yx, xy, yy, x0, y0);
+  path_apply_matrix(path, &matrix);
+
+  return self;
+}
+
+static mrb_value
+path_extents(mrb_state *mrb, mrb_value self) {
+  waah_path_t *path;
+  double x1, x2, y1, y2;
+  mrb_value vals[4];
+  Data_Get_Struct(mrb, self, &_waah_path_type_info, path);
+
+  cairo_path_extents(path_read_cr(path), &x1, &y1, &x2, &y2);
+  vals[0] = mrb_float_value(mrb, x1);
+  vals[1] = mrb_float_value(mrb, y1);
+  vals[2] = mrb_float_value(mrb, x2 - x1);
+  vals[3] = mrb_float_value(mrb, y2 - y1);
+  return mrb_ary_new_from_values(mrb, 4, vals);
+}
+
+static mrb_value
+path_clear(mrb_state *mrb, mrb_value self) {
+  waah_path_t *path;
+  Data_Get_Struct(mrb, self, &_waah_path_type_info, path);
+
+  cairo_new_path(path_cr(path));
+
+  return self;
+}
+
+/* Pixel access needs an image surface, which the canvas a Picture is
+ * recorded with does not have */
+static void
+canvas_check_image(mrb_state *mrb, waah_canvas_t *canvas) {
+  if(cairo_surface_get_type(canvas->surface) != CAIRO_SURFACE_TYPE_IMAGE) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "canvas is recording a picture");
+  }
+}
+
+static mrb_value
+canvas_initialize(mrb_state *mrb, mrb_value self) {
+  waah_canvas_t *canvas;
+  mrb_int w, h;
+  mrb_value opts = mrb_nil_value();
+  mrb_sym format_sym;
+  cairo_format_t format = CAIRO_FORMAT_ARGB32;
+
+  mrb_get_args(mrb, "ii|H", &w, &h, &opts);
+
+  format_sym = opt_sym(mrb, opts, waah_state(mrb)->id_format);
+  if(format_sym != 0) {
+    format = format_from_sym(mrb, format_sym);
+  }
+
+  canvas = (waah_canvas_t *) mrb_calloc(mrb, sizeof(waah_canvas_t), 1);
+  DATA_PTR(self) = canvas;
+  DATA_TYPE(self) = &_waah_canvas_type_info;
+
+  canvas->width = w;
+  canvas->height = h;
+  canvas->surface = surface_pool_create(format, canvas->width, canvas->height);
+  canvas->cr = cairo_create(canvas->surface);
+
+  return self;
+}
+
+/* Clears the pixels and resets the drawing state, for reusing a canvas
+ * instead of allocating a new one */
+static mrb_value
+canvas_reset(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  canvas_check_image(mrb, canvas);
+
+  if(canvas->snapshots != NULL &&
+     cairo_surface_get_user_data(canvas->surface, &pool_key) != NULL) {
+    /* The snapshots can have the old pixels, instead of a copy of them */
+    cairo_surface_t *surface = surface_pool_create(cairo_image_surface_get_format(canvas->surface),
+                                                   canvas->width, canvas->height);
+    if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+      cairo_surface_destroy(surface);
+      raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
+    }
+    while(canvas->snapshots != NULL) {
+      snapshot_unlink(canvas->snapshots);
+    }
+    cairo_surface_destroy(canvas->surface);
+    canvas->surface = surface;
+  } else {
+    _waah_canvas_detach_snapshots(canvas);
+    cairo_surface_flush(canvas->surface);
+    memset(cairo_image_surface_get_data(canvas->surface), 0,
+           (size_t) cairo_image_surface_get_stride(canvas->surface) * canvas->height);
+    cairo_surface_mark_dirty(canvas->surface);
+  }
+
+  cairo_destroy(canvas->cr);
+  canvas->cr = cairo_create(canvas->surface);
+
+  return self;
+}
+
+static mrb_value
+canvas_s_pool_limit(mrb_state *mrb, mrb_value self) {
+  size_t limit;
+
+  POOL_LOCK();
+  limit = surface_pool.limit;
+  POOL_UNLOCK();
+
+  return mrb_fixnum_value(limit);
+}
+
+/* Maximum number of bytes kept in idle buffers, 0 disables the pool */
+static mrb_value
+canvas_s_set_pool_limit(mrb_state *mrb, mrb_value self) {
+  mrb_int limit;
+
+  mrb_get_args(mrb, "i", &limit);
+  if(limit < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "limit must not be negative");
+  }
+
+  POOL_LOCK();
+  surface_pool.limit = limit;
+  pool_trim(surface_pool.limit);
+  POOL_UNLOCK();
+
+  return mrb_fixnum_value(limit);
+}
+
+static mrb_value
+canvas_s_pool_stats(mrb_state *mrb, mrb_value self) {
+  mrb_value stats = mrb_hash_new(mrb);
+  waah_state_t *state = waah_state(mrb);
+
+  POOL_LOCK();
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_limit), mrb_fixnum_value(surface_pool.limit));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_bytes), mrb_fixnum_value(surface_pool.bytes));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_buffers), mrb_fixnum_value(surface_pool.buffers));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_hits), mrb_fixnum_value(surface_pool.hits));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_misses), mrb_fixnum_value(surface_pool.misses));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_discarded), mrb_fixnum_value(surface_pool.discarded));
+  POOL_UNLOCK();
+
+  return stats;
+}
+
+static mrb_value
+canvas_color(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_int r, g, b;
+  double a = 1.0;
+  mrb_value _a;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_int n_args = mrb_get_args(mrb, "iii|o", &r, &g, &b, &_a);
+
+  if(n_args > 3) {
+    switch (mrb_type(_a)) {
+        case MRB_TT_FIXNUM:
+          a = (double)mrb_fixnum(_a) / 255.0;
+          break;
+        case MRB_TT_FLOAT:
+          a = mrb_float(_a);
+          break;
+        default:
+          mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid alpha argument");
+          return self;
+    }
+  }
+
+
+  cairo_set_source_rgba(cr, (double)r / 255.0, (double)g / 255.0, (double)b / 255.0, a);
+
+  return self;
+}
+
+
+static mrb_value
+pattern_linear(mrb_state *mrb, mrb_value self) {
+
+  waah_pattern_t *pattern;
+  mrb_float x0, y0, x1, y1;
+  mrb_value mrb_pattern = pattern_new(mrb, &pattern);
+
+  mrb_get_args(mrb, "ffff", &x0, &y0, &x1, &y1);
+
+  pattern->cr_pattern  = cairo_pattern_create_linear(x0,
+                                                     y0,
+                                                     x1,
+                                                     y1);
+
+  return mrb_pattern;
+}
+
+static mrb_value
+pattern_radial(mrb_state *mrb, mrb_value self) {
+
+  waah_pattern_t *pattern;
+  mrb_float cx0, cy0, radius0, cx1, cy1, radius1;
+
+  mrb_value mrb_pattern = pattern_new(mrb, &pattern);
+
+  mrb_get_args(mrb, "ffffff", &cx0, &cy0, &radius0, &cx1, &cy1, &radius1);
+
+  pattern->cr_pattern  = cairo_pattern_create_radial(cx0,
+                                                     cy0,
+                                                     radius0,
+                                                     cx1,
+                                                     cy1,
+                                                     radius1);
+
+  return mrb_pattern;
+}
+
+static mrb_value
+pattern_color_stop(mrb_state *mrb, mrb_value self) {
+  mrb_int r, g, b;
+  double a = 1.0;
+  mrb_value _a;
+  mrb_float off;
+  waah_pattern_t *pattern;
+  Data_Get_Struct(mrb, self, &_waah_pattern_type_info, pattern);
+
+  mrb_int n_args = mrb_get_args(mrb, "fiii|o", &off, &r, &g, &b, &_a);
+
+  if(n_args > 4) {
+    switch (mrb_type(_a)) {
+        case MRB_TT_FIXNUM:
+          a = (double)mrb_fixnum(_a) / 255.0;
+          break;
+        case MRB_TT_FLOAT:
+          a = mrb_float(_a);
+          break;
+        default:
+          mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid alpha argument");
+          return self;
+    }
+  }
+
+  cairo_pattern_add_color_stop_rgba(pattern->cr_pattern,
+                                    off, (double)r / 255.0,
+                                    (double)g / 255.0, (double)b / 255.0, a);
+
+  return self;
+}
+
+/* Grayscale images are A8 surfaces holding luminance, which cairo would
+ * take for alpha. As a source they are expanded to RGB24, for as long as
+ * the source is set. Returns a reference the caller has to destroy. */
+static cairo_surface_t *
+image_source_surface(waah_image_t *image) {
+  cairo_surface_t *expanded;
+  unsigned char *src, *dst;
+  int w, h, src_stride, dst_stride, y;
+
+  if(!image->gray) {
+    return cairo_surface_reference(image->surface);
+  }
+
+  w = cairo_image_surface_get_width(image->surface);
+  h = cairo_image_surface_get_height(image->surface);
+  expanded = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
+  if(cairo_surface_status(expanded) != CAIRO_STATUS_SUCCESS) {
+    return expanded;
+  }
+
+  cairo_surface_flush(image->surface);
+  src = cairo_image_surface_get_data(image->surface);
+  dst = cairo_image_surface_get_data(expanded);
+  src_stride = cairo_image_surface_get_stride(image->surface);
+  dst_stride = cairo_image_surface_get_stride(expanded);
+  for(y = 0; y < h; y++) {
+    swizzle_gray_to_xrgb32(dst + (size_t) y * dst_stride, src + (size_t) y * src_stride, w);
+  }
+  cairo_surface_mark_dirty(expanded);
+
+  return expanded;
+}
+
+static mrb_value
+canvas_image(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_value mrb_image;
+  mrb_float x = 0, y = 0;
+  waah_image_t *image;
+  cairo_surface_t *source;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "o|ff", &mrb_image, &x, &y);
+  Data_Get_Struct(mrb, mrb_image, &_waah_image_type_info, image);
+
+  /* A snapshot of the canvas itself must not share its pixels */
+  if(image->snapshot_of == canvas) {
+    _waah_canvas_detach_snapshots(canvas);
+  }
+
+  /* Decodes lazy images, the pattern keeps them from being evicted */
+  image_surface(mrb, image);
+  source = image_source_surface(image);
+  cairo_set_source_surface(cr, source, x, y);
+  cairo_surface_destroy(source);
+
+  return self;
+}
+
+/* Very similar to #image, merge ? */
+static mrb_value
+canvas_canvas(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_value mrb_canvas;
+  mrb_float x = 0, y = 0;
+  waah_canvas_t *_canvas;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "o|ff", &mrb_canvas, &x, &y);
+  Data_Get_Struct(mrb, mrb_canvas, &_waah_canvas_type_info, _canvas);
+
+  if(canvas == _canvas) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "cannot use self");
+  }
+
+  cairo_set_source_surface(cr, _canvas->surface, x, y);
+
+  return self;
+}
+
+static mrb_value
+canvas_pattern(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_value mrb_pattern;
+  waah_pattern_t *pattern;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "o", &mrb_pattern);
+  Data_Get_Struct(mrb, mrb_pattern, &_waah_pattern_type_info, pattern);
+
+  cairo_set_source(cr, pattern->cr_pattern);
+
+  return self;
+}
+
+static void
+_cairo_ellipse(cairo_t *cr, double cx, double cy, double rw, double rh) {
+  cairo_save(cr);
+  cairo_translate(cr, cx, cy);
+  cairo_scale(cr, rw / 2., rh / 2.);
+  cairo_arc(cr, 0., 0., 1., 0., 2 * M_PI);
+  cairo_restore(cr);
+}
+
+static mrb_value
+canvas_ellipse(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  mrb_float cx, cy, rw, rh;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ffff", &cx, &cy, &rw, &rh);
+
+  _cairo_ellipse(cr, cx, cy, rw, rh);
+
+  return self;
+}
+
+static mrb_value
+canvas_circle(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  mrb_float cx, cy, r;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "fff", &cx, &cy, &r);
+
+  cairo_arc(cr, cx, cy, r, 0, 2 * M_PI);
+  /*_cairo_ellipse(cr, cx, cy, r, r);*/
+
+  return self;
+}
+
+
+static mrb_value
+canvas_rect(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  mrb_float x, y, w, h;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ffff", &x, &y, &w, &h);
+
+  cairo_rectangle(cr, x, y, w, h);
+
+  return self;
+}
+
+static mrb_value
+canvas_rounded_rect(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  mrb_float x, y, w, h, r;
+  double deg = M_PI / 180.0;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "fffff", &x, &y, &w, &h, &r);
+  /* From: http://cairographics.org/samples/rounded_rectangle/ */
+  cairo_new_path(cr);
+  cairo_arc(cr, x + w - r, y + r, r, -90 * deg, 0 * deg);
+  cairo_arc(cr, x + w - r, y + h - r, r, 0 * deg, 90 * deg);
+  cairo_arc(cr, x + r, y + h - r, r, 90 * deg, 180 * deg);
+  cairo_arc(cr, x + r, y + r, r, 180 * deg, 270 * deg);
+  cairo_close_path (cr);
+
+  return self;
+}
+
+
+
+
+#define SHOW_TEXT_GLYPHS 64
+
+/* Draws text with its origin at (x, y), blitting glyphs from the cache of
+ * the current scaled font. Unlike cairo_show_text, it leaves the path and
+ * the current point alone. */
+static cairo_status_t
+show_text_at(cairo_t *cr, double x, double y, const char *text, int len) {
+  cairo_glyph_t stack_glyphs[SHOW_TEXT_GLYPHS];
+  cairo_glyph_t *glyphs = stack_glyphs;
+  int n_glyphs = SHOW_TEXT_GLYPHS;
+  cairo_status_t status;
+
+  status = cairo_scaled_font_text_to_glyphs(cairo_get_scaled_font(cr), x, y, text, len,
+                                            &glyphs, &n_glyphs, NULL, NULL, NULL);
+  if(status == CAIRO_STATUS_SUCCESS) {
+    cairo_show_glyphs(cr, glyphs, n_glyphs);
+  }
+  /* cairo allocates a larger array if needed */
+  if(glyphs != stack_glyphs) {
+    cairo_glyph_free(glyphs);
+  }
+  return status;
+}
+
+static mrb_value
+canvas_text(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_float x, y;
+  char *text;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ffz", &x, &y, &text);
+
+  cairo_move_to(cr, (double)x, (double)y);
+  cairo_text_path(cr, text);
+
+  return self;
+}
+
+/* Draws text right away with the current font and source. Faster than
+ * text followed by fill, but no path is built for clipping or stroking. */
+static mrb_value
+canvas_draw_text(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_float x, y;
+  char *text;
+  mrb_int len;
+  cairo_status_t status;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ffs", &x, &y, &text, &len);
+
+  _waah_canvas_detach_snapshots(canvas);
+  status = show_text_at(cr, x, y, text, len);
+  if(status != CAIRO_STATUS_SUCCESS && !raise_cairo_status(mrb, status)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, cairo_status_to_string(status));
+  }
+
+  return self;
+}
+
+static mrb_value
+canvas_text_extents(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  cairo_text_extents_t e;
+  char *text;
+  mrb_value vals[6];
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "z", &text);
+
+  cairo_text_extents(cr, text, &e);
+
+  vals[0] = mrb_float_value(mrb, e.width);
+  vals[1] = mrb_float_value(mrb, e.height);
+  vals[2] = mrb_float_value(mrb, e.x_bearing);
+  vals[3] = mrb_float_value(mrb, e.y_bearing);
+  vals[4] = mrb_float_value(mrb, e.x_advance);
+  vals[5] = mrb_float_value(mrb, e.y_advance);
+
+  return mrb_ary_new_from_values(mrb, 6, vals);
+}
+
+/* Canvas#text_extents_many(strings, double: false) measures all strings at
+ * once and returns their extents packed into a String, six native floats
+ * (or doubles) per string in the order of text_extents */
+static mrb_value
+canvas_text_extents_many(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_value strings, opts = mrb_nil_value(), out;
+  mrb_bool dbl;
+  mrb_int i;
+  cairo_scaled_font_t *scaled_font;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "A|H", &strings, &opts);
+  dbl = opt_bool(mrb, opts, waah_state(mrb)->id_double);
+
+  for(i = 0; i < RARRAY_LEN(strings); i++) {
+    if(!mrb_string_p(RARRAY_PTR(strings)[i])) {
+      mrb_raise(mrb, E_TYPE_ERROR, "expected an Array of Strings");
+    }
+  }
+
+  scaled_font = cairo_get_scaled_font(cr);
+  out = mrb_str_buf_new(mrb, RARRAY_LEN(strings) * 6 * (dbl ? sizeof(double) : sizeof(float)));
+  for(i = 0; i < RARRAY_LEN(strings); i++) {
+    mrb_value str = RARRAY_PTR(strings)[i];
+    cairo_glyph_t stack_glyphs[SHOW_TEXT_GLYPHS];
+    cairo_glyph_t *glyphs = stack_glyphs;
+    int n_glyphs = SHOW_TEXT_GLYPHS;
+    cairo_text_extents_t e;
+    cairo_status_t status;
+    double vals[6];
+    int j;
+
+    status = cairo_scaled_font_text_to_glyphs(scaled_font, 0, 0, RSTRING_PTR(str), RSTRING_LEN(str),
+                                              &glyphs, &n_glyphs, NULL, NULL, NULL);
+    if(status == CAIRO_STATUS_SUCCESS) {
+      cairo_scaled_font_glyph_extents(scaled_font, glyphs, n_glyphs, &e);
+    }
+    if(glyphs != stack_glyphs) {
+      cairo_glyph_free(glyphs);
+    }
+    if(status != CAIRO_STATUS_SUCCESS && !raise_cairo_status(mrb, status)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, cairo_status_to_string(status));
+    }
+
+    vals[0] = e.width;
+    vals[1] = e.height;
+    vals[2] = e.x_bearing;
+    vals[3] = e.y_bearing;
+    vals[4] = e.x_advance;
+    vals[5] = e.y_advance;
+    for(j = 0; j < 6; j++) {
+      if(dbl) {
+        mrb_str_cat(mrb, out, (const char *) &vals[j], sizeof(double));
+      } else {
+        float f = (float) vals[j];
+        mrb_str_cat(mrb, out, (const char *) &f, sizeof(float));
+      }
+    }
+  }
+
+  return out;
+}
+
+/* Paragraph layout for Canvas#text_box. The text is mapped to glyphs once,
+ * lines are then broken greedily and measured from the glyph positions. */
+struct layout_char {
+  uint32_t cp;
+  /* Start of the char in the text */
+  size_t off;
+  /* First glyph of the cluster the char starts, -1 inside a cluster */
+  int glyph;
+  int n_glyphs;
+  /* Position and advance of its cluster */
+  double x;
+  double advance;
+};
+
+struct layout_line {
+  int start;
+  int end;
+  double x;
+  double width;
+};
+
+static int
+layout_is_space(uint32_t cp) {
+  return cp == ' ' || cp == '\t' || cp == 0x3000;
+}
+
+static int
+layout_is_newline(uint32_t cp) {
+  return cp == '\n' || cp == '\r' || cp == 0x2028 || cp == 0x2029;
+}
+
+/* Scripts written without spaces, which may break between any two chars */
+static int
+layout_is_ideographic(uint32_t cp) {
+  return (cp >= 0x2e80 && cp <= 0x9fff) || (cp >= 0xac00 && cp <= 0xd7af) ||
+         (cp >= 0xf900 && cp <= 0xfaff) || (cp >= 0xff00 && cp <= 0xffef) ||
+         (cp >= 0x20000 && cp <= 0x3ffff);
+}
+
+/* Closing punctuation, which must not start a line */
+static int
+layout_no_break_before(uint32_t cp) {
+  if(cp < 0x80) {
+    return cp != 0 && strchr(",.;:!?)]}%", (int) cp) != NULL;
+  }
+  return cp == 0x3001 || cp == 0x3002 || cp == 0xff0c || cp == 0xff0e ||
+         cp == 0xff01 || cp == 0xff1f || cp == 0x300d || cp == 0x300f ||
+         cp == 0xff09 || cp == 0x30fc || cp == 0x2019 || cp == 0x201d;
+}
+
+/* Opening punctuation, which must not end a line */
+static int
+layout_no_break_after(uint32_t cp) {
+  return cp == '(' || cp == '[' || cp == '{' || cp == 0x300c || cp == 0x300e ||
+         cp == 0xff08 || cp == 0x2018 || cp == 0x201c;
+}
+
+/* Whether a line may break between a and b, a simplified version of the
+ * rules of UAX #14: after spaces, after hyphens and around ideographs */
+static int
+layout_break_between(uint32_t a, uint32_t b) {
+  if(layout_is_space(b) || layout_no_break_before(b) || layout_no_break_after(a)) {
+    return FALSE;
+  }
+  if(layout_is_space(a)) {
+    return TRUE;
+  }
+  if((a == '-' || a == 0x2010) && !(b >= '0' && b <= '9')) {
+    return TRUE;
+  }
+  return layout_is_ideographic(a) || layout_is_ideographic(b);
+}
+
+/* Decodes UTF-8, which cairo has already validated */
+static uint32_t
+layout_decode(const unsigned char *s, size_t *len) {
+  if(s[0] < 0x80) {
+    *len = 1;
+    return s[0];
+  } else if(s[0] < 0xe0) {
+    *len = 2;
+    return ((uint32_t) (s[0] & 0x1f) << 6) | (s[1] & 0x3f);
+  } else if(s[0] < 0xf0) {
+    *len = 3;
+    return ((uint32_t) (s[0] & 0x0f) << 12) | ((uint32_t) (s[1] & 0x3f) << 6) | (s[2] & 0x3f);
+  }
+  *len = 4;
+  return ((uint32_t) (s[0] & 0x07) << 18) | ((uint32_t) (s[1] & 0x3f) << 12) |
+         ((uint32_t) (s[2] & 0x3f) << 6) | (s[3] & 0x3f);
+}
+
+static double
+layout_width(struct layout_char *chars, int start, int *end) {
+  double width = 0;
+  int i;
+
+  /* Trailing spaces hang past the end of the line */
+  while(*end > start && (layout_is_space(chars[*end - 1].cp) || layout_is_newline(chars[*end - 1].cp))) {
+    (*end)--;
+  }
+  for(i = start; i < *end; i++) {
+    width += chars[i].advance;
+  }
+  return width;
+}
+
+/* Maps text to chars with the glyphs of their clusters. Returns the
+ * number of chars or -1. */
+static int
+layout_chars(const char *text, size_t len, cairo_glyph_t *glyphs, int n_glyphs,
+             cairo_text_cluster_t *clusters, int n_clusters, double end_x,
+             struct layout_char *chars) {
+  size_t off = 0, n;
+  int n_chars = 0, c, i, glyph = 0;
+
+  while(off < len) {
+    chars[n_chars].cp = layout_decode((const unsigned char *) text + off, &n);
+    chars[n_chars].off = off;
+    chars[n_chars].glyph = -1;
+    chars[n_chars].n_glyphs = 0;
+    chars[n_chars].x = 0;
+    chars[n_chars].advance = 0;
+    off += n;
+    n_chars++;
+  }
+
+  off = 0;
+  i = 0;
+  for(c = 0; c < n_clusters; c++) {
+    double x = glyph < n_glyphs ? glyphs[glyph].x : end_x;
+    double next_x = glyph + clusters[c].num_glyphs < n_glyphs ?
+                    glyphs[glyph + clusters[c].num_glyphs].x : end_x;
+
+    if(i >= n_chars || chars[i].off != off) {
+      return -1;
+    }
+    chars[i].glyph = glyph;
+    chars[i].n_glyphs = clusters[c].num_glyphs;
+    chars[i].advance = next_x - x;
+    for(; i < n_chars && chars[i].off < off + clusters[c].num_bytes; i++) {
+      chars[i].x = x;
+    }
+    off += clusters[c].num_bytes;
+    glyph += clusters[c].num_glyphs;
+  }
+
+  return n_chars;
+}
+
+/* Canvas#text_box(x, y, w, h, str, align: :left, line_height: nil,
+ * ellipsis: false) lays out str in lines of at most w and draws as many
+ * as fit into h in one go, with the current font and source. Lines break
+ * at newlines, after spaces and hyphens and around ideographs; words
+ * longer than a line are split. With ellipsis (true for "…" or a
+ * String) the last line is shortened to mark the text that did not fit.
+ * Returns [x, baseline, width, first char, char count] for every line
+ * drawn. */
+static mrb_value
+canvas_text_box(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_float x, y, w, h;
+  char *text;
+  mrb_int len;
+  mrb_value opts = mrb_nil_value(), mrb_ellipsis, result;
+  waah_state_t *state = waah_state(mrb);
+  mrb_sym align;
+  double line_height;
+  const char *ellipsis = NULL;
+  size_t ellipsis_len = 0;
+  cairo_scaled_font_t *scaled_font;
+  cairo_font_extents_t font_extents;
+  cairo_text_extents_t extents;
+  cairo_glyph_t *glyphs = NULL, *ellipsis_glyphs = NULL, *out = NULL;
+  cairo_text_cluster_t *clusters = NULL;
+  cairo_text_cluster_flags_t cluster_flags = 0;
+  int n_glyphs = 0, n_clusters = 0, n_ellipsis_glyphs = 0, n_out = 0;
+  struct layout_char *chars = NULL;
+  struct layout_line *lines = NULL;
+  int n_chars = 0, n_lines = 0, max_lines, start, i, overflow = FALSE;
+  double ellipsis_width = 0, fit;
+  cairo_status_t status;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ffffs|H", &x, &y, &w, &h, &text, &len, &opts);
+
+  align = opt_sym(mrb, opts, state->id_align);
+  if(align == 0) {
+    align = state->id_left;
+  } else if(align != state->id_left && align != state->id_center && align != state->id_right) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid align option");
+  }
+
+  scaled_font = cairo_get_scaled_font(cr);
+  cairo_scaled_font_extents(scaled_font, &font_extents);
+
+  line_height = font_extents.height;
+  if(!mrb_nil_p(opts)) {
+    mrb_value val = mrb_hash_get(mrb, opts, mrb_symbol_value(state->id_line_height));
+    if(!mrb_nil_p(val)) {
+      line_height = mrb_to_flo(mrb, val);
+    }
+    mrb_ellipsis = mrb_hash_get(mrb, opts, mrb_symbol_value(state->id_ellipsis));
+    if(mrb_string_p(mrb_ellipsis)) {
+      ellipsis = RSTRING_PTR(mrb_ellipsis);
+      ellipsis_len = RSTRING_LEN(mrb_ellipsis);
+    } else if(mrb_test(mrb_ellipsis)) {
+      ellipsis = "\xe2\x80\xa6";
+      ellipsis_len = 3;
+    }
+  }
+  if(w <= 0 || line_height <= 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid text box size");
+  }
+
+  status = cairo_scaled_font_text_to_glyphs(scaled_font, 0, 0, text, len,
+                                            &glyphs, &n_glyphs, &clusters, &n_clusters,
+                                            &cluster_flags);
+  if(status == CAIRO_STATUS_SUCCESS && ellipsis != NULL) {
+    status = cairo_scaled_font_text_to_glyphs(scaled_font, 0, 0, ellipsis, ellipsis_len,
+                                              &ellipsis_glyphs, &n_ellipsis_glyphs,
+                                              NULL, NULL, NULL);
+    if(status == CAIRO_STATUS_SUCCESS) {
+      cairo_scaled_font_glyph_extents(scaled_font, ellipsis_glyphs, n_ellipsis_glyphs, &extents);
+      ellipsis_width = extents.x_advance;
+    }
+  }
+  if(status != CAIRO_STATUS_SUCCESS) {
+    goto done;
+  }
+
+  cairo_scaled_font_glyph_extents(scaled_font, glyphs, n_glyphs, &extents);
+  chars = (struct layout_char *) mrb_malloc_simple(mrb, (len + 1) * sizeof(struct layout_char));
+  lines = (struct layout_line *) mrb_malloc_simple(mrb, (len + 1) * sizeof(struct layout_line));
+  out = (cairo_glyph_t *) mrb_malloc_simple(mrb, (n_glyphs + n_ellipsis_glyphs + 1) * sizeof(cairo_glyph_t));
+  if(chars == NULL || lines == NULL || out == NULL) {
+    status = CAIRO_STATUS_NO_MEMORY;
+    goto done;
+  }
+
+  n_chars = layout_chars(text, len, glyphs, n_glyphs, clusters, n_clusters,
+                         (n_glyphs > 0 ? glyphs[0].x : 0) + extents.x_advance, chars);
+  if(n_chars < 0 || (cluster_flags & CAIRO_TEXT_CLUSTER_FLAG_BACKWARD)) {
+    status = CAIRO_STATUS_INVALID_CLUSTERS;
+    goto done;
+  }
+
+  fit = floor(h / line_height + 1e-9);
+  max_lines = fit < n_chars + 1 ? (int) fit : n_chars + 1;
+  for(start = 0; start < n_chars && n_lines < max_lines; ) {
+    double width = 0;
+    int last_break = -1, end = n_chars, next = n_chars;
+
+    for(i = start; i < n_chars; i++) {
+      if(layout_is_newline(chars[i].cp)) {
+        end = i;
+        next = i + 1;
+        /* \r\n is one break */
+        if(chars[i].cp == '\r' && next < n_chars && chars[next].cp == '\n') {
+          next++;
+        }
+        break;
+      }
+      if(width + chars[i].advance > w && i > start && !layout_is_space(chars[i].cp)) {
+        end = next = last_break >= 0 ? last_break + 1 : i;
+        break;
+      }
+      width += chars[i].advance;
+      if(i + 1 < n_chars && layout_break_between(chars[i].cp, chars[i + 1].cp)) {
+        last_break = i;
+      }
+    }
+
+    lines[n_lines].start = start;
+    lines[n_lines].end = end;
+    lines[n_lines].width = layout_width(chars, start, &lines[n_lines].end);
+    n_lines++;
+    start = next;
+  }
+  overflow = start < n_chars;
+
+  if(overflow && ellipsis != NULL && n_lines > 0) {
+    struct layout_line *line = &lines[n_lines - 1];
+    while(line->end > line->start && line->width + ellipsis_width > w) {
+      line->end--;
+      line->width = layout_width(chars, line->start, &line->end);
+    }
+  }
+
+  for(i = 0; i < n_lines; i++) {
+    struct layout_line *line = &lines[i];
+    double lx = x, baseline = y + font_extents.ascent + i * line_height;
+    double origin = line->start < n_chars ? chars[line->start].x : 0;
+    double width = line->width;
+    int c, g;
+
+    if(overflow && ellipsis != NULL && i == n_lines - 1) {
+      width += ellipsis_width;
+    }
+    if(align == state->id_center) {
+      lx += (w - width) / 2;
+    } else if(align == state->id_right) {
+      lx += w - width;
+    }
+    line->x = lx;
+
+    for(c = line->start; c < line->end; c++) {
+      for(g = chars[c].glyph; g >= 0 && g < chars[c].glyph + chars[c].n_glyphs; g++) {
+        out[n_out] = glyphs[g];
+        out[n_out].x += lx - origin;
+        out[n_out].y += baseline;
+        n_out++;
+      }
+    }
+    if(overflow && ellipsis != NULL && i == n_lines - 1) {
+      for(g = 0; g < n_ellipsis_glyphs; g++) {
+        out[n_out] = ellipsis_glyphs[g];
+        out[n_out].x += lx + line->width;
+        out[n_out].y += baseline;
+        n_out++;
+      }
+    }
+    line->width = width;
+  }
+
+  if(n_out > 0) {
+    _waah_canvas_detach_snapshots(canvas);
+    cairo_show_glyphs(cr, out, n_out);
+  }
+
+done:
+  cairo_glyph_free(glyphs);
+  cairo_glyph_free(ellipsis_glyphs);
+  cairo_text_cluster_free(clusters);
+  mrb_free(mrb, chars);
+  mrb_free(mrb, out);
+  if(status != CAIRO_STATUS_SUCCESS) {
+    mrb_free(mrb, lines);
+    if(!raise_cairo_status(mrb, status)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, cairo_status_to_string(status));
+    }
+  }
+
+  result = mrb_ary_new_capa(mrb, n_lines);
+  for(i = 0; i < n_lines; i++) {
+    mrb_value vals[5];
+
+    vals[0] = mrb_float_value(mrb, lines[i].x);
+    vals[1] = mrb_float_value(mrb, y + font_extents.ascent + i * line_height);
+    vals[2] = mrb_float_value(mrb, lines[i].width);
+    vals[3] = mrb_fixnum_value(lines[i].start);
+    vals[4] = mrb_fixnum_value(lines[i].end - lines[i].start);
+    mrb_ary_push(mrb, result, mrb_ary_new_from_values(mrb, 5, vals));
+  }
+  mrb_free(mrb, lines);
+
+  return result;
+}
+
+static mrb_value
+canvas_path_extents(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  double x1, x2, y1, y2;
+  mrb_value vals[4];
+  CANVAS_DEFAULT_DECL_INITS;
+
+  cairo_path_extents(cr,
+                     &x1,
+                     &y1,
+                     &x2,
+                     &y2);
+  vals[0] = mrb_float_value(mrb, x1);
+  vals[1] = mrb_float_value(mrb, y1);
+  vals[2] = mrb_float_value(mrb, x2 - x1);
+  vals[3] = mrb_float_value(mrb, y2 - y1);
+  return mrb_ary_new_from_values(mrb, 4, vals);
+}
+
+static mrb_value
+canvas_font_size(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_float s;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "f", &s);
+
+  cairo_set_font_size(cr, s);
+
+  return self;
+}
+
+static cairo_font_face_t *
+font_get_cr_face(waah_font_t *font) {
+  if(font->cr_face == NULL) {
+#ifdef CAIRO_HAS_FC_FONT
+    if(font->fc_pattern != NULL) {
+      font->face = face_from_pattern(font->ft_lib, font->fc_pattern);
+      if(font->face != NULL) {
+        font->cr_face = cairo_font_face_reference(font->face->cr_face);
+      } else {
+        FC_LOCK();
+        font->cr_face = cairo_ft_font_face_create_for_pattern(font->fc_pattern);
+        FC_UNLOCK();
+      }
+    } else
+#endif
+      if(font->ft_face != NULL) {
+        font->cr_face = cairo_ft_font_face_create_for_ft_face(font->ft_face, 0);
+      }
+  }
+  return font->cr_face;
+}
+
+static mrb_value
+canvas_font(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_value mrb_font;
+  mrb_sym sym_slant, sym_weight;
+  int n_args;
+  cairo_font_slant_t slant = CAIRO_FONT_SLANT_NORMAL;
+  cairo_font_weight_t weight = CAIRO_FONT_WEIGHT_NORMAL;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  n_args = mrb_get_args(mrb, "o|nn", &mrb_font, &sym_weight, &sym_slant);
+
+  switch (mrb_type(mrb_font)) {
+    case MRB_TT_DATA: {
+      waah_font_t *font;
+      Data_Get_Struct(mrb, mrb_font, &_waah_font_type_info, font);
+      cairo_set_font_face(canvas->cr, font_get_cr_face(font));
+      break;
+    }
+    case MRB_TT_STRING: {
+      char *font_name = mrb_str_to_cstr(mrb, mrb_font);
+      if(sym_slant == waah_state(mrb)->id_italic) slant = CAIRO_FONT_SLANT_ITALIC;
+      else if(sym_slant == waah_state(mrb)->id_oblique) slant = CAIRO_FONT_SLANT_OBLIQUE;
+
+      if(sym_weight == waah_state(mrb)->id_bold) {
+        weight = CAIRO_FONT_WEIGHT_BOLD;
+      } else if(n_args == 2 && sym_weight == waah_state(mrb)->id_italic) {
+        slant = CAIRO_FONT_SLANT_ITALIC;
+      }
+      cairo_select_font_face(canvas->cr, font_name, slant, weight);
+      break;
+    }
+    default: {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "font must either be String or Font");
+      return mrb_nil_value();
+    }
+  }
+
+  return self;
+}
+
+static unsigned int
+text_run_hash(cairo_font_face_t *face, double size, const char *text, size_t len) {
+  unsigned int hash = 5381;
+  uint64_t size_bits;
+  size_t i;
+
+  for(i = 0; i < len; i++) {
+    hash = hash * 33 + (unsigned char) text[i];
+  }
+  memcpy(&size_bits, &size, sizeof(size_bits));
+  hash ^= (unsigned int) (size_bits ^ (size_bits >> 32));
+  hash ^= (unsigned int) ((uintptr_t) face >> 4);
+  return hash;
+}
+
+/* Returns FALSE unless text is well-formed UTF-8 */
+static int
+text_run_valid_utf8(const unsigned char *s, size_t len) {
+  size_t i, n, k;
+  uint32_t cp;
+
+  for(i = 0; i < len; i += n) {
+    if(s[i] < 0x80) n = 1;
+    else if(s[i] >= 0xc2 && s[i] < 0xe0) n = 2;
+    else if(s[i] >= 0xe0 && s[i] < 0xf0) n = 3;
+    else if(s[i] >= 0xf0 && s[i] < 0xf5) n = 4;
+    else return FALSE;
+
+    if(n > len - i) {
+      return FALSE;
+    }
+    for(k = 1; k < n; k++) {
+      if((s[i + k] & 0xc0) != 0x80) {
+        return FALSE;
+      }
+    }
+    /* Overlong forms, surrogates and code points past U+10FFFF */
+    cp = layout_decode(s + i, &k);
+    if((n == 3 && (cp < 0x800 || (cp >= 0xd800 && cp < 0xe000))) ||
+       (n == 4 && (cp < 0x10000 || cp > 0x10ffff))) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/* Positions the glyphs of the run's text in ft_face, which has to be
+ * scaled to the run's size. HarfBuzz shapes the text if available,
+ * otherwise there is one glyph per character, placed with FreeType's
+ * advances and kerning. Returns FALSE if out of memory. */
+static int
+text_run_shape_ft(waah_text_run_t *run, FT_Face ft_face) {
+#ifdef WAAH_HAVE_HARFBUZZ
+  hb_font_t *hb_font = hb_ft_font_create(ft_face, NULL);
+  hb_buffer_t *buffer = hb_buffer_create();
+  hb_glyph_info_t *infos;
+  hb_glyph_position_t *positions;
+  unsigned int i, n;
+  double x = 0, y = 0;
+
+  hb_ft_font_set_load_flags(hb_font, FT_LOAD_NO_HINTING);
+  hb_buffer_add_utf8(buffer, run->text, (int) run->text_len, 0, (int) run->text_len);
+  hb_buffer_guess_segment_properties(buffer);
+  hb_shape(hb_font, buffer, NULL, 0);
+
+  infos = hb_buffer_get_glyph_infos(buffer, &n);
+  positions = hb_buffer_get_glyph_positions(buffer, NULL);
+  run->glyphs = cairo_glyph_allocate((int) MAX(n, 1));
+  if(run->glyphs != NULL) {
+    /* HarfBuzz's y axis points up, in 26.6 fixed point */
+    for(i = 0; i < n; i++) {
+      run->glyphs[i].index = infos[i].codepoint;
+      run->glyphs[i].x = x + positions[i].x_offset / 64.0;
+      run->glyphs[i].y = y - positions[i].y_offset / 64.0;
+      x += positions[i].x_advance / 64.0;
+      y -= positions[i].y_advance / 64.0;
+    }
+    run->n_glyphs = (int) n;
+  }
+
+  hb_buffer_destroy(buffer);
+  hb_font_destroy(hb_font);
+  return run->glyphs != NULL;
+#else
+  const unsigned char *text = (const unsigned char *) run->text;
+  int kerning = FT_HAS_KERNING(ft_face);
+  FT_UInt prev = 0;
+  double x = 0;
+  size_t i, n;
+
+  /* At most one glyph per byte */
+  run->glyphs = cairo_glyph_allocate((int) MAX(run->text_len, 1));
+  if(run->glyphs == NULL) {
+    return FALSE;
+  }
+
+  for(i = 0; i < run->text_len; i += n) {
+    FT_UInt index = FT_Get_Char_Index(ft_face, layout_decode(text + i, &n));
+    FT_Fixed advance;
+    FT_Vector delta;
+
+    if(kerning && prev != 0 && index != 0 &&
+       FT_Get_Kerning(ft_face, prev, index, FT_KERNING_UNFITTED, &delta) == FT_Err_Ok) {
+      x += delta.x / 64.0;
+    }
+    run->glyphs[run->n_glyphs].index = index;
+    run->glyphs[run->n_glyphs].x = x;
+    run->glyphs[run->n_glyphs].y = 0;
+    run->n_glyphs++;
+
+    /* 16.16 fixed point, as the face is scaled */
+    if(FT_Get_Advance(ft_face, index, FT_LOAD_NO_HINTING, &advance) == FT_Err_Ok) {
+      x += advance / 65536.0;
+    }
+    prev = index;
+  }
+  return TRUE;
+#endif
+}
+
+/* Maps text to glyphs of face at size, once. Glyphs are placed with
+ * unhinted metrics and without a transformation, so that the run can be
+ * drawn under any CTM and font options. Faces cairo doesn't open through
+ * FreeType are mapped by cairo, one glyph per character. Doesn't raise, so
+ * that the caller can release its references first. */
+static cairo_status_t
+text_run_shape(mrb_state *mrb, cairo_font_face_t *face, double size, const char *text, size_t len,
+               waah_text_run_t **rrun) {
+  waah_text_run_t *run = (waah_text_run_t *) mrb_malloc_simple(mrb, sizeof(waah_text_run_t));
+  cairo_matrix_t font_matrix, ctm;
+  cairo_font_options_t *options;
+  cairo_scaled_font_t *scaled_font;
+  cairo_status_t status;
+  FT_Face ft_face;
+
+  if(run == NULL) {
+    return CAIRO_STATUS_NO_MEMORY;
+  }
+  memset(run, 0, sizeof(waah_text_run_t));
+  run->refs = 1;
+  run->face = cairo_font_face_reference(face);
+  run->size = size;
+  run->text_len = len;
+  run->text = (char *) mrb_malloc_simple(mrb, len + 1);
+  if(run->text == NULL) {
+    text_run_unref(mrb, run);
+    return CAIRO_STATUS_NO_MEMORY;
+  }
+  memcpy(run->text, text, len);
+  run->text[len] = '\0';
+
+  cairo_matrix_init_scale(&font_matrix, size, size);
+  cairo_matrix_init_identity(&ctm);
+  options = cairo_font_options_create();
+  cairo_font_options_set_hint_style(options, CAIRO_HINT_STYLE_NONE);
+  cairo_font_options_set_hint_metrics(options, CAIRO_HINT_METRICS_OFF);
+  scaled_font = cairo_scaled_font_create(face, &font_matrix, &ctm, options);
+  cairo_font_options_destroy(options);
+
+  status = cairo_scaled_font_status(scaled_font);
+  if(status == CAIRO_STATUS_SUCCESS && !text_run_valid_utf8((const unsigned char *) text, len)) {
+    status = CAIRO_STATUS_INVALID_STRING;
+  }
+  if(status == CAIRO_STATUS_SUCCESS) {
+    /* The face has to be unlocked again before cairo uses it */
+    ft_face = cairo_scaled_font_get_type(scaled_font) == CAIRO_FONT_TYPE_FT ?
+              cairo_ft_scaled_font_lock_face(scaled_font) : NULL;
+    if(ft_face != NULL) {
+      if(!text_run_shape_ft(run, ft_face)) {
+        status = CAIRO_STATUS_NO_MEMORY;
+      }
+      cairo_ft_scaled_font_unlock_face(scaled_font);
+    } else {
+      status = cairo_scaled_font_text_to_glyphs(scaled_font, 0, 0, text, len,
+                                                &run->glyphs, &run->n_glyphs,
+                                                NULL, NULL, NULL);
+    }
+  }
+  if(status == CAIRO_STATUS_SUCCESS) {
+    cairo_scaled_font_glyph_extents(scaled_font, run->glyphs, run->n_glyphs, &run->extents);
+  }
+  cairo_scaled_font_destroy(scaled_font);
+
+  if(status != CAIRO_STATUS_SUCCESS) {
+    text_run_unref(mrb, run);
+    return status;
+  }
+  *rrun = run;
+  return CAIRO_STATUS_SUCCESS;
+}
+
+static void
+text_cache_unlink_lru(text_cache_t *cache, struct text_cache_entry *entry) {
+  if(entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    cache->head = entry->lru_next;
+  }
+  if(entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    cache->tail = entry->lru_prev;
+  }
+}
+
+static void
+text_cache_push_lru(text_cache_t *cache, struct text_cache_entry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->head;
+  if(cache->head != NULL) {
+    cache->head->lru_prev = entry;
+  } else {
+    cache->tail = entry;
+  }
+  cache->head = entry;
+}
+
+static void
+text_cache_evict(mrb_state *mrb, text_cache_t *cache) {
+  struct text_cache_entry *entry = cache->tail;
+  struct text_cache_entry **p;
+
+  for(p = &cache->buckets[entry->hash % TEXT_CACHE_BUCKETS]; *p != entry; p = &(*p)->next);
+  *p = entry->next;
+  text_cache_unlink_lru(cache, entry);
+  cache->runs--;
+
+  text_run_unref(mrb, entry->run);
+  free(entry);
+}
+
+/* Sets *rrun to a new reference to the run of text in face at size,
+ * shaping it unless cached. Doesn't raise, see text_run_shape. */
+static cairo_status_t
+text_run_get(mrb_state *mrb, cairo_font_face_t *face, double size, const char *text, size_t len,
+             waah_text_run_t **rrun) {
+  text_cache_t *cache = &waah_state(mrb)->text_cache;
+  unsigned int hash = text_run_hash(face, size, text, len);
+  struct text_cache_entry *entry;
+  waah_text_run_t *run;
+  cairo_status_t status;
+
+  for(entry = cache->buckets[hash % TEXT_CACHE_BUCKETS]; entry != NULL; entry = entry->next) {
+    run = entry->run;
+    if(entry->hash == hash && run->size == size && run->text_len == len &&
+       run->face == face && memcmp(run->text, text, len) == 0) {
+      cache->hits++;
+      text_cache_unlink_lru(cache, entry);
+      text_cache_push_lru(cache, entry);
+      run->refs++;
+      *rrun = run;
+      return CAIRO_STATUS_SUCCESS;
+    }
+  }
+
+  cache->misses++;
+  status = text_run_shape(mrb, face, size, text, len, &run);
+  if(status != CAIRO_STATUS_SUCCESS) {
+    return status;
+  }
+  *rrun = run;
+
+  /* Not caching the run is fine if there is no memory for it */
+  entry = (struct text_cache_entry *) malloc(sizeof(struct text_cache_entry));
+  if(entry == NULL) {
+    return CAIRO_STATUS_SUCCESS;
+  }
+  entry->run = run;
+  entry->hash = hash;
+  entry->next = cache->buckets[hash % TEXT_CACHE_BUCKETS];
+  cache->buckets[hash % TEXT_CACHE_BUCKETS] = entry;
+  text_cache_push_lru(cache, entry);
+  cache->runs++;
+  run->refs++;
+
+  if(cache->runs > TEXT_CACHE_MAX) {
+    text_cache_evict(mrb, cache);
+  }
+
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/* TextRun.new(font, size, text), font being a Font or a family name */
+static mrb_value
+text_run_initialize(mrb_state *mrb, mrb_value self) {
+  mrb_value mrb_font;
+  mrb_float size;
+  char *text;
+  mrb_int len;
+  cairo_font_face_t *face;
+  cairo_status_t status;
+  waah_text_run_t *run;
+
+  mrb_get_args(mrb, "ofs", &mrb_font, &size, &text, &len);
+  if(size <= 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid font size");
+  }
+
+  if(mrb_string_p(mrb_font)) {
+    face = cairo_toy_font_face_create(mrb_str_to_cstr(mrb, mrb_font),
+                                      CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    status = cairo_font_face_status(face);
+    if(status != CAIRO_STATUS_SUCCESS) {
+      cairo_font_face_destroy(face);
+      if(!raise_cairo_status(mrb, status)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, cairo_status_to_string(status));
+      }
+    }
+  } else {
+    waah_font_t *font;
+    Data_Get_Struct(mrb, mrb_font, &_waah_font_type_info, font);
+    face = font_get_cr_face(font);
+    if(face == NULL) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "font has no face");
+    }
+    cairo_font_face_reference(face);
+  }
+
+  /* Toy faces are cached by cairo, so the same family gives the same face */
+  status = text_run_get(mrb, face, size, text, len, &run);
+  cairo_font_face_destroy(face);
+  if(status != CAIRO_STATUS_SUCCESS && !raise_cairo_status(mrb, status)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, cairo_status_to_string(status));
+  }
+
+  if(DATA_PTR(self) != NULL) {
+    text_run_unref(mrb, (waah_text_run_t *) DATA_PTR(self));
+  }
+  DATA_PTR(self) = run;
+  DATA_TYPE(self) = &_waah_text_run_type_info;
+
+  return self;
+}
+
+static mrb_value
+text_run_width(mrb_state *mrb, mrb_value self) {
+  waah_text_run_t *run;
+  Data_Get_Struct(mrb, self, &_waah_text_run_type_info, run);
+
+  return mrb_float_value(mrb, run->extents.x_advance);
+}
+
+/* Same as Canvas#text_extents */
+static mrb_value
+text_run_extents(mrb_state *mrb, mrb_value self) {
+  waah_text_run_t *run;
+  mrb_value vals[6];
+  Data_Get_Struct(mrb, self, &_waah_text_run_type_info, run);
+
+  vals[0] = mrb_float_value(mrb, run->extents.width);
+  vals[1] = mrb_float_value(mrb, run->extents.height);
+  vals[2] = mrb_float_value(mrb, run->extents.x_bearing);
+  vals[3] = mrb_float_value(mrb, run->extents.y_bearing);
+  vals[4] = mrb_float_value(mrb, run->extents.x_advance);
+  vals[5] = mrb_float_value(mrb, run->extents.y_advance);
+
+  return mrb_ary_new_from_values(mrb, 6, vals);
+}
+
+static mrb_value
+text_run_glyph_count(mrb_state *mrb, mrb_value self) {
+  waah_text_run_t *run;
+  Data_Get_Struct(mrb, self, &_waah_text_run_type_info, run);
+
+  return mrb_fixnum_value(run->n_glyphs);
+}
+
+static mrb_value
+text_run_text(mrb_state *mrb, mrb_value self) {
+  waah_text_run_t *run;
+  Data_Get_Struct(mrb, self, &_waah_text_run_type_info, run);
+
+  return mrb_str_new(mrb, run->text, run->text_len);
+}
+
+static mrb_value
+text_run_s_cache_stats(mrb_state *mrb, mrb_value self) {
+  mrb_value stats = mrb_hash_new(mrb);
+  waah_state_t *state = waah_state(mrb);
+
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_runs), mrb_fixnum_value(state->text_cache.runs));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_hits), mrb_fixnum_value(state->text_cache.hits));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_misses), mrb_fixnum_value(state->text_cache.misses));
+
+  return stats;
+}
+
+/* Draws a TextRun with its origin at (x, y) using the current source. The
+ * glyphs are rendered for the current transformation and font options,
+ * blitted from cairo's glyph cache rather than filled as paths, and the
+ * current path is left alone. */
+static mrb_value
+canvas_text_run(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_value mrb_run;
+  mrb_float x = 0, y = 0;
+  waah_text_run_t *run;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "o|ff", &mrb_run, &x, &y);
+  Data_Get_Struct(mrb, mrb_run, &_waah_text_run_type_info, run);
+
+  _waah_canvas_detach_snapshots(canvas);
+
+  cairo_save(cr);
+  cairo_translate(cr, x, y);
+  /* cairo looks up the scaled font for the CTM and options of cr */
+  cairo_set_font_face(cr, run->face);
+  cairo_set_font_size(cr, run->size);
+  cairo_show_glyphs(cr, run->glyphs, run->n_glyphs);
+  cairo_restore(cr);
+
+  return self;
+}
+
+/* Canvas#font_options(antialias:, hinting:, hint_metrics:), for the glyphs
+ * of text, draw_text, text_box and text_run. Omitted options are left
+ * unchanged. */
+static mrb_value
+canvas_font_options(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_value opts, hint_metrics;
+  mrb_sym antialias_sym, hinting_sym;
+  waah_state_t *state = waah_state(mrb);
+  cairo_antialias_t antialias = CAIRO_ANTIALIAS_DEFAULT;
+  cairo_hint_style_t hint_style = CAIRO_HINT_STYLE_DEFAULT;
+  cairo_font_options_t *options;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "H", &opts);
+
+  /* Everything that may raise comes before the options are created */
+  antialias_sym = opt_sym(mrb, opts, state->id_antialias);
+  if(antialias_sym == 0 || antialias_sym == state->id_default) antialias = CAIRO_ANTIALIAS_DEFAULT;
+  else if(antialias_sym == state->id_none) antialias = CAIRO_ANTIALIAS_NONE;
+  else if(antialias_sym == state->id_gray) antialias = CAIRO_ANTIALIAS_GRAY;
+  else if(antialias_sym == state->id_subpixel) antialias = CAIRO_ANTIALIAS_SUBPIXEL;
+  else if(antialias_sym == state->id_fast) antialias = CAIRO_ANTIALIAS_FAST;
+  else if(antialias_sym == state->id_good) antialias = CAIRO_ANTIALIAS_GOOD;
+  else if(antialias_sym == state->id_best) antialias = CAIRO_ANTIALIAS_BEST;
+  else mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid antialias option");
+
+  hinting_sym = opt_sym(mrb, opts, state->id_hinting);
+  if(hinting_sym == 0 || hinting_sym == state->id_default) hint_style = CAIRO_HINT_STYLE_DEFAULT;
+  else if(hinting_sym == state->id_none) hint_style = CAIRO_HINT_STYLE_NONE;
+  else if(hinting_sym == state->id_slight) hint_style = CAIRO_HINT_STYLE_SLIGHT;
+  else if(hinting_sym == state->id_medium) hint_style = CAIRO_HINT_STYLE_MEDIUM;
+  else if(hinting_sym == state->id_full) hint_style = CAIRO_HINT_STYLE_FULL;
+  else mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid hinting option");
+
+  hint_metrics = mrb_hash_get(mrb, opts, mrb_symbol_value(state->id_hint_metrics));
+
+  options = cairo_font_options_create();
+  cairo_get_font_options(cr, options);
+  if(antialias_sym != 0) {
+    cairo_font_options_set_antialias(options, antialias);
+  }
+  if(hinting_sym != 0) {
+    cairo_font_options_set_hint_style(options, hint_style);
+  }
+  if(!mrb_nil_p(hint_metrics)) {
+    cairo_font_options_set_hint_metrics(options, mrb_test(hint_metrics) ? CAIRO_HINT_METRICS_ON
+                                                                        : CAIRO_HINT_METRICS_OFF);
+  }
+
+  cairo_set_font_options(cr, options);
+  cairo_font_options_destroy(options);
+
+  return self;
+}
+
+static mrb_value
+canvas_line_width(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_float w;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "f", &w);
+
+  cairo_set_line_width(cr, (double) w);
+
+  return self;
+}
+
+static mrb_value
+canvas_line_cap(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_sym c;
+  cairo_line_cap_t cap;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "n", &c);
+
+  if(c == waah_state(mrb)->id_round) cap = CAIRO_LINE_CAP_ROUND;
+  else if(c == waah_state(mrb)->id_butt) cap = CAIRO_LINE_CAP_BUTT;
+  else if(c == waah_state(mrb)->id_square) cap = CAIRO_LINE_CAP_SQUARE;
+  else mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid cap");
+
+  cairo_set_line_cap(cr, cap);
+
+  return self;
+}
+
+static mrb_value
+canvas_line_join(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_sym c;
+  cairo_line_join_t join;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "n", &c);
+
+  if(c == waah_state(mrb)->id_round) join = CAIRO_LINE_JOIN_ROUND;
+  else if(c == waah_state(mrb)->id_miter) join = CAIRO_LINE_JOIN_MITER;
+  else if(c == waah_state(mrb)->id_bevel) join = CAIRO_LINE_JOIN_BEVEL;
+  else mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid join");
+
+  cairo_set_line_join(cr, join);
+
+  return self;
+}
+
+static mrb_value
+canvas_path(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_value mrb_path;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  if(mrb_get_args(mrb, "|o", &mrb_path) == 1) {
+    waah_path_t *path;
+    Data_Get_Struct(mrb, mrb_path, &_waah_path_type_info, path);
+    cairo_append_path(cr, path_get_cr_path(path));
+  }
+
+  return self;
+}
+
+static mrb_value
+canvas_copy_path(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  waah_path_t *path;
+  mrb_value mrb_path;
+  cairo_path_t *cr_path;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_path = path_new(mrb, &path);
+  cr_path = cairo_copy_path(cr);
+  cairo_append_path(path_cr(path), cr_path);
+  path->cr_path = cr_path;
+
+  return mrb_path;
+}
+
+static mrb_value
+canvas_m(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  double cx, cy, x, y;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ff", &x, &y);
+
+  cairo_get_current_point(cr, &cx, &cy);
+  cairo_move_to(cr, cx + x, cy + y);
+
+  return self;
+}
+
+static mrb_value
+canvas_M(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  double x, y;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ff", &x, &y);
+  cairo_move_to(cr, x, y);
+
+  return self;
+}
+
+static mrb_value
+canvas_l(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  double x, y;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ff", &x, &y);
+  cairo_rel_line_to(cr, x, y);
+
+  return self;
+}
+
+static mrb_value
+canvas_L(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  double x, y;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ff", &x, &y);
+  cairo_line_to(cr, x, y);
+
+  return self;
+}
+
+static mrb_value
+canvas_h(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  double x;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "f", &x);
+
+  cairo_rel_line_to(cr, x, 0);
+  return self;
+}
+
+static mrb_value
+canvas_H(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  double x, cx, cy;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "f", &x);
+
+  cairo_get_current_point(cr, &cx, &cy);
+  cairo_line_to(cr, x, cy);
+  return self;
+}
+
+static mrb_value
+canvas_v(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  double y;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "f", &y);
+
+  cairo_rel_line_to(cr, 0, y);
+  return self;
+}
+
+static mrb_value
+canvas_V(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  double y, cx, cy;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "f", &y);
+
+  cairo_get_current_point(cr, &cx, &cy);
+  cairo_line_to(cr, cx, y);
+  return self;
+}
+
+static mrb_value
+canvas_c(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  double a, b, c, d, e, f;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ffffff", &a, &b, &c, &d, &e, &f);
+
+  cairo_rel_curve_to(cr, a, b, c, d, e, f);
+  return self;
+}
+
+static mrb_value
+canvas_C(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  double a, b, c, d, e, f;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ffffff", &a, &b, &c, &d, &e, &f);
+
+  cairo_curve_to(cr, a, b, c, d, e, f);
+  return self;
+}
+
+static mrb_value
+canvas_a(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  double a, b, c, d, e, f;
+  double cx, cy, x, y;
+  int argc;
+  PATH_DEFAULT_DECL_INITS;
+
+  argc = mrb_get_args(mrb, "fffff|f", &a, &b, &c, &d, &e, &f);
+
+
+  cairo_get_current_point(cr, &cx, &cy);
+  x = cx + a;
+  y = cy + b;
+
+  if(argc > 5 && f > 0) {
+    cairo_arc_negative(cr,
+                       x,
+                       y,
+                       c,
+                       d,
+                       e);
+  } else {
+    cairo_arc(cr,
+              x,
+              y,
+              c,
+              d,
+              e);
+  }
+  return self;
+}
+
+static mrb_value
+canvas_A(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  double a, b, c, d, e;
+  mrb_bool neg = FALSE;
+  double x, y;
+  int argc;
+  PATH_DEFAULT_DECL_INITS;
+
+  argc = mrb_get_args(mrb, "fffff|b", &a, &b, &c, &d, &e, &neg);
+
+  x = a;
+  y = b;
+
+  if(argc > 5 && neg) {
+    cairo_arc_negative(cr,
+                       x,
+                       y,
+                       c,
+                       d,
+                       e);
+  } else {
+    cairo_arc(cr,
+              x,
+              y,
+              c,
+              d,
+              e);
+  }
+  return self;
+}
+
+static mrb_value
+canvas_z(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  PATH_DEFAULT_DECL_INITS;
+
+  cairo_close_path(cr);
+  return self;
+}
+
+/* SVG path data (the "d" attribute), see
+ * http://www.w3.org/TR/SVG/paths.html#PathDataBNF */
+
+static const char *
+svg_skip_separators(const char *p, const char *end) {
+  while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == ',')) {
+    p++;
+  }
+  return p;
+}
+
+/* Parses a number without strtod, which is locale dependent and also
+ * accepts hex numbers, inf and nan */
+static int
+svg_parse_number(const char **pp, const char *end, double *out) {
+  const char *p = svg_skip_separators(*pp, end);
+  double mantissa = 0;
+  int exp = 0, digits = 0, neg = FALSE;
+
+  if(p < end && (*p == '-' || *p == '+')) {
+    neg = *p == '-';
+    p++;
+  }
+
+  while(p < end && isdigit((unsigned char) *p)) {
+    mantissa = mantissa * 10 + (*p - '0');
+    digits++;
+    p++;
+  }
+
+  if(p < end && *p == '.') {
+    p++;
+    while(p < end && isdigit((unsigned char) *p)) {
+      mantissa = mantissa * 10 + (*p - '0');
+      exp--;
+      digits++;
+      p++;
+    }
+  }
+
+  if(digits == 0) {
+    return FALSE;
+  }
+
+  if(p < end && (*p == 'e' || *p == 'E')) {
+    const char *q = p + 1;
+    int e = 0, eneg = FALSE;
+
+    if(q < end && (*q == '-' || *q == '+')) {
+      eneg = *q == '-';
+      q++;
+    }
+    if(q < end && isdigit((unsigned char) *q)) {
+      while(q < end && isdigit((unsigned char) *q)) {
+        e = MIN(e * 10 + (*q - '0'), 10000);
+        q++;
+      }
+      exp += eneg ? -e : e;
+      p = q;
+    }
+  }
+
+  *out = exp == 0 ? mantissa : mantissa * pow(10, exp);
+  if(neg) {
+    *out = -*out;
+  }
+  *pp = p;
+  return TRUE;
+}
+
+/* Arc flags may be written without separators, e.g. "a5 5 0 015 5" */
+static int
+svg_parse_flag(const char **pp, const char *end, int *out) {
+  const char *p = svg_skip_separators(*pp, end);
+
+  if(p < end && (*p == '0' || *p == '1')) {
+    *out = *p == '1';
+    *pp = p + 1;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+static double
+svg_angle(double ux, double uy, double vx, double vy) {
+  return atan2(ux * vy - uy * vx, ux * vx + uy * vy);
+}
+
+/* Elliptical arc from (x1, y1) to (x2, y2), using the endpoint to center
+ * conversion from http://www.w3.org/TR/SVG/implnote.html#ArcImplementationNotes */
+static void
+svg_arc(cairo_t *cr, double x1, double y1, double rx, double ry, double phi,
+        int large_arc, int sweep, double x2, double y2) {
+  double cos_phi, sin_phi, dx2, dy2, x1p, y1p, lambda;
+  double rx2, ry2, num, den, coef, cxp, cyp, cx, cy, theta1, dtheta;
+  cairo_matrix_t matrix;
+
+  if(x1 == x2 && y1 == y2) {
+    return;
+  }
+
+  rx = fabs(rx);
+  ry = fabs(ry);
+  if(rx == 0 || ry == 0) {
+    cairo_line_to(cr, x2, y2);
+    return;
+  }
+
+  phi = phi * M_PI / 180.0;
+  cos_phi = cos(phi);
+  sin_phi = sin(phi);
+
+  dx2 = (x1 - x2) / 2.0;
+  dy2 = (y1 - y2) / 2.0;
+  x1p = cos_phi * dx2 + sin_phi * dy2;
+  y1p = -sin_phi * dx2 + cos_phi * dy2;
+
+  /* Scale up radii that are too small to span the endpoints */
+  lambda = (x1p * x1p) / (rx * rx) + (y1p * y1p) / (ry * ry);
+  if(lambda > 1) {
+    rx *= sqrt(lambda);
+    ry *= sqrt(lambda);
+  }
+
+  rx2 = rx * rx;
+  ry2 = ry * ry;
+  num = rx2 * ry2 - rx2 * y1p * y1p - ry2 * x1p * x1p;
+  den = rx2 * y1p * y1p + ry2 * x1p * x1p;
+  coef = den == 0 ? 0 : sqrt(MAX(0, num / den));
+  if(large_arc == sweep) {
+    coef = -coef;
+  }
+
+  cxp = coef * rx * y1p / ry;
+  cyp = -coef * ry * x1p / rx;
+  cx = cos_phi * cxp - sin_phi * cyp + (x1 + x2) / 2.0;
+  cy = sin_phi * cxp + cos_phi * cyp + (y1 + y2) / 2.0;
+
+  theta1 = svg_angle(1, 0, (x1p - cxp) / rx, (y1p - cyp) / ry);
+  dtheta = svg_angle((x1p - cxp) / rx, (y1p - cyp) / ry,
+                     (-x1p - cxp) / rx, (-y1p - cyp) / ry);
+  if(!sweep && dtheta > 0) {
+    dtheta -= 2 * M_PI;
+  } else if(sweep && dtheta < 0) {
+    dtheta += 2 * M_PI;
+  }
+
+  cairo_get_matrix(cr, &matrix);
+  cairo_translate(cr, cx, cy);
+  cairo_rotate(cr, phi);
+  cairo_scale(cr, rx, ry);
+  if(sweep) {
+    cairo_arc(cr, 0, 0, 1, theta1, theta1 + dtheta);
+  } else {
+    cairo_arc_negative(cr, 0, 0, 1, theta1, theta1 + dtheta);
+  }
+  cairo_set_matrix(cr, &matrix);
+}
+
+static void
+svg_path(mrb_state *mrb, cairo_t *cr, const char *d, size_t len) {
+  const char *p = d, *end = d + len;
+  /* current point, start of the subpath and last control point */
+  double x = 0, y = 0, sx = 0, sy = 0, cx = 0, cy = 0;
+  double a[7];
+  char cmd = 0, prev = 0;
+
+  while(TRUE) {
+    int n_args, i, rel;
+    char c;
+
+    p = svg_skip_separators(p, end);
+    if(p >= end) {
+      break;
+    }
+
+    if(isalpha((unsigned char) *p)) {
+      cmd = *p++;
+    } else if(cmd == 0 || cmd == 'Z' || cmd == 'z') {
+      /* Closepath takes no arguments, so it can't repeat implicitly */
+      goto error;
+    } else if(cmd == 'M') {
+      /* Coordinates following a moveto are implicit linetos */
+      cmd = 'L';
+    } else if(cmd == 'm') {
+      cmd = 'l';
+    }
+
+    if(prev == 0 && cmd != 'M' && cmd != 'm') {
+      goto error;
+    }
+
+    c = toupper((unsigned char) cmd);
+    rel = cmd != c;
+
+    switch(c) {
+      case 'Z': n_args = 0; break;
+      case 'H': case 'V': n_args = 1; break;
+      case 'M': case 'L': case 'T': n_args = 2; break;
+      case 'S': case 'Q': n_args = 4; break;
+      case 'C': n_args = 6; break;
+      case 'A': n_args = 7; break;
+      default: goto error;
+    }
+
+    for(i = 0; i < n_args; i++) {
+      if(c == 'A' && (i == 3 || i == 4)) {
+        int flag;
+        if(!svg_parse_flag(&p, end, &flag)) goto error;
+        a[i] = flag;
+      } else if(!svg_parse_number(&p, end, &a[i])) {
+        goto error;
+      }
+    }
+
+    if(rel) {
+      switch(c) {
+        case 'H': a[0] += x; break;
+        case 'V': a[0] += y; break;
+        case 'A': a[5] += x; a[6] += y; break;
+        default:
+          for(i = 0; i < n_args; i += 2) {
+            a[i] += x;
+            a[i + 1] += y;
+          }
+      }
+    }
+
+    /* Reflected control point for S and T */
+    if((c == 'S' && (prev == 'C' || prev == 'S')) ||
+       (c == 'T' && (prev == 'Q' || prev == 'T'))) {
+      cx = 2 * x - cx;
+      cy = 2 * y - cy;
+    } else {
+      cx = x;
+      cy = y;
+    }
+
+    switch(c) {
+      case 'M':
+        cairo_move_to(cr, a[0], a[1]);
+        sx = x = a[0];
+        sy = y = a[1];
+        break;
+      case 'L':
+        cairo_line_to(cr, a[0], a[1]);
+        x = a[0];
+        y = a[1];
+        break;
+      case 'H':
+        cairo_line_to(cr, a[0], y);
+        x = a[0];
+        break;
+      case 'V':
+        cairo_line_to(cr, x, a[0]);
+        y = a[0];
+        break;
+      case 'C':
+        cairo_curve_to(cr, a[0], a[1], a[2], a[3], a[4], a[5]);
+        cx = a[2];
+        cy = a[3];
+        x = a[4];
+        y = a[5];
+        break;
+      case 'S':
+        cairo_curve_to(cr, cx, cy, a[0], a[1], a[2], a[3]);
+        cx = a[0];
+        cy = a[1];
+        x = a[2];
+        y = a[3];
+        break;
+      case 'T':
+        a[2] = a[0];
+        a[3] = a[1];
+        a[0] = cx;
+        a[1] = cy;
+        /* fall through */
+      case 'Q':
+        /* Quadratic to cubic: control points at 2/3 towards the quadratic one */
+        cairo_curve_to(cr,
+                       x + 2.0 / 3.0 * (a[0] - x), y + 2.0 / 3.0 * (a[1] - y),
+                       a[2] + 2.0 / 3.0 * (a[0] - a[2]), a[3] + 2.0 / 3.0 * (a[1] - a[3]),
+                       a[2], a[3]);
+        cx = a[0];
+        cy = a[1];
+        x = a[2];
+        y = a[3];
+        break;
+      case 'A':
+        svg_arc(cr, x, y, a[0], a[1], a[2], (int) a[3], (int) a[4], a[5], a[6]);
+        x = a[5];
+        y = a[6];
+        break;
+      case 'Z':
+        cairo_close_path(cr);
+        x = sx;
+        y = sy;
+        break;
+    }
+
+    prev = c;
+  }
+
+  return;
+
+error:
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid path data at offset %S",
+             mrb_fixnum_value(p - d));
+}
+
+static mrb_value
+canvas_svg_path(mrb_state *mrb, mrb_value self) {
+  PATH_DEFAULT_DECLS;
+  char *d;
+  mrb_int len;
+  PATH_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "s", &d, &len);
+
+  svg_path(mrb, cr, d, len);
+
+  return self;
+}
+
+/* Paints the current source through the alpha channel of a Canvas or
+ * Image, usually an A8 one. Grayscale images mask by luminance. */
+static mrb_value
+canvas_mask(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_value mrb_mask;
+  mrb_float x = 0, y = 0;
+  waah_canvas_t *mask_canvas;
+  cairo_surface_t *mask;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "o|ff", &mrb_mask, &x, &y);
+
+  /* Detached first, a snapshot of this canvas then has its own pixels */
+  _waah_canvas_detach_snapshots(canvas);
+
+  mask_canvas = (waah_canvas_t *) mrb_data_check_get_ptr(mrb, mrb_mask, &_waah_canvas_type_info);
+  if(mask_canvas != NULL) {
+    if(mask_canvas == canvas) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "cannot use self");
+    }
+    mask = mask_canvas->surface;
+  } else {
+    waah_image_t *image;
+    Data_Get_Struct(mrb, mrb_mask, &_waah_image_type_info, image);
+    mask = image_surface(mrb, image);
+  }
+
+  cairo_mask_surface(cr, mask, x, y);
+
+  return self;
+}
+
+static mrb_value
+canvas_fill(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_bool preserve = FALSE;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "|b", &preserve);
+  _waah_canvas_detach_snapshots(canvas);
+  if(!preserve) {
+    cairo_fill(cr);
+  } else {
+    cairo_fill_preserve(cr);
+  }
+
+  return self;
+}
+
+static mrb_value
+canvas_stroke(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_bool preserve = FALSE;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "|b", &preserve);
+  _waah_canvas_detach_snapshots(canvas);
+  if(!preserve) {
+    cairo_stroke(cr);
+  } else {
+    cairo_stroke_preserve(cr);
+  }
+
+  return self;
+}
+
+static mrb_value
+canvas_clear(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  _waah_canvas_detach_snapshots(canvas);
+  cairo_paint(cr);
+
+  return self;
+}
+
+/* Batched primitives: coordinates come either as a packed String of native
+ * floats (or doubles, with double: true) or as a flat Array of numbers */
+struct coord_seq {
+  mrb_value ary;
+  const char *bytes;
+  mrb_bool dbl;
+  mrb_int len;
+};
+
+static void
+coord_seq_init(mrb_state *mrb, mrb_value data, mrb_bool dbl, mrb_int stride,
+               struct coord_seq *seq) {
+  seq->ary = data;
+  seq->bytes = NULL;
+  seq->dbl = dbl;
+
+  if(mrb_string_p(data)) {
+    size_t size = dbl ? sizeof(double) : sizeof(float);
+    if(RSTRING_LEN(data) % size != 0) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "packed coordinate string has a partial value");
+    }
+    seq->bytes = RSTRING_PTR(data);
+    seq->len = RSTRING_LEN(data) / size;
+  } else if(mrb_array_p(data)) {
+    seq->len = RARRAY_LEN(data);
+  } else {
+    mrb_raise(mrb, E_TYPE_ERROR, "expected packed String or Array");
+  }
+
+  if(seq->len % stride != 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "expected a multiple of %S coordinates",
+               mrb_fixnum_value(stride));
+  }
+}
+
+static double
+coord_seq_get(mrb_state *mrb, struct coord_seq *seq, mrb_int i) {
+  if(seq->bytes != NULL) {
+    /* Strings are not guaranteed to be aligned */
+    if(seq->dbl) {
+      double d;
+      memcpy(&d, seq->bytes + i * sizeof(double), sizeof(double));
+      return d;
+    } else {
+      float f;
+      memcpy(&f, seq->bytes + i * sizeof(float), sizeof(float));
+      return f;
+    }
+  } else {
+    mrb_value val = RARRAY_PTR(seq->ary)[i];
+    switch(mrb_type(val)) {
+      case MRB_TT_FLOAT:
+        return mrb_float(val);
+      case MRB_TT_FIXNUM:
+        return mrb_fixnum(val);
+      default:
+        mrb_raise(mrb, E_TYPE_ERROR, "expected numeric coordinates");
+        return 0;
+    }
+  }
+}
+
+/* Raises now rather than from within coord_seq_get */
+static void
+coord_seq_check(mrb_state *mrb, struct coord_seq *seq) {
+  mrb_int i;
+
+  if(seq->bytes != NULL) {
+    return;
+  }
+  for(i = 0; i < seq->len; i++) {
+    coord_seq_get(mrb, seq, i);
+  }
+}
+
+enum {
+  BATCH_RECTS,
+  BATCH_CIRCLES,
+  BATCH_LINES
+};
+
+static void
+batch_paint(cairo_t *cr, mrb_bool fill, mrb_bool stroke) {
+  if(fill && stroke) {
+    cairo_fill_preserve(cr);
+    cairo_stroke(cr);
+  } else if(fill) {
+    cairo_fill(cr);
+  } else if(stroke) {
+    cairo_stroke(cr);
+  }
+}
+
+/* Without fill: or stroke: the primitives are only appended to the current
+ * path. With each: true every primitive is painted on its own, so that
+ * overlapping translucent shapes blend with each other, and the current
+ * path is left as it was. */
+static mrb_value
+canvas_batch(mrb_state *mrb, mrb_value self, int kind) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_value data, opts = mrb_nil_value();
+  struct coord_seq seq;
+  mrb_bool fill, stroke, each;
+  mrb_int i, stride = kind == BATCH_CIRCLES ? 3 : 4;
+  double v[4];
+  cairo_path_t *saved = NULL;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "o|H", &data, &opts);
+
+  coord_seq_init(mrb, data, opt_bool(mrb, opts, waah_state(mrb)->id_double), stride, &seq);
+  fill = opt_bool(mrb, opts, waah_state(mrb)->id_fill);
+  stroke = opt_bool(mrb, opts, waah_state(mrb)->id_stroke);
+  each = (fill || stroke) && opt_bool(mrb, opts, waah_state(mrb)->id_each);
+
+  if(fill || stroke) {
+    _waah_canvas_detach_snapshots(canvas);
+  }
+  /* Each shape is painted on its own, the path built so far is kept aside
+   * and restored afterwards. Nothing may raise while it is. */
+  if(each) {
+    coord_seq_check(mrb, &seq);
+    saved = cairo_copy_path(cr);
+    cairo_new_path(cr);
+  }
+
+  for(i = 0; i < seq.len; i += stride) {
+    mrb_int j;
+    for(j = 0; j < stride; j++) {
+      v[j] = coord_seq_get(mrb, &seq, i + j);
+    }
+
+    switch(kind) {
+      case BATCH_RECTS:
+        cairo_rectangle(cr, v[0], v[1], v[2], v[3]);
+        break;
+      case BATCH_CIRCLES:
+        /* Keep cairo_arc from connecting consecutive circles */
+        cairo_new_sub_path(cr);
+        cairo_arc(cr, v[0], v[1], v[2], 0, 2 * M_PI);
+        cairo_close_path(cr);
+        break;
+      case BATCH_LINES:
+        cairo_move_to(cr, v[0], v[1]);
+        cairo_line_to(cr, v[2], v[3]);
+        break;
+    }
+
+    if(each) {
+      batch_paint(cr, fill, stroke);
+    }
+  }
+
+  if(!each) {
+    batch_paint(cr, fill, stroke);
+  } else {
+    cairo_append_path(cr, saved);
+    cairo_path_destroy(saved);
+  }
+
+  return self;
+}
+
+static mrb_value
+canvas_rects(mrb_state *mrb, mrb_value self) {
+  return canvas_batch(mrb, self, BATCH_RECTS);
+}
+
+static mrb_value
+canvas_circles(mrb_state *mrb, mrb_value self) {
+  return canvas_batch(mrb, self, BATCH_CIRCLES);
+}
+
+static mrb_value
+canvas_lines(mrb_state *mrb, mrb_value self) {
+  return canvas_batch(mrb, self, BATCH_LINES);
+}
+
+static mrb_value
+canvas_polyline(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_value data, opts = mrb_nil_value();
+  struct coord_seq seq;
+  mrb_bool fill, stroke;
+  mrb_int i;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "o|H", &data, &opts);
+
+  coord_seq_init(mrb, data, opt_bool(mrb, opts, waah_state(mrb)->id_double), 2, &seq);
+  fill = opt_bool(mrb, opts, waah_state(mrb)->id_fill);
+  stroke = opt_bool(mrb, opts, waah_state(mrb)->id_stroke);
+
+  for(i = 0; i < seq.len; i += 2) {
+    double x = coord_seq_get(mrb, &seq, i);
+    double y = coord_seq_get(mrb, &seq, i + 1);
+    if(i == 0) {
+      cairo_move_to(cr, x, y);
+    } else {
+      cairo_line_to(cr, x, y);
+    }
+  }
+
+  if(seq.len > 0 && opt_bool(mrb, opts, waah_state(mrb)->id_close)) {
+    cairo_close_path(cr);
+  }
+
+  if(fill || stroke) {
+    _waah_canvas_detach_snapshots(canvas);
+    batch_paint(cr, fill, stroke);
+  }
+
+  return self;
+}
+
+static mrb_value
+canvas_push(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_value blk;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "&", &blk);
+
+  cairo_save(cr);
+
+  if(!mrb_nil_p(blk)) {
+    mrb_funcall_with_block(mrb, self, waah_state(mrb)->id_instance_eval, 0, NULL, blk);
+    cairo_restore(cr);
+  }
+
+  return self;
+}
+
+static mrb_value
+canvas_translate(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  double x, y;
+  mrb_value block;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ff&", &x, &y, &block);
+
+  cairo_translate(cr, x, y);
+  if(!mrb_nil_p(block)) {
+    mrb_funcall_with_block(mrb, self, waah_state(mrb)->id_instance_eval, 0, NULL, block);
+    cairo_translate(cr, -x, -y);
+  }
+  return self;
+}
+
+static mrb_value
+canvas_scale(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  double x, y;
+  mrb_value block;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "ff&", &x, &y, &block);
+
+  if(!mrb_nil_p(block)) {
+    cairo_save(cr);
+  }
+
+  cairo_scale(cr, x, y);
+
+  if(!mrb_nil_p(block)) {
+    mrb_funcall_with_block(mrb, self, waah_state(mrb)->id_instance_eval, 0, NULL, block);
+    cairo_restore(cr);
+  }
+  return self;
+}
+
+static mrb_value
+canvas_clip(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  mrb_bool preserve = FALSE;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "|b", &preserve);
+  if(!preserve) {
+    cairo_clip(cr);
+  } else {
+    cairo_clip_preserve(cr);
+  }
+  return self;
+}
+
+static mrb_value
+canvas_rotate(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  double r;
+  mrb_value block;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  mrb_get_args(mrb, "f&", &r, &block);
+
+  cairo_rotate(cr, r);
+  if(!mrb_nil_p(block)) {
+    mrb_funcall_with_block(mrb, self, waah_state(mrb)->id_instance_eval, 0, NULL, block);
+    cairo_rotate(cr, -r);
+  }
+  return self;
+}
+
+static mrb_value
+canvas_pop(mrb_state *mrb, mrb_value self) {
+  CANVAS_DEFAULT_DECLS;
+  CANVAS_DEFAULT_DECL_INITS;
+
+  cairo_restore(cr);
+
+  return self;
+}
+
+cairo_status_t cairo_write_to_mrb_str (void *user_data,
+                                       const unsigned char *data,
+                                       unsigned int length) {
+  mrb_value buf = *((mrb_value *)(((void **)user_data)[0]));
+  mrb_state *mrb = (mrb_state *) ((void **)user_data)[1];
 
-  mrb_get_args(mrb, "s", &name, &len);
-  config = FcConfigGetCurrent();
-  pat = FcNameParse((const FcChar8*)name);
-  FcConfigSubstitute(config, pat, FcMatchPattern);
-  FcDefaultSubstitute(pat);
-  font->fc_pattern = FcFontMatch(config, pat, &result);
-  FcPatternDestroy(pat);
+  mrb_str_cat(mrb, buf, (const char *)data, length);
 
-  return mrb_font;
+  return CAIRO_STATUS_SUCCESS;
+}
 
-#else
-  return mrb_nil_value();
-#endif
+
+/* Binary command buffers, see enum waah_op for the format */
+
+struct cmd_op_info {
+  const char *name;
+  const char *operands;
+};
+
+static const struct cmd_op_info cmd_ops[256] = {
+  [WAAH_OP_NOP] = {"nop", ""},
+  [WAAH_OP_MOVE_TO] = {"move_to", "ff"},
+  [WAAH_OP_REL_MOVE_TO] = {"rel_move_to", "ff"},
+  [WAAH_OP_LINE_TO] = {"line_to", "ff"},
+  [WAAH_OP_REL_LINE_TO] = {"rel_line_to", "ff"},
+  [WAAH_OP_HLINE_TO] = {"hline_to", "f"},
+  [WAAH_OP_REL_HLINE_TO] = {"rel_hline_to", "f"},
+  [WAAH_OP_VLINE_TO] = {"vline_to", "f"},
+  [WAAH_OP_REL_VLINE_TO] = {"rel_vline_to", "f"},
+  [WAAH_OP_CURVE_TO] = {"curve_to", "ffffff"},
+  [WAAH_OP_REL_CURVE_TO] = {"rel_curve_to", "ffffff"},
+  [WAAH_OP_ARC] = {"arc", "fffff"},
+  [WAAH_OP_ARC_NEGATIVE] = {"arc_negative", "fffff"},
+  [WAAH_OP_CLOSE_PATH] = {"close_path", ""},
+  [WAAH_OP_NEW_PATH] = {"new_path", ""},
+  [WAAH_OP_RECT] = {"rect", "ffff"},
+  [WAAH_OP_CIRCLE] = {"circle", "fff"},
+  [WAAH_OP_ELLIPSE] = {"ellipse", "ffff"},
+  [WAAH_OP_ROUNDED_RECT] = {"rounded_rect", "fffff"},
+  [WAAH_OP_PATH] = {"path", "i"},
+  [WAAH_OP_TEXT] = {"text", "ffs"},
+  [WAAH_OP_COLOR] = {"color", "ffff"},
+  [WAAH_OP_PATTERN] = {"pattern", "i"},
+  [WAAH_OP_IMAGE] = {"image", "iff"},
+  [WAAH_OP_CANVAS] = {"canvas", "iff"},
+  [WAAH_OP_LINE_WIDTH] = {"line_width", "f"},
+  [WAAH_OP_LINE_CAP] = {"line_cap", "b"},
+  [WAAH_OP_LINE_JOIN] = {"line_join", "b"},
+  [WAAH_OP_FONT] = {"font", "i"},
+  [WAAH_OP_FONT_SIZE] = {"font_size", "f"},
+  [WAAH_OP_TRANSLATE] = {"translate", "ff"},
+  [WAAH_OP_SCALE] = {"scale", "ff"},
+  [WAAH_OP_ROTATE] = {"rotate", "f"},
+  [WAAH_OP_PUSH] = {"push", ""},
+  [WAAH_OP_POP] = {"pop", ""},
+  [WAAH_OP_FILL] = {"fill", ""},
+  [WAAH_OP_FILL_PRESERVE] = {"fill_preserve", ""},
+  [WAAH_OP_STROKE] = {"stroke", ""},
+  [WAAH_OP_STROKE_PRESERVE] = {"stroke_preserve", ""},
+  [WAAH_OP_CLIP] = {"clip", ""},
+  [WAAH_OP_CLIP_PRESERVE] = {"clip_preserve", ""},
+  [WAAH_OP_CLEAR] = {"clear", ""},
+  [WAAH_OP_PICTURE] = {"picture", "iff"},
+  [WAAH_OP_DRAW_TEXT] = {"draw_text", "ffs"}
+};
+
+struct cmd {
+  int op;
+  double f[6];
+  /* Byte operand or resource index */
+  uint32_t arg;
+  /* NUL terminated, str_len includes the NUL */
+  const char *str;
+  uint32_t str_len;
+};
+
+#define CMD_MAX_FONT_NAME 256
+
+static uint32_t
+cmd_read_u32(const unsigned char *p) {
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+         ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
 }
 
+/* Decodes the command at *pos and advances it. Returns an error message
+ * or NULL. */
+static const char *
+cmd_decode(const unsigned char *buf, size_t len, size_t *pos, struct cmd *cmd) {
+  size_t p = *pos;
+  const char *operands;
+  int n_floats = 0;
+
+  cmd->op = buf[p++];
+  operands = cmd_ops[cmd->op].operands;
+  if(operands == NULL) {
+    return "unknown opcode";
+  }
 
-static mrb_value
-font_list(mrb_state *mrb, mrb_value self) {
-  mrb_value ary = mrb_ary_new(mrb);
-#ifdef CAIRO_HAS_FC_FONT
-  FcPattern *pattern;
-  FcFontSet *font_set;
-  FcObjectSet *os;
-  FcConfig *config;
-  int i;
+  for(; *operands != '\0'; operands++) {
+    switch(*operands) {
+      case 'f': {
+        uint32_t u;
+        float f;
+        if(len - p < 4) {
+          return "truncated operand";
+        }
+        u = cmd_read_u32(buf + p);
+        memcpy(&f, &u, sizeof(f));
+        if(!isfinite(f)) {
+          return "operand not finite";
+        }
+        cmd->f[n_floats++] = f;
+        p += 4;
+        break;
+      }
+      case 'b':
+        if(len - p < 1) {
+          return "truncated operand";
+        }
+        cmd->arg = buf[p++];
+        break;
+      case 'i':
+        if(len - p < 4) {
+          return "truncated operand";
+        }
+        cmd->arg = cmd_read_u32(buf + p);
+        p += 4;
+        break;
+      case 's':
+        if(len - p < 4) {
+          return "truncated operand";
+        }
+        cmd->str_len = cmd_read_u32(buf + p);
+        p += 4;
+        if(cmd->str_len == 0 || len - p < cmd->str_len || buf[p + cmd->str_len - 1] != '\0') {
+          return "invalid string operand";
+        }
+        cmd->str = (const char *) buf + p;
+        p += cmd->str_len;
+        break;
+    }
+  }
 
-  config = FcConfigGetCurrent();
-  FcConfigSetRescanInterval(config, 0);
-  pattern = FcPatternCreate();
-  os = FcObjectSetBuild(FC_FAMILY, FC_STYLE, FC_LANG, (char *) 0);
-  font_set = FcFontList(config, pattern, os);
-  for(i = 0;font_set && i < font_set->nfont; i++) {
-    waah_font_t *font;
-    mrb_value mrb_font = font_new(mrb, &font);
-    mrb_ary_push(mrb, ary, mrb_font);
-    font->fc_pattern = font_set->fonts[i];//FcFontSetFont(font_set, i);
-    FcPatternReference(font->fc_pattern);
+  *pos = p;
+  return NULL;
+}
+
+static const char *
+cmd_check_resource(mrb_state *mrb, const struct cmd *cmd, mrb_value resources,
+                   waah_canvas_t *canvas) {
+  mrb_value res;
+
+  if(cmd->arg >= (uint32_t) RARRAY_LEN(resources)) {
+    return "resource index out of range";
   }
-  if(font_set) FcFontSetDestroy(font_set);
+  res = RARRAY_PTR(resources)[cmd->arg];
 
-#endif
+  switch(cmd->op) {
+    case WAAH_OP_PATH:
+      if(mrb_data_check_get_ptr(mrb, res, &_waah_path_type_info) == NULL) {
+        return "resource is not a Path";
+      }
+      break;
+    case WAAH_OP_PATTERN:
+      if(mrb_data_check_get_ptr(mrb, res, &_waah_pattern_type_info) == NULL) {
+        return "resource is not a Pattern";
+      }
+      break;
+    case WAAH_OP_IMAGE:
+      if(mrb_data_check_get_ptr(mrb, res, &_waah_image_type_info) == NULL) {
+        return "resource is not an Image";
+      }
+      break;
+    case WAAH_OP_CANVAS: {
+      waah_canvas_t *source = mrb_data_check_get_ptr(mrb, res, &_waah_canvas_type_info);
+      if(source == NULL) {
+        return "resource is not a Canvas";
+      }
+      if(source == canvas) {
+        return "cannot use self";
+      }
+      break;
+    }
+    case WAAH_OP_PICTURE: {
+      waah_picture_t *picture = mrb_data_check_get_ptr(mrb, res, &_waah_picture_type_info);
+      if(picture == NULL) {
+        return "resource is not a Picture";
+      }
+      if(canvas != NULL && picture->surface == canvas->surface) {
+        return "cannot use self";
+      }
+      break;
+    }
+    case WAAH_OP_FONT:
+      if(mrb_string_p(res)) {
+        if(RSTRING_LEN(res) >= CMD_MAX_FONT_NAME) {
+          return "font name too long";
+        }
+      } else {
+        waah_font_t *font = mrb_data_check_get_ptr(mrb, res, &_waah_font_type_info);
+        if(font == NULL) {
+          return "resource is neither Font nor String";
+        }
+      }
+      break;
+  }
 
-  return ary;
+  return NULL;
 }
 
-static mrb_value
-font_name(mrb_state *mrb, mrb_value self) {
-  waah_font_t *font;
-  mrb_value retval;
-  char *name = NULL;
-  int free_name = FALSE;
+/* Checks a whole buffer, so that #execute never stops halfway. On error,
+ * *pos is the offset of the offending command. Resources are only checked
+ * if given. */
+static const char *
+cmd_validate(mrb_state *mrb, const unsigned char *buf, size_t len,
+             mrb_value resources, waah_canvas_t *canvas, size_t *pos) {
+  struct cmd cmd;
+  const char *err = NULL;
+  size_t next = 0;
+  int depth = 0;
+
+  for(*pos = 0; *pos < len; *pos = next) {
+    err = cmd_decode(buf, len, &next, &cmd);
+    if(err != NULL) {
+      break;
+    }
 
-  Data_Get_Struct(mrb, self, &_waah_font_type_info, font);
+    switch(cmd.op) {
+      case WAAH_OP_LINE_CAP:
+        if(cmd.arg > CAIRO_LINE_CAP_SQUARE) {
+          err = "invalid line cap";
+        }
+        break;
+      case WAAH_OP_LINE_JOIN:
+        if(cmd.arg > CAIRO_LINE_JOIN_BEVEL) {
+          err = "invalid line join";
+        }
+        break;
+      case WAAH_OP_PUSH:
+        depth++;
+        break;
+      case WAAH_OP_POP:
+        /* Popping state saved outside the buffer could underflow cairo's
+         * stack, which puts the context into an error state for good */
+        if(depth == 0) {
+          err = "pop without push";
+        }
+        depth--;
+        break;
+      case WAAH_OP_PATH:
+      case WAAH_OP_PATTERN:
+      case WAAH_OP_IMAGE:
+      case WAAH_OP_CANVAS:
+      case WAAH_OP_FONT:
+      case WAAH_OP_PICTURE:
+        if(!mrb_nil_p(resources)) {
+          err = cmd_check_resource(mrb, &cmd, resources, canvas);
+        }
+        break;
+    }
 
-  if(font->ft_face != NULL) {
-    name = (char *) FT_Get_Postscript_Name(font->ft_face);
+    if(err != NULL) {
+      break;
+    }
   }
 
-#ifdef CAIRO_HAS_FC_FONT
-  else if(font->fc_pattern != NULL) {
-    name = (char *) FcNameUnparse(font->fc_pattern);
-    free_name = TRUE;
+  /* cmd_run doesn't restore state left saved, it would leak into the
+   * canvas */
+  if(err == NULL && depth != 0) {
+    err = "push without pop";
   }
-#endif
 
-  if(name != NULL) {
-    retval = mrb_str_new_cstr(mrb, name);
+  return err;
+}
+
+/* Worker threads must not share image surfaces, as the reference counts of
+ * their pixman images are not atomic. They each get their own surface on
+ * the same pixels instead. */
+static void
+cmd_set_source_surface(cairo_t *cr, int private_copy, cairo_surface_t *surface,
+                       double x, double y) {
+  if(private_copy) {
+    cairo_surface_t *own = cairo_image_surface_create_for_data(cairo_image_surface_get_data(surface),
+                                                               cairo_image_surface_get_format(surface),
+                                                               cairo_image_surface_get_width(surface),
+                                                               cairo_image_surface_get_height(surface),
+                                                               cairo_image_surface_get_stride(surface));
+    cairo_set_source_surface(cr, own, x, y);
+    cairo_surface_destroy(own);
   } else {
-    retval = mrb_nil_value();
+    cairo_set_source_surface(cr, surface, x, y);
   }
+}
 
-  if(free_name) {
-    free(name);
+static void
+cmd_detach(waah_canvas_t *canvas) {
+  if(canvas != NULL) {
+    _waah_canvas_detach_snapshots(canvas);
   }
-
-  return retval;
 }
 
+/* Runs a validated buffer on cr, which is canvas->cr or, for parallel
+ * rendering, the context of a single band (canvas is NULL then). Without
+ * paint only the state changes are applied, painting operators just
+ * consume the path. Must not call into mruby, as it runs on worker
+ * threads. */
+static void
+cmd_run(cairo_t *cr, waah_canvas_t *canvas, int paint,
+        const unsigned char *buf, size_t len, mrb_value resources) {
+  struct cmd cmd;
+  size_t pos = 0;
+  double x, y;
+  const double *f = cmd.f;
+
+  while(pos < len) {
+    cmd_decode(buf, len, &pos, &cmd);
+
+    switch(cmd.op) {
+      case WAAH_OP_NOP:
+        break;
+      case WAAH_OP_MOVE_TO:
+        cairo_move_to(cr, f[0], f[1]);
+        break;
+      case WAAH_OP_REL_MOVE_TO:
+        cairo_get_current_point(cr, &x, &y);
+        cairo_move_to(cr, x + f[0], y + f[1]);
+        break;
+      case WAAH_OP_LINE_TO:
+        cairo_line_to(cr, f[0], f[1]);
+        break;
+      case WAAH_OP_REL_LINE_TO:
+        cairo_rel_line_to(cr, f[0], f[1]);
+        break;
+      case WAAH_OP_HLINE_TO:
+        cairo_get_current_point(cr, &x, &y);
+        cairo_line_to(cr, f[0], y);
+        break;
+      case WAAH_OP_REL_HLINE_TO:
+        cairo_rel_line_to(cr, f[0], 0);
+        break;
+      case WAAH_OP_VLINE_TO:
+        cairo_get_current_point(cr, &x, &y);
+        cairo_line_to(cr, x, f[0]);
+        break;
+      case WAAH_OP_REL_VLINE_TO:
+        cairo_rel_line_to(cr, 0, f[0]);
+        break;
+      case WAAH_OP_CURVE_TO:
+        cairo_curve_to(cr, f[0], f[1], f[2], f[3], f[4], f[5]);
+        break;
+      case WAAH_OP_REL_CURVE_TO:
+        cairo_rel_curve_to(cr, f[0], f[1], f[2], f[3], f[4], f[5]);
+        break;
+      case WAAH_OP_ARC:
+        cairo_arc(cr, f[0], f[1], f[2], f[3], f[4]);
+        break;
+      case WAAH_OP_ARC_NEGATIVE:
+        cairo_arc_negative(cr, f[0], f[1], f[2], f[3], f[4]);
+        break;
+      case WAAH_OP_CLOSE_PATH:
+        cairo_close_path(cr);
+        break;
+      case WAAH_OP_NEW_PATH:
+        cairo_new_path(cr);
+        break;
+      case WAAH_OP_RECT:
+        cairo_rectangle(cr, f[0], f[1], f[2], f[3]);
+        break;
+      case WAAH_OP_CIRCLE:
+        cairo_arc(cr, f[0], f[1], f[2], 0, 2 * M_PI);
+        break;
+      case WAAH_OP_ELLIPSE:
+        _cairo_ellipse(cr, f[0], f[1], f[2], f[3]);
+        break;
+      case WAAH_OP_ROUNDED_RECT: {
+        double deg = M_PI / 180.0, r = f[4];
+        cairo_new_path(cr);
+        cairo_arc(cr, f[0] + f[2] - r, f[1] + r, r, -90 * deg, 0 * deg);
+        cairo_arc(cr, f[0] + f[2] - r, f[1] + f[3] - r, r, 0 * deg, 90 * deg);
+        cairo_arc(cr, f[0] + r, f[1] + f[3] - r, r, 90 * deg, 180 * deg);
+        cairo_arc(cr, f[0] + r, f[1] + r, r, 180 * deg, 270 * deg);
+        cairo_close_path(cr);
+        break;
+      }
+      case WAAH_OP_PATH: {
+        waah_path_t *path = DATA_PTR(RARRAY_PTR(resources)[cmd.arg]);
+        cairo_append_path(cr, path_get_cr_path(path));
+        break;
+      }
+      case WAAH_OP_TEXT:
+        cairo_move_to(cr, f[0], f[1]);
+        cairo_text_path(cr, cmd.str);
+        break;
+      case WAAH_OP_COLOR:
+        cairo_set_source_rgba(cr, f[0] / 255.0, f[1] / 255.0, f[2] / 255.0, f[3]);
+        break;
+      case WAAH_OP_PATTERN: {
+        waah_pattern_t *pattern = DATA_PTR(RARRAY_PTR(resources)[cmd.arg]);
+        cairo_set_source(cr, pattern->cr_pattern);
+        break;
+      }
+      case WAAH_OP_IMAGE: {
+        waah_image_t *image = DATA_PTR(RARRAY_PTR(resources)[cmd.arg]);
+        cairo_surface_t *source;
+        /* A snapshot of the canvas itself must not share its pixels */
+        if(canvas != NULL && image->snapshot_of == canvas) {
+          _waah_canvas_detach_snapshots(canvas);
+        }
+        /* Workers never see grayscale images, see tile_check_buffer */
+        source = image_source_surface(image);
+        cmd_set_source_surface(cr, canvas == NULL, source, f[0], f[1]);
+        cairo_surface_destroy(source);
+        break;
+      }
+      case WAAH_OP_CANVAS: {
+        waah_canvas_t *source = DATA_PTR(RARRAY_PTR(resources)[cmd.arg]);
+        cmd_set_source_surface(cr, canvas == NULL, source->surface, f[0], f[1]);
+        break;
+      }
+      case WAAH_OP_LINE_WIDTH:
+        cairo_set_line_width(cr, f[0]);
+        break;
+      case WAAH_OP_LINE_CAP:
+        cairo_set_line_cap(cr, (cairo_line_cap_t) cmd.arg);
+        break;
+      case WAAH_OP_LINE_JOIN:
+        cairo_set_line_join(cr, (cairo_line_join_t) cmd.arg);
+        break;
+      case WAAH_OP_FONT: {
+        mrb_value res = RARRAY_PTR(resources)[cmd.arg];
+        if(mrb_string_p(res)) {
+          char name[CMD_MAX_FONT_NAME];
+          memcpy(name, RSTRING_PTR(res), RSTRING_LEN(res));
+          name[RSTRING_LEN(res)] = '\0';
+          cairo_select_font_face(cr, name, CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+        } else {
+          cairo_set_font_face(cr, font_get_cr_face(DATA_PTR(res)));
+        }
+        break;
+      }
+      case WAAH_OP_FONT_SIZE:
+        cairo_set_font_size(cr, f[0]);
+        break;
+      case WAAH_OP_TRANSLATE:
+        cairo_translate(cr, f[0], f[1]);
+        break;
+      case WAAH_OP_SCALE:
+        cairo_scale(cr, f[0], f[1]);
+        break;
+      case WAAH_OP_ROTATE:
+        cairo_rotate(cr, f[0]);
+        break;
+      case WAAH_OP_PUSH:
+        cairo_save(cr);
+        break;
+      case WAAH_OP_POP:
+        cairo_restore(cr);
+        break;
+      case WAAH_OP_FILL:
+        if(paint) {
+          cmd_detach(canvas);
+          cairo_fill(cr);
+        } else {
+          cairo_new_path(cr);
+        }
+        break;
+      case WAAH_OP_FILL_PRESERVE:
+        if(paint) {
+          cmd_detach(canvas);
+          cairo_fill_preserve(cr);
+        }
+        break;
+      case WAAH_OP_STROKE:
+        if(paint) {
+          cmd_detach(canvas);
+          cairo_stroke(cr);
+        } else {
+          cairo_new_path(cr);
+        }
+        break;
+      case WAAH_OP_STROKE_PRESERVE:
+        if(paint) {
+          cmd_detach(canvas);
+          cairo_stroke_preserve(cr);
+        }
+        break;
+      case WAAH_OP_CLIP:
+        cairo_clip(cr);
+        break;
+      case WAAH_OP_CLIP_PRESERVE:
+        cairo_clip_preserve(cr);
+        break;
+      case WAAH_OP_CLEAR:
+        if(paint) {
+          cmd_detach(canvas);
+          cairo_paint(cr);
+        }
+        break;
+      case WAAH_OP_PICTURE: {
+        waah_picture_t *picture = DATA_PTR(RARRAY_PTR(resources)[cmd.arg]);
+        if(!paint) {
+          break;
+        }
+        cmd_detach(canvas);
+        cairo_save(cr);
+        cairo_set_source_surface(cr, picture->surface, f[0], f[1]);
+        cairo_paint(cr);
+        cairo_restore(cr);
+        break;
+      }
+      case WAAH_OP_DRAW_TEXT:
+        if(paint) {
+          cmd_detach(canvas);
+          show_text_at(cr, f[0], f[1], cmd.str, cmd.str_len - 1);
+        }
+        break;
+    }
+  }
+}
 
+/* Parallel replay: the canvas is split into bands of full rows, each drawn
+ * by a worker through its own image surface on the canvas' pixels (a
+ * subsurface would share the canvas' pixman image between threads). Bands
+ * are offset by whole pixels only, so the result is identical to a serial
+ * run. */
+
+#define TILE_MAX_THREADS 64
+#define TILE_MIN_BAND_HEIGHT 16
+
+/* Drawing state of the canvas, set up again for every band */
+struct tile_state {
+  cairo_matrix_t matrix;
+  cairo_pattern_t *source;
+  cairo_operator_t op;
+  cairo_antialias_t antialias;
+  cairo_fill_rule_t fill_rule;
+  double tolerance;
+  double line_width;
+  cairo_line_cap_t line_cap;
+  cairo_line_join_t line_join;
+  double miter_limit;
+  cairo_font_face_t *font_face;
+  cairo_matrix_t font_matrix;
+  cairo_font_options_t *font_options;
+  /* In device space, NULL if unclipped */
+  cairo_rectangle_list_t *clip;
+};
+
+struct tile_job {
+  struct tile_state state;
+  const unsigned char *buf;
+  size_t len;
+  mrb_value resources;
+  unsigned char *data;
+  cairo_format_t format;
+  int width;
+  int height;
+  int stride;
+  int band_height;
+  int n_bands;
+  int next_band;
+};
+
+/* Returns FALSE for state that cannot be transferred to another context */
+static int
+tile_state_init(cairo_t *cr, int width, int height, struct tile_state *state) {
+  cairo_rectangle_t *r;
 
+  if(cairo_has_current_point(cr)) {
+    return FALSE;
+  }
 
-static mrb_value
-font_get_prop(mrb_state *mrb, mrb_value self, const char *prop) {
-  waah_font_t *font;
-  mrb_value retval;
-  char *name = NULL;
-  int free_name = FALSE;
+  /* Other sources are locked to the user space in effect when they were
+   * set, which cannot be queried */
+  state->source = cairo_get_source(cr);
+  if(cairo_pattern_get_type(state->source) != CAIRO_PATTERN_TYPE_SOLID) {
+    return FALSE;
+  }
 
-  Data_Get_Struct(mrb, self, &_waah_font_type_info, font);
+  /* Intersecting with the surface makes an unclipped context report a
+   * single rectangle, while clips to arbitrary paths stay unrepresentable */
+  cairo_get_matrix(cr, &state->matrix);
+  cairo_save(cr);
+  cairo_identity_matrix(cr);
+  cairo_rectangle(cr, 0, 0, width, height);
+  cairo_clip(cr);
+  state->clip = cairo_copy_clip_rectangle_list(cr);
+  cairo_restore(cr);
 
-#ifdef CAIRO_HAS_FC_FONT
-  if(font->fc_pattern != NULL) {
-    if(FcPatternGetString(font->fc_pattern,
-          prop, 0, (FcChar8 **)&name) != FcResultMatch) {
-      name = NULL;
-    }
-    free_name = FALSE;
+  if(state->clip->status != CAIRO_STATUS_SUCCESS) {
+    cairo_rectangle_list_destroy(state->clip);
+    return FALSE;
   }
-#endif
-
-  if(name != NULL) {
-    retval = mrb_str_new_cstr(mrb, name);
-  } else {
-    retval = mrb_nil_value();
+  r = state->clip->rectangles;
+  if(state->clip->num_rectangles == 1 &&
+     r->x == 0 && r->y == 0 && r->width == width && r->height == height) {
+    cairo_rectangle_list_destroy(state->clip);
+    state->clip = NULL;
   }
 
-  if(free_name) {
-    free(name);
-  }
+  state->op = cairo_get_operator(cr);
+  state->antialias = cairo_get_antialias(cr);
+  state->fill_rule = cairo_get_fill_rule(cr);
+  state->tolerance = cairo_get_tolerance(cr);
+  state->line_width = cairo_get_line_width(cr);
+  state->line_cap = cairo_get_line_cap(cr);
+  state->line_join = cairo_get_line_join(cr);
+  state->miter_limit = cairo_get_miter_limit(cr);
+  state->font_face = cairo_get_font_face(cr);
+  cairo_get_font_matrix(cr, &state->font_matrix);
+  state->font_options = cairo_font_options_create();
+  cairo_get_font_options(cr, state->font_options);
 
-  return retval;
+  return TRUE;
 }
 
-static mrb_value
-font_family(mrb_state *mrb, mrb_value self) {
-#ifdef CAIRO_HAS_FC_FONT
-  return font_get_prop(mrb, self, FC_FAMILY);
-#else
-  return mrb_nil_value();
-#endif
+static void
+tile_state_fini(struct tile_state *state) {
+  if(state->clip != NULL) {
+    cairo_rectangle_list_destroy(state->clip);
+  }
+  cairo_font_options_destroy(state->font_options);
 }
 
-static mrb_value
-font_style(mrb_state *mrb, mrb_value self) {
-#ifdef CAIRO_HAS_FC_FONT
-  return font_get_prop(mrb, self, FC_STYLE);
-#else
-  return mrb_nil_value();
-#endif
+static void
+tile_state_apply(const struct tile_state *state, cairo_t *cr, int y) {
+  cairo_matrix_t matrix = state->matrix;
+
+  if(state->clip != NULL) {
+    int i;
+    for(i = 0; i < state->clip->num_rectangles; i++) {
+      const cairo_rectangle_t *r = &state->clip->rectangles[i];
+      cairo_rectangle(cr, r->x, r->y - y, r->width, r->height);
+    }
+    cairo_clip(cr);
+  }
+
+  matrix.y0 -= y;
+  cairo_set_matrix(cr, &matrix);
+  cairo_set_source(cr, state->source);
+  cairo_set_operator(cr, state->op);
+  cairo_set_antialias(cr, state->antialias);
+  cairo_set_fill_rule(cr, state->fill_rule);
+  cairo_set_tolerance(cr, state->tolerance);
+  cairo_set_line_width(cr, state->line_width);
+  cairo_set_line_cap(cr, state->line_cap);
+  cairo_set_line_join(cr, state->line_join);
+  cairo_set_miter_limit(cr, state->miter_limit);
+  cairo_set_font_face(cr, state->font_face);
+  cairo_set_font_matrix(cr, &state->font_matrix);
+  cairo_set_font_options(cr, state->font_options);
 }
 
-static mrb_value
-path_initialize(mrb_state *mrb, mrb_value self) {
-  waah_path_t *path = (waah_path_t *) mrb_calloc(mrb, sizeof(waah_path_t), 1);
+/* Recordings cannot be replayed concurrently (cairo attaches proxies to
+ * the source while doing so), and sources have to be image surfaces to
+ * be wrapped per worker. The path data and font faces created on first
+ * use are created here, so that the workers only read them. */
+static int
+tile_check_buffer(const unsigned char *buf, size_t len, mrb_value resources) {
+  struct cmd cmd;
+  size_t pos = 0;
+
+  while(pos < len) {
+    cairo_surface_t *surface = NULL;
+
+    cmd_decode(buf, len, &pos, &cmd);
+    switch(cmd.op) {
+      case WAAH_OP_PICTURE:
+        return FALSE;
+      case WAAH_OP_PATH:
+        path_get_cr_path(DATA_PTR(RARRAY_PTR(resources)[cmd.arg]));
+        break;
+      case WAAH_OP_FONT: {
+        mrb_value res = RARRAY_PTR(resources)[cmd.arg];
+        if(!mrb_string_p(res)) {
+          font_get_cr_face(DATA_PTR(res));
+        }
+        break;
+      }
+      case WAAH_OP_IMAGE: {
+        waah_image_t *image = DATA_PTR(RARRAY_PTR(resources)[cmd.arg]);
+        /* Would be expanded once per band */
+        if(image->gray) {
+          return FALSE;
+        }
+        surface = image->surface;
+        break;
+      }
+      case WAAH_OP_CANVAS:
+        surface = ((waah_canvas_t *) DATA_PTR(RARRAY_PTR(resources)[cmd.arg]))->surface;
+        break;
+    }
 
-  DATA_PTR(self) = path;
-  DATA_TYPE(self) = &_waah_path_type_info;
+    if(surface != NULL) {
+      if(cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE ||
+         cairo_image_surface_get_data(surface) == NULL) {
+        return FALSE;
+      }
+      cairo_surface_flush(surface);
+    }
+  }
 
-  return self;
+  return TRUE;
 }
 
-static mrb_value
-canvas_initialize(mrb_state *mrb, mrb_value self) {
-  waah_canvas_t *canvas = (waah_canvas_t *) mrb_calloc(mrb, sizeof(waah_canvas_t), 1);
+static void
+tile_render_band(struct tile_job *job, int band) {
+  int y = band * job->band_height;
+  int h = MIN(job->band_height, job->height - y);
+  cairo_surface_t *surface;
+  cairo_t *cr;
+
+  surface = cairo_image_surface_create_for_data(job->data + (size_t) y * job->stride,
+                                                job->format, job->width, h, job->stride);
+  cr = cairo_create(surface);
+  tile_state_apply(&job->state, cr, y);
+  cmd_run(cr, NULL, TRUE, job->buf, job->len, job->resources);
+  cairo_destroy(cr);
+  cairo_surface_finish(surface);
+  cairo_surface_destroy(surface);
+}
 
-  DATA_PTR(self) = canvas;
-  DATA_TYPE(self) = &_waah_canvas_type_info;
+#ifdef WAAH_HAVE_THREADS
+/* Worker threads are started on demand and kept for later renders */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  /* Serializes renders from different threads */
+  pthread_mutex_t run_lock;
+  int n_threads;
+  unsigned long generation;
+  /* Pool threads taking part in the current job, besides the calling
+   * thread, and those of them not done yet. The job lives on the stack of
+   * the caller and is only valid while busy > 0. */
+  int n_workers;
+  int busy;
+  struct tile_job *job;
+} tile_pool = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_MUTEX_INITIALIZER,
+  0, 0, 0, 0, NULL
+};
 
-  mrb_int w, h;
-  mrb_get_args(mrb, "ii", &w, &h);
+static void
+tile_job_work(struct tile_job *job) {
+  while(TRUE) {
+    int band;
 
-  canvas->width = w;
-  canvas->height = h;
-  canvas->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, canvas->width, canvas->height);
-  canvas->cr = cairo_create(canvas->surface);
+    pthread_mutex_lock(&tile_pool.lock);
+    band = job->next_band < job->n_bands ? job->next_band++ : -1;
+    pthread_mutex_unlock(&tile_pool.lock);
 
-  return self;
+    if(band < 0) {
+      break;
+    }
+    tile_render_band(job, band);
+  }
 }
 
-static mrb_value
-canvas_color(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_int r, g, b;
-  double a = 1.0;
-  mrb_value _a;
-  CANVAS_DEFAULT_DECL_INITS;
+static void *
+tile_worker(void *arg) {
+  int index = (int) (intptr_t) arg;
+  unsigned long seen = 0;
 
-  mrb_int n_args = mrb_get_args(mrb, "iii|o", &r, &g, &b, &_a);
+  pthread_mutex_lock(&tile_pool.lock);
+  while(TRUE) {
+    struct tile_job *job;
 
-  if(n_args > 3) {
-    switch (mrb_type(_a)) {
-        case MRB_TT_FIXNUM:
-          a = (double)mrb_fixnum(_a) / 255.0;
-          break;
-        case MRB_TT_FLOAT:
-          a = mrb_float(_a);
-          break;
-        default:
-          mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid alpha argument");
-          return self;
+    while(tile_pool.generation == seen) {
+      pthread_cond_wait(&tile_pool.start, &tile_pool.lock);
+    }
+    seen = tile_pool.generation;
+
+    /* Workers waking up late may find the job already done */
+    if(index < tile_pool.n_workers) {
+      job = tile_pool.job;
+      pthread_mutex_unlock(&tile_pool.lock);
+      tile_job_work(job);
+      pthread_mutex_lock(&tile_pool.lock);
+      if(--tile_pool.busy == 0) {
+        pthread_cond_signal(&tile_pool.done);
+      }
     }
   }
 
-
-  cairo_set_source_rgba(cr, (double)r / 255.0, (double)g / 255.0, (double)b / 255.0, a);
-
-  return self;
+  return NULL;
 }
 
+static void
+tile_run(struct tile_job *job, int n_threads) {
+  pthread_mutex_lock(&tile_pool.run_lock);
+  pthread_mutex_lock(&tile_pool.lock);
+
+  /* Started while holding the lock, so new workers only ever see this job */
+  while(tile_pool.n_threads < n_threads - 1) {
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, tile_worker, (void *) (intptr_t) tile_pool.n_threads) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    tile_pool.n_threads++;
+  }
 
-static mrb_value
-pattern_linear(mrb_state *mrb, mrb_value self) {
+  tile_pool.n_workers = MIN(n_threads - 1, tile_pool.n_threads);
+  tile_pool.job = job;
+  tile_pool.busy = tile_pool.n_workers;
+  tile_pool.generation++;
+  pthread_cond_broadcast(&tile_pool.start);
+  pthread_mutex_unlock(&tile_pool.lock);
 
-  waah_pattern_t *pattern;
-  mrb_float x0, y0, x1, y1;
-  mrb_value mrb_pattern = pattern_new(mrb, &pattern);
+  tile_job_work(job);
 
-  mrb_get_args(mrb, "ffff", &x0, &y0, &x1, &y1);
+  pthread_mutex_lock(&tile_pool.lock);
+  while(tile_pool.busy > 0) {
+    pthread_cond_wait(&tile_pool.done, &tile_pool.lock);
+  }
+  tile_pool.n_workers = 0;
+  tile_pool.job = NULL;
+  pthread_mutex_unlock(&tile_pool.lock);
+  pthread_mutex_unlock(&tile_pool.run_lock);
+}
+#endif
 
-  pattern->cr_pattern  = cairo_pattern_create_linear(x0,
-                                                     y0,
-                                                     x1,
-                                                     y1);
+/* Returns FALSE if the buffer has to be run serially instead */
+static int
+cmd_run_parallel(waah_canvas_t *canvas, const unsigned char *buf, size_t len,
+                 mrb_value resources, int n_threads) {
+#ifdef WAAH_HAVE_THREADS
+  struct tile_job job;
+
+  if(n_threads <= 1 ||
+     canvas->height < 2 * TILE_MIN_BAND_HEIGHT ||
+     cairo_surface_get_type(canvas->surface) != CAIRO_SURFACE_TYPE_IMAGE ||
+     !tile_check_buffer(buf, len, resources) ||
+     !tile_state_init(canvas->cr, canvas->width, canvas->height, &job.state)) {
+    return FALSE;
+  }
 
-  return mrb_pattern;
-}
+  n_threads = MIN(n_threads, TILE_MAX_THREADS);
 
-static mrb_value
-pattern_radial(mrb_state *mrb, mrb_value self) {
+  /* Workers write to the pixels behind cairo's back */
+  _waah_canvas_detach_snapshots(canvas);
+  cairo_surface_flush(canvas->surface);
 
-  waah_pattern_t *pattern;
-  mrb_float cx0, cy0, radius0, cx1, cy1, radius1;
+  job.buf = buf;
+  job.len = len;
+  job.resources = resources;
+  job.data = cairo_image_surface_get_data(canvas->surface);
+  job.format = cairo_image_surface_get_format(canvas->surface);
+  job.width = canvas->width;
+  job.height = canvas->height;
+  job.stride = cairo_image_surface_get_stride(canvas->surface);
+  /* A few bands per thread, to even out uneven drawing */
+  job.band_height = MAX(TILE_MIN_BAND_HEIGHT, (job.height + n_threads * 4 - 1) / (n_threads * 4));
+  job.n_bands = (job.height + job.band_height - 1) / job.band_height;
+  job.next_band = 0;
 
-  mrb_value mrb_pattern = pattern_new(mrb, &pattern);
+  tile_run(&job, n_threads);
 
-  mrb_get_args(mrb, "ffffff", &cx0, &cy0, &radius0, &cx1, &cy1, &radius1);
+  tile_state_fini(&job.state);
+  cairo_surface_mark_dirty(canvas->surface);
 
-  pattern->cr_pattern  = cairo_pattern_create_radial(cx0,
-                                                     cy0,
-                                                     radius0,
-                                                     cx1,
-                                                     cy1,
-                                                     radius1);
+  /* Leave the canvas in the state a serial run would */
+  cmd_run(canvas->cr, canvas, FALSE, buf, len, resources);
 
-  return mrb_pattern;
+  return TRUE;
+#else
+  return FALSE;
+#endif
 }
 
-static mrb_value
-pattern_color_stop(mrb_state *mrb, mrb_value self) {
-  mrb_int r, g, b;
-  double a = 1.0;
-  mrb_value _a;
-  mrb_float off;
-  waah_pattern_t *pattern;
-  Data_Get_Struct(mrb, self, &_waah_pattern_type_info, pattern);
+static void
+cmd_raise(mrb_state *mrb, const char *err, size_t pos) {
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid command at offset %S: %S",
+             mrb_fixnum_value((mrb_int) pos), mrb_str_new_cstr(mrb, err));
+}
+
+/* References on the surfaces of the lazy images among the resources of a
+ * command buffer. Decoding one of them could otherwise evict another one
+ * before or during the run. Wrapped in an object, so the GC releases them
+ * if decoding raises. */
+struct image_pins {
+  cairo_surface_t **surfaces;
+  mrb_int len;
+};
 
-  mrb_int n_args = mrb_get_args(mrb, "fiii|o", &off, &r, &g, &b, &_a);
+static void
+image_pins_free(mrb_state *mrb, void *ptr) {
+  struct image_pins *pins = (struct image_pins *) ptr;
+  mrb_int i;
 
-  if(n_args > 4) {
-    switch (mrb_type(_a)) {
-        case MRB_TT_FIXNUM:
-          a = (double)mrb_fixnum(_a) / 255.0;
-          break;
-        case MRB_TT_FLOAT:
-          a = mrb_float(_a);
-          break;
-        default:
-          mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid alpha argument");
-          return self;
+  if(pins == NULL) {
+    return;
+  }
+  for(i = 0; i < pins->len; i++) {
+    cairo_surface_destroy(pins->surfaces[i]);
+  }
+  mrb_free(mrb, pins->surfaces);
+  mrb_free(mrb, pins);
+}
+
+static struct mrb_data_type _waah_image_pins_type_info = {"ImagePins", image_pins_free};
+
+/* Returns nil if there are no lazy images */
+static mrb_value
+cmd_pin_images(mrb_state *mrb, mrb_value resources) {
+  struct image_pins *pins;
+  mrb_value mrb_pins = mrb_nil_value();
+  mrb_int i;
+
+  for(i = 0; i < RARRAY_LEN(resources); i++) {
+    waah_image_t *image = (waah_image_t *) mrb_data_check_get_ptr(mrb, RARRAY_PTR(resources)[i],
+                                                                  &_waah_image_type_info);
+    if(image == NULL || image->cache == NULL) {
+      continue;
     }
+    if(mrb_nil_p(mrb_pins)) {
+      pins = (struct image_pins *) mrb_calloc(mrb, 1, sizeof(struct image_pins));
+      mrb_pins = mrb_obj_value(Data_Wrap_Struct(mrb, mrb->object_class, &_waah_image_pins_type_info, pins));
+      pins->surfaces = (cairo_surface_t **) mrb_calloc(mrb, RARRAY_LEN(resources), sizeof(cairo_surface_t *));
+    }
+    pins->surfaces[pins->len++] = cairo_surface_reference(image_surface(mrb, image));
   }
 
-  cairo_pattern_add_color_stop_rgba(pattern->cr_pattern,
-                                    off, (double)r / 255.0,
-                                    (double)g / 255.0, (double)b / 255.0, a);
+  return mrb_pins;
+}
 
-  return self;
+static void
+cmd_unpin_images(mrb_state *mrb, mrb_value mrb_pins) {
+  if(!mrb_nil_p(mrb_pins)) {
+    image_pins_free(mrb, DATA_PTR(mrb_pins));
+    DATA_PTR(mrb_pins) = NULL;
+  }
 }
 
 static mrb_value
-canvas_image(mrb_state *mrb, mrb_value self) {
+canvas_execute(mrb_state *mrb, mrb_value self) {
   CANVAS_DEFAULT_DECLS;
-  mrb_value mrb_image;
-  mrb_float x = 0, y = 0;
-  waah_image_t *image;
+  mrb_value buf, resources = mrb_nil_value(), opts = mrb_nil_value();
+  const unsigned char *data;
+  const char *err;
+  size_t pos, len;
+  mrb_int n_threads;
+  mrb_value pins;
   CANVAS_DEFAULT_DECL_INITS;
 
-  mrb_get_args(mrb, "o|ff", &mrb_image, &x, &y);
-  Data_Get_Struct(mrb, mrb_image, &_waah_image_type_info, image);
+  mrb_get_args(mrb, "S|oH", &buf, &resources, &opts);
 
-  cairo_set_source_surface(cr, image->surface, x, y);
+  if(mrb_hash_p(resources) && mrb_nil_p(opts)) {
+    opts = resources;
+    resources = mrb_nil_value();
+  }
+  if(mrb_nil_p(resources)) {
+    resources = mrb_ary_new(mrb);
+  } else if(!mrb_array_p(resources)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "resources must be an Array");
+  }
 
-  return self;
-}
+  data = (const unsigned char *) RSTRING_PTR(buf);
+  len = RSTRING_LEN(buf);
 
-/* Very similar to #image, merge ? */
-static mrb_value
-canvas_canvas(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_value mrb_canvas;
-  mrb_float x = 0, y = 0;
-  waah_canvas_t *_canvas;
-  CANVAS_DEFAULT_DECL_INITS;
+  err = cmd_validate(mrb, data, len, resources, canvas, &pos);
+  if(err != NULL) {
+    cmd_raise(mrb, err, pos);
+  }
 
-  mrb_get_args(mrb, "o|ff", &mrb_canvas, &x, &y);
-  Data_Get_Struct(mrb, mrb_canvas, &_waah_canvas_type_info, _canvas);
+  /* threads: n renders in bands on up to n threads where possible */
+  n_threads = opt_int(mrb, opts, waah_state(mrb)->id_threads, 1);
 
-  if(canvas == _canvas) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR, "cannot use self");
+  pins = cmd_pin_images(mrb, resources);
+  if(cmd_run_parallel(canvas, data, len, resources, (int) MIN(n_threads, TILE_MAX_THREADS))) {
+    waah_state(mrb)->parallel_runs++;
+  } else {
+    if(n_threads > 1) {
+      waah_state(mrb)->parallel_fallbacks++;
+    }
+    cmd_run(cr, canvas, TRUE, data, len, resources);
   }
-
-  cairo_set_source_surface(cr, _canvas->surface, x, y);
+  cmd_unpin_images(mrb, pins);
 
   return self;
 }
 
+/* How often execute(threads: n > 1) ran in bands or fell back to a serial
+ * run, for instance because of a PICTURE op or a small canvas */
 static mrb_value
-canvas_pattern(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_value mrb_pattern;
-  waah_pattern_t *pattern;
-  CANVAS_DEFAULT_DECL_INITS;
-
-  mrb_get_args(mrb, "o", &mrb_pattern);
-  Data_Get_Struct(mrb, mrb_pattern, &_waah_pattern_type_info, pattern);
-
-  cairo_set_source(cr, pattern->cr_pattern);
+commands_s_stats(mrb_state *mrb, mrb_value self) {
+  mrb_value stats = mrb_hash_new(mrb);
+  waah_state_t *state = waah_state(mrb);
 
-  return self;
-}
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_parallel), mrb_fixnum_value(state->parallel_runs));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_fallbacks), mrb_fixnum_value(state->parallel_fallbacks));
 
-static void
-_cairo_ellipse(cairo_t *cr, double cx, double cy, double rw, double rh) {
-  cairo_save(cr);
-  cairo_translate(cr, cx, cy);
-  cairo_scale(cr, rw / 2., rh / 2.);
-  cairo_arc(cr, 0., 0., 1., 0., 2 * M_PI);
-  cairo_restore(cr);
+  return stats;
 }
 
 static mrb_value
-canvas_ellipse(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_float cx, cy, rw, rh;
-  CANVAS_DEFAULT_DECL_INITS;
+commands_validate(mrb_state *mrb, mrb_value self) {
+  mrb_value buf, resources = mrb_nil_value();
+  const char *err;
+  size_t pos;
 
-  mrb_get_args(mrb, "ffff", &cx, &cy, &rw, &rh);
+  mrb_get_args(mrb, "S|A", &buf, &resources);
 
-  _cairo_ellipse(cr, cx, cy, rw, rh);
+  err = cmd_validate(mrb, (const unsigned char *) RSTRING_PTR(buf), RSTRING_LEN(buf),
+                     resources, NULL, &pos);
+  if(err != NULL) {
+    cmd_raise(mrb, err, pos);
+  }
 
-  return self;
+  return mrb_true_value();
 }
 
+/* One command per line, prefixed with its offset. Stops at the first
+ * malformed command instead of raising, as this is meant for debugging. */
 static mrb_value
-canvas_circle(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_float cx, cy, r;
-  CANVAS_DEFAULT_DECL_INITS;
+commands_disassemble(mrb_state *mrb, mrb_value self) {
+  mrb_value buf, out;
+  const unsigned char *data;
+  size_t len, pos = 0;
+  char tmp[64];
+
+  mrb_get_args(mrb, "S", &buf);
+
+  data = (const unsigned char *) RSTRING_PTR(buf);
+  len = RSTRING_LEN(buf);
+  out = mrb_str_new(mrb, NULL, 0);
+
+  while(pos < len) {
+    struct cmd cmd;
+    const char *operands, *err;
+    size_t start = pos;
+    int n_floats = 0;
+
+    snprintf(tmp, sizeof(tmp), "%08lx  ", (unsigned long) start);
+    mrb_str_cat_cstr(mrb, out, tmp);
+
+    err = cmd_decode(data, len, &pos, &cmd);
+    if(err != NULL) {
+      snprintf(tmp, sizeof(tmp), "<0x%02x> ", data[start]);
+      mrb_str_cat_cstr(mrb, out, tmp);
+      mrb_str_cat_cstr(mrb, out, err);
+      mrb_str_cat_cstr(mrb, out, "\n");
+      break;
+    }
 
-  mrb_get_args(mrb, "fff", &cx, &cy, &r);
+    mrb_str_cat_cstr(mrb, out, cmd_ops[cmd.op].name);
+    for(operands = cmd_ops[cmd.op].operands; *operands != '\0'; operands++) {
+      switch(*operands) {
+        case 'f':
+          snprintf(tmp, sizeof(tmp), " %g", cmd.f[n_floats++]);
+          mrb_str_cat_cstr(mrb, out, tmp);
+          break;
+        case 'b':
+          snprintf(tmp, sizeof(tmp), " %u", (unsigned) cmd.arg);
+          mrb_str_cat_cstr(mrb, out, tmp);
+          break;
+        case 'i':
+          snprintf(tmp, sizeof(tmp), " #%lu", (unsigned long) cmd.arg);
+          mrb_str_cat_cstr(mrb, out, tmp);
+          break;
+        case 's':
+          mrb_str_cat_cstr(mrb, out, " ");
+          mrb_str_concat(mrb, out, mrb_inspect(mrb, mrb_str_new(mrb, cmd.str, cmd.str_len - 1)));
+          break;
+      }
+    }
+    mrb_str_cat_cstr(mrb, out, "\n");
+  }
 
-  cairo_arc(cr, cx, cy, r, 0, 2 * M_PI);
-  /*_cairo_ellipse(cr, cx, cy, r, r);*/
+  return out;
+}
 
-  return self;
+static mrb_value
+picture_record_body(mrb_state *mrb, mrb_value args) {
+  return mrb_funcall_with_block(mrb, mrb_ary_ref(mrb, args, 0), waah_state(mrb)->id_instance_eval,
+                                0, NULL, mrb_ary_ref(mrb, args, 1));
 }
 
+/* The block may keep the canvas, which must not add to the picture after
+ * it is returned */
+static mrb_value
+picture_record_finish(mrb_state *mrb, mrb_value mrb_canvas) {
+  waah_canvas_t *canvas = (waah_canvas_t *) DATA_PTR(mrb_canvas);
+
+  cairo_destroy(canvas->cr);
+  canvas->cr = NULL;
+
+  return mrb_nil_value();
+}
 
 static mrb_value
-canvas_rect(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_float x, y, w, h;
-  CANVAS_DEFAULT_DECL_INITS;
+picture_record(mrb_state *mrb, mrb_value self) {
+  mrb_float w, h;
+  mrb_value blk, mrb_picture, mrb_canvas;
+  waah_picture_t *picture;
+  waah_canvas_t *canvas;
+  cairo_rectangle_t extents;
 
-  mrb_get_args(mrb, "ffff", &x, &y, &w, &h);
+  mrb_get_args(mrb, "ff&", &w, &h, &blk);
 
-  cairo_rectangle(cr, x, y, w, h);
+  if(mrb_nil_p(blk)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+  if(w <= 0 || h <= 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid picture size");
+  }
 
-  return self;
+  extents.x = 0;
+  extents.y = 0;
+  extents.width = w;
+  extents.height = h;
+
+  picture = (waah_picture_t *) mrb_calloc(mrb, sizeof(waah_picture_t), 1);
+  mrb_picture = mrb_obj_value(Data_Wrap_Struct(mrb, waah_state(mrb)->cPicture, &_waah_picture_type_info, picture));
+  picture->surface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+  picture->width = w;
+  picture->height = h;
+
+  /* The block draws to an ordinary Canvas, only backed by the recording */
+  canvas = (waah_canvas_t *) mrb_calloc(mrb, sizeof(waah_canvas_t), 1);
+  mrb_canvas = mrb_obj_value(Data_Wrap_Struct(mrb, waah_state(mrb)->cCanvas, &_waah_canvas_type_info, canvas));
+  canvas->width = (int) ceil(w);
+  canvas->height = (int) ceil(h);
+  canvas->surface = cairo_surface_reference(picture->surface);
+  canvas->cr = cairo_create(canvas->surface);
+
+  mrb_ensure(mrb, picture_record_body, mrb_assoc_new(mrb, mrb_canvas, blk),
+             picture_record_finish, mrb_canvas);
+
+  return mrb_picture;
 }
 
 static mrb_value
-canvas_rounded_rect(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_float x, y, w, h, r;
-  double deg = M_PI / 180.0;
-  CANVAS_DEFAULT_DECL_INITS;
+picture_width(mrb_state *mrb, mrb_value self) {
+  waah_picture_t *picture;
+  Data_Get_Struct(mrb, self, &_waah_picture_type_info, picture);
 
-  mrb_get_args(mrb, "fffff", &x, &y, &w, &h, &r);
-  /* From: http://cairographics.org/samples/rounded_rectangle/ */
-  cairo_new_path(cr);
-  cairo_arc(cr, x + w - r, y + r, r, -90 * deg, 0 * deg);
-  cairo_arc(cr, x + w - r, y + h - r, r, 0 * deg, 90 * deg);
-  cairo_arc(cr, x + r, y + h - r, r, 90 * deg, 180 * deg);
-  cairo_arc(cr, x + r, y + r, r, 180 * deg, 270 * deg);
-  cairo_close_path (cr);
+  return mrb_float_value(mrb, picture->width);
+}
 
-  return self;
+static mrb_value
+picture_height(mrb_state *mrb, mrb_value self) {
+  waah_picture_t *picture;
+  Data_Get_Struct(mrb, self, &_waah_picture_type_info, picture);
+
+  return mrb_float_value(mrb, picture->height);
 }
 
+/* Bounding box of everything actually drawn, as [x, y, w, h] */
+static mrb_value
+picture_ink_extents(mrb_state *mrb, mrb_value self) {
+  waah_picture_t *picture;
+  double x, y, w, h;
+  mrb_value vals[4];
+  Data_Get_Struct(mrb, self, &_waah_picture_type_info, picture);
 
+  cairo_recording_surface_ink_extents(picture->surface, &x, &y, &w, &h);
 
+  vals[0] = mrb_float_value(mrb, x);
+  vals[1] = mrb_float_value(mrb, y);
+  vals[2] = mrb_float_value(mrb, w);
+  vals[3] = mrb_float_value(mrb, h);
+  return mrb_ary_new_from_values(mrb, 4, vals);
+}
 
+/* Replays a picture at (x, y), under the current transformation and clip */
 static mrb_value
-canvas_text(mrb_state *mrb, mrb_value self) {
+canvas_picture(mrb_state *mrb, mrb_value self) {
   CANVAS_DEFAULT_DECLS;
-  mrb_float x, y;
-  char *text;
+  mrb_value mrb_picture;
+  mrb_float x = 0, y = 0;
+  waah_picture_t *picture;
   CANVAS_DEFAULT_DECL_INITS;
 
-  mrb_get_args(mrb, "ffz", &x, &y, &text);
+  mrb_get_args(mrb, "o|ff", &mrb_picture, &x, &y);
+  Data_Get_Struct(mrb, mrb_picture, &_waah_picture_type_info, picture);
 
-  cairo_move_to(cr, (double)x, (double)y);
-  cairo_text_path(cr, text);
+  if(picture->surface == canvas->surface) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "cannot use self");
+  }
+
+  _waah_canvas_detach_snapshots(canvas);
+
+  cairo_save(cr);
+  cairo_set_source_surface(cr, picture->surface, x, y);
+  cairo_paint(cr);
+  cairo_restore(cr);
 
   return self;
 }
 
 static mrb_value
-canvas_text_extents(mrb_state *mrb, mrb_value self) {
+canvas_snapshot(mrb_state *mrb, mrb_value self) {
   CANVAS_DEFAULT_DECLS;
-  cairo_text_extents_t e;
-  char *text;
-  mrb_value vals[6];
+  mrb_value mrb_image;
+  mrb_value opts = mrb_nil_value();
+  mrb_sym format_sym;
+  waah_image_t *image;
   CANVAS_DEFAULT_DECL_INITS;
 
-  mrb_get_args(mrb, "z", &text);
+  canvas_check_image(mrb, canvas);
+  mrb_get_args(mrb, "|H", &opts);
+
+  /* A snapshot in another format is a converted copy */
+  format_sym = opt_sym(mrb, opts, waah_state(mrb)->id_format);
+  if(format_sym != 0) {
+    cairo_format_t format = format_from_sym(mrb, format_sym);
+    if(format != cairo_image_surface_get_format(canvas->surface)) {
+      mrb_image = image_new(mrb, &image);
+      image->surface = surface_convert(canvas->surface, format);
+      return mrb_image;
+    }
+  }
 
-  cairo_text_extents(cr, text, &e);
+  mrb_image = image_new(mrb, &image);
 
-  vals[0] = mrb_float_value(mrb, e.width);
-  vals[1] = mrb_float_value(mrb, e.height);
-  vals[2] = mrb_float_value(mrb, e.x_bearing);
-  vals[3] = mrb_float_value(mrb, e.y_bearing);
-  vals[4] = mrb_float_value(mrb, e.x_advance);
-  vals[5] = mrb_float_value(mrb, e.y_advance);
+  /* Copy-on-write: the pixels are only copied once the canvas is drawn to */
+  image->surface = cairo_surface_reference(canvas->surface);
+  image->snapshot_of = canvas;
+  image->snapshot_next = canvas->snapshots;
+  if(canvas->snapshots != NULL) {
+    canvas->snapshots->snapshot_prev = image;
+  }
+  canvas->snapshots = image;
 
-  return mrb_ary_new_from_values(mrb, 6, vals);
+  return mrb_image;
 }
 
 static mrb_value
-canvas_path_extents(mrb_state *mrb, mrb_value self) {
+canvas_width(mrb_state *mrb, mrb_value self) {
   CANVAS_DEFAULT_DECLS;
-  double x1, x2, y1, y2;
-  mrb_value vals[4];
   CANVAS_DEFAULT_DECL_INITS;
 
-  cairo_path_extents(cr,
-                     &x1,
-                     &y1,
-                     &x2,
-                     &y2);
-  vals[0] = mrb_float_value(mrb, x1);
-  vals[1] = mrb_float_value(mrb, y1);
-  vals[2] = mrb_float_value(mrb, x2 - x1);
-  vals[3] = mrb_float_value(mrb, y2 - y1);
-  return mrb_ary_new_from_values(mrb, 4, vals);
+  return mrb_fixnum_value(canvas->width);
 }
 
 static mrb_value
-canvas_font_size(mrb_state *mrb, mrb_value self) {
+canvas_height(mrb_state *mrb, mrb_value self) {
   CANVAS_DEFAULT_DECLS;
-  mrb_float s;
   CANVAS_DEFAULT_DECL_INITS;
 
-  mrb_get_args(mrb, "f", &s);
+  return mrb_fixnum_value(canvas->height);
+}
 
-  cairo_set_font_size(cr, s);
 
-  return self;
+/* Growable output buffer the encoders write into. It is backed by malloc'd
+ * memory rather than a String, as growing a String may raise from inside
+ * the libpng or libjpeg callbacks, leaking the encoder. The capacity is
+ * managed here rather than through repeated mrb_str_cat calls. */
+struct str_sink {
+  unsigned char *buf;
+  size_t len;
+  size_t capa;
+};
+
+/* Returns FALSE if out of memory */
+static int
+str_sink_init(struct str_sink *sink, size_t capa) {
+  sink->len = 0;
+  sink->capa = capa;
+  sink->buf = (unsigned char *) malloc(capa);
+  return sink->buf != NULL;
+}
+
+/* Makes room for at least len more bytes, returns FALSE if out of memory */
+static int
+str_sink_reserve(struct str_sink *sink, size_t len) {
+  if(sink->len + len > sink->capa) {
+    size_t capa = MAX(sink->capa * 2, sink->len + len);
+    unsigned char *buf = (unsigned char *) realloc(sink->buf, capa);
+    if(buf == NULL) {
+      return FALSE;
+    }
+    sink->buf = buf;
+    sink->capa = capa;
+  }
+  return TRUE;
+}
+
+static int
+str_sink_write(struct str_sink *sink, const unsigned char *data, size_t len) {
+  if(!str_sink_reserve(sink, len)) {
+    return FALSE;
+  }
+  memcpy(sink->buf + sink->len, data, len);
+  sink->len += len;
+  return TRUE;
 }
 
+static void
+str_sink_free(struct str_sink *sink) {
+  free(sink->buf);
+  sink->buf = NULL;
+}
+
+/* Copies the output into a String and frees the sink */
 static mrb_value
-canvas_font(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_value mrb_font;
-  mrb_sym sym_slant, sym_weight;
-  int n_args;
-  cairo_font_slant_t slant = CAIRO_FONT_SLANT_NORMAL;
-  cairo_font_weight_t weight = CAIRO_FONT_WEIGHT_NORMAL;
-  CANVAS_DEFAULT_DECL_INITS;
+str_sink_finish(mrb_state *mrb, struct str_sink *sink) {
+  mrb_value str = mrb_str_new(mrb, (const char *) sink->buf, sink->len);
+  str_sink_free(sink);
+  return str;
+}
 
-  n_args = mrb_get_args(mrb, "o|nn", &mrb_font, &sym_weight, &sym_slant);
+/* The encoders don't raise, so that they can run without an interpreter.
+ * For ENCODE_CODEC_ERROR the message is left in their error buffer. */
+enum encode_status {
+  ENCODE_OK,
+  ENCODE_NO_MEMORY,
+  ENCODE_WRITE_ERROR,
+  ENCODE_CODEC_ERROR
+};
 
-  switch (mrb_type(mrb_font)) {
-    case MRB_TT_DATA: {
-      waah_font_t *font;
-      Data_Get_Struct(mrb, mrb_font, &_waah_font_type_info, font);
-      if(font->cr_face == NULL) {
-#ifdef CAIRO_HAS_FC_FONT
-        if(font->fc_pattern != NULL) {
-          font->cr_face = cairo_ft_font_face_create_for_pattern(font->fc_pattern);
-        } else
-#endif
-          if(font->ft_face != NULL) {
-            font->cr_face = cairo_ft_font_face_create_for_ft_face(font->ft_face, 0);
-          }
-      }
-      cairo_set_font_face(canvas->cr, font->cr_face);
+static void
+raise_encode_status(mrb_state *mrb, int status, const char *error) {
+  switch(status) {
+    case ENCODE_OK:
       break;
-    }
-    case MRB_TT_STRING: {
-      char *font_name = mrb_str_to_cstr(mrb, mrb_font);
-      if(sym_slant == id_italic) slant = CAIRO_FONT_SLANT_ITALIC;
-      else if(sym_slant == id_oblique) slant = CAIRO_FONT_SLANT_OBLIQUE;
-
-      if(sym_weight == id_bold) {
-        weight = CAIRO_FONT_WEIGHT_BOLD;
-      } else if(n_args == 2 && sym_weight == id_italic) {
-        slant = CAIRO_FONT_SLANT_ITALIC;
-      }
-      cairo_select_font_face(canvas->cr, font_name, slant, weight);
+    case ENCODE_NO_MEMORY:
+      raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
       break;
-    }
-    default: {
-      mrb_raise(mrb, E_ARGUMENT_ERROR, "font must either be String or Font");
-      return mrb_nil_value();
-    }
+    case ENCODE_WRITE_ERROR:
+      raise_cairo_status(mrb, CAIRO_STATUS_WRITE_ERROR);
+      break;
+    default:
+      mrb_raise(mrb, E_RUNTIME_ERROR, error);
+      break;
+  }
+}
+
+/* Returns a surface with the same content in a format the encoders can read
+ * directly (ARGB32, RGB24 or A8). The result has to be destroyed. */
+static cairo_surface_t *
+surface_for_encoding(cairo_surface_t *surface) {
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+
+  switch(format) {
+    case CAIRO_FORMAT_ARGB32:
+    case CAIRO_FORMAT_RGB24:
+    case CAIRO_FORMAT_A8:
+      cairo_surface_flush(surface);
+      return cairo_surface_reference(surface);
+    /* Other formats are widened to the one with the same channels, so
+     * opaque and mask content stays without alpha or color */
+    case CAIRO_FORMAT_A1:
+      return surface_convert(surface, CAIRO_FORMAT_A8);
+    case CAIRO_FORMAT_RGB16_565:
+    case CAIRO_FORMAT_RGB30:
+      return surface_convert(surface, CAIRO_FORMAT_RGB24);
+    default:
+      return surface_convert(surface, CAIRO_FORMAT_ARGB32);
   }
+}
 
-  return self;
+struct png_opts {
+  int level;
+  int filters;
+  int strategy;
+};
+
+static void
+png_write_to_sink(png_structp png, png_bytep data, png_size_t len) {
+  if(!str_sink_write((struct str_sink *) png_get_io_ptr(png), data, len)) {
+    png_error(png, "no memory");
+  }
 }
 
-static mrb_value
-canvas_line_width(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_float w;
-  CANVAS_DEFAULT_DECL_INITS;
+static void
+png_flush_sink(png_structp png) {
+}
 
-  mrb_get_args(mrb, "f", &w);
+static void
+png_parse_opts(mrb_state *mrb, mrb_value opts, struct png_opts *png_opts) {
+  mrb_sym filter, strategy;
+
+  /* zlib's default, spelled out so that its Z_DEFAULT_COMPRESSION alias
+   * doesn't have to be accepted from the caller */
+  png_opts->level = 6;
+  png_opts->filters = PNG_ALL_FILTERS;
+  /* -1 keeps libpng's choice (Z_FILTERED if filtering is enabled) */
+  png_opts->strategy = -1;
+
+  if(opt_bool(mrb, opts, waah_state(mrb)->id_fast)) {
+    png_opts->level = 1;
+    png_opts->filters = PNG_FILTER_SUB;
+  }
 
-  cairo_set_line_width(cr, (double) w);
+  png_opts->level = opt_int(mrb, opts, waah_state(mrb)->id_level, png_opts->level);
+  if(png_opts->level < 0 || png_opts->level > 9) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "level must be between 0 and 9");
+  }
 
-  return self;
+  filter = opt_sym(mrb, opts, waah_state(mrb)->id_filter);
+  if(filter == 0) {
+  } else if(filter == waah_state(mrb)->id_none) png_opts->filters = PNG_FILTER_NONE;
+  else if(filter == waah_state(mrb)->id_sub) png_opts->filters = PNG_FILTER_SUB;
+  else if(filter == waah_state(mrb)->id_up) png_opts->filters = PNG_FILTER_UP;
+  else if(filter == waah_state(mrb)->id_avg) png_opts->filters = PNG_FILTER_AVG;
+  else if(filter == waah_state(mrb)->id_paeth) png_opts->filters = PNG_FILTER_PAETH;
+  else if(filter == waah_state(mrb)->id_all) png_opts->filters = PNG_ALL_FILTERS;
+  else mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid filter");
+
+  strategy = opt_sym(mrb, opts, waah_state(mrb)->id_strategy);
+  if(strategy == 0) {
+  } else if(strategy == waah_state(mrb)->id_default) png_opts->strategy = Z_DEFAULT_STRATEGY;
+  else if(strategy == waah_state(mrb)->id_filtered) png_opts->strategy = Z_FILTERED;
+  else if(strategy == waah_state(mrb)->id_huffman) png_opts->strategy = Z_HUFFMAN_ONLY;
+  else if(strategy == waah_state(mrb)->id_rle) png_opts->strategy = Z_RLE;
+  else if(strategy == waah_state(mrb)->id_fixed) png_opts->strategy = Z_FIXED;
+  else mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid strategy");
 }
 
-static mrb_value
-canvas_line_cap(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_sym c;
-  cairo_line_cap_t cap;
-  CANVAS_DEFAULT_DECL_INITS;
+/* Writes surface as PNG to either filename or sink. Does not need an
+ * interpreter, returns an encode_status. */
+static int
+encode_png(cairo_surface_t *surface, const char *filename, struct str_sink *sink,
+           const struct png_opts *opts, char *error) {
+  FILE *file = NULL;
+  png_structp png;
+  png_infop info;
+  cairo_surface_t *src = surface_for_encoding(surface);
+  cairo_format_t format = cairo_image_surface_get_format(src);
+  int w = cairo_image_surface_get_width(src);
+  int h = cairo_image_surface_get_height(src);
+  int stride = cairo_image_surface_get_stride(src);
+  unsigned char *data = cairo_image_surface_get_data(src);
+  unsigned char *row = NULL;
+  int color_type, y;
+
+  if(data == NULL) {
+    cairo_surface_destroy(src);
+    return ENCODE_NO_MEMORY;
+  }
 
-  mrb_get_args(mrb, "n", &c);
+  switch(format) {
+    case CAIRO_FORMAT_ARGB32:
+      color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+      row = (unsigned char *) malloc((size_t) w * 4);
+      if(row == NULL) {
+        cairo_surface_destroy(src);
+        return ENCODE_NO_MEMORY;
+      }
+      break;
+    case CAIRO_FORMAT_RGB24:
+      color_type = PNG_COLOR_TYPE_RGB;
+      break;
+    default:
+      color_type = PNG_COLOR_TYPE_GRAY;
+      break;
+  }
 
-  if(c == id_round) cap = CAIRO_LINE_CAP_ROUND;
-  else if(c == id_butt) cap = CAIRO_LINE_CAP_BUTT;
-  else if(c == id_square) cap = CAIRO_LINE_CAP_SQUARE;
-  else mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid cap");
+  png = png_create_write_struct(PNG_LIBPNG_VER_STRING, error, png_error_handler, png_warning_handler);
+  info = png == NULL ? NULL : png_create_info_struct(png);
+  if(info == NULL) {
+    png_destroy_write_struct(&png, NULL);
+    free(row);
+    cairo_surface_destroy(src);
+    return ENCODE_NO_MEMORY;
+  }
 
-  cairo_set_line_cap(cr, cap);
+  if(filename != NULL) {
+    file = fopen(filename, "wb");
+    if(file == NULL) {
+      png_destroy_write_struct(&png, &info);
+      free(row);
+      cairo_surface_destroy(src);
+      return ENCODE_WRITE_ERROR;
+    }
+  }
 
-  return self;
-}
+  if(setjmp(png_jmpbuf(png))) {
+    png_destroy_write_struct(&png, &info);
+    free(row);
+    cairo_surface_destroy(src);
+    if(file != NULL) {
+      fclose(file);
+    }
+    return ENCODE_CODEC_ERROR;
+  }
 
-static mrb_value
-canvas_line_join(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_sym c;
-  cairo_line_join_t join;
-  CANVAS_DEFAULT_DECL_INITS;
+  if(file != NULL) {
+    png_init_io(png, file);
+  } else {
+    png_set_write_fn(png, sink, png_write_to_sink, png_flush_sink);
+  }
 
-  mrb_get_args(mrb, "n", &c);
+  png_set_compression_level(png, opts->level);
+  if(opts->strategy >= 0) {
+    png_set_compression_strategy(png, opts->strategy);
+  }
+  png_set_filter(png, PNG_FILTER_TYPE_BASE, opts->filters);
+  png_set_compression_buffer_size(png, 1 << 16);
 
-  if(c == id_round) join = CAIRO_LINE_JOIN_ROUND;
-  else if(c == id_miter) join = CAIRO_LINE_JOIN_MITER;
-  else if(c == id_bevel) join = CAIRO_LINE_JOIN_BEVEL;
-  else mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid join");
+  png_set_IHDR(png, info, w, h, 8, color_type, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
 
-  cairo_set_line_join(cr, join);
+  /* RGB24 rows are handed to libpng as they are, it strips the pad byte */
+  if(format == CAIRO_FORMAT_RGB24) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    png_set_filler(png, 0, PNG_FILLER_BEFORE);
+#else
+    png_set_filler(png, 0, PNG_FILLER_AFTER);
+    png_set_bgr(png);
+#endif
+  }
 
-  return self;
-}
+  for(y = 0; y < h; y++) {
+    unsigned char *line = data + (size_t) y * stride;
+    if(row != NULL) {
+      unpremultiply_argb32_to_rgba(row, line, w);
+      line = row;
+    }
+    png_write_row(png, (png_bytep) line);
+  }
 
-static mrb_value
-canvas_path(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_value path;
-  CANVAS_DEFAULT_DECL_INITS;
+  png_write_end(png, info);
+  png_destroy_write_struct(&png, &info);
 
-  if(mrb_get_args(mrb, "|o", &path) == 1) {
+  free(row);
+  cairo_surface_destroy(src);
+
+  if(file != NULL && fclose(file) != 0) {
+    return ENCODE_WRITE_ERROR;
   }
+  return ENCODE_OK;
+}
 
-  return self;
+/* Initial capacity for PNG output, an eighth of the raw image data.
+ * str_sink_reserve doubles it for images that compress worse, which keeps
+ * the typical peak well below the raw size. */
+static size_t
+png_size_hint(cairo_surface_t *surface) {
+  size_t raw = (size_t) cairo_image_surface_get_height(surface) *
+               (1 + (size_t) cairo_image_surface_get_width(surface) * 4);
+  return raw / 8 + 1024;
 }
 
+/* Encodes surface to a file if filename is given, otherwise to a String */
 static mrb_value
-canvas_m(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double cx, cy, x, y;
-  CANVAS_DEFAULT_DECL_INITS;
+surface_to_png(mrb_state *mrb, cairo_surface_t *surface, const char *filename, mrb_value opts) {
+  struct png_opts png_opts;
+  char error[ERROR_MSG_LEN];
 
-  mrb_get_args(mrb, "ff", &x, &y);
+  png_parse_opts(mrb, opts, &png_opts);
 
-  cairo_get_current_point(cr, &cx, &cy);
-  cairo_move_to(cr, cx + x, cy + y);
+  if(filename != NULL) {
+    raise_encode_status(mrb, encode_png(surface, filename, NULL, &png_opts, error), error);
+    return mrb_true_value();
+  } else {
+    struct str_sink sink;
+    int status;
 
-  return self;
+    if(!str_sink_init(&sink, png_size_hint(surface))) {
+      raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
+    }
+    status = encode_png(surface, NULL, &sink, &png_opts, error);
+    if(status != ENCODE_OK) {
+      str_sink_free(&sink);
+      raise_encode_status(mrb, status, error);
+    }
+    return str_sink_finish(mrb, &sink);
+  }
 }
 
-static mrb_value
-canvas_M(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double x, y;
-  CANVAS_DEFAULT_DECL_INITS;
+struct jpeg_opts {
+  int quality;
+  int subsampling;
+  mrb_bool progressive;
+};
 
-  mrb_get_args(mrb, "ff", &x, &y);
-  cairo_move_to(cr, x, y);
+static void
+jpeg_parse_opts(mrb_state *mrb, mrb_value opts, struct jpeg_opts *jpeg_opts) {
+  jpeg_opts->quality = opt_int(mrb, opts, waah_state(mrb)->id_quality, 85);
+  jpeg_opts->subsampling = opt_int(mrb, opts, waah_state(mrb)->id_subsampling, 420);
+  jpeg_opts->progressive = opt_bool(mrb, opts, waah_state(mrb)->id_progressive);
 
-  return self;
+  if(jpeg_opts->quality < 1 || jpeg_opts->quality > 100) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "quality must be between 1 and 100");
+  }
+  if(jpeg_opts->subsampling != 444 &&
+     jpeg_opts->subsampling != 422 &&
+     jpeg_opts->subsampling != 420) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "subsampling must be 444, 422 or 420");
+  }
 }
 
-static mrb_value
-canvas_l(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double x, y;
-  CANVAS_DEFAULT_DECL_INITS;
+/* Destination manager compressing straight into a str_sink */
+static void
+jpeg_sink_init_destination(j_compress_ptr info) {
+  struct str_sink *sink = (struct str_sink *) info->client_data;
+  info->dest->next_output_byte = (JOCTET *) sink->buf + sink->len;
+  info->dest->free_in_buffer = sink->capa - sink->len;
+}
 
-  mrb_get_args(mrb, "ff", &x, &y);
-  cairo_rel_line_to(cr, x, y);
+static boolean
+jpeg_sink_empty_output_buffer(j_compress_ptr info) {
+  struct str_sink *sink = (struct str_sink *) info->client_data;
+  /* Contrary to its name, this is called when the buffer is full */
+  sink->len = sink->capa;
+  if(!str_sink_reserve(sink, sink->capa)) {
+    ERREXIT(info, JERR_OUT_OF_MEMORY);
+  }
+  jpeg_sink_init_destination(info);
+  return TRUE;
+}
 
-  return self;
+static void
+jpeg_sink_term_destination(j_compress_ptr info) {
+  struct str_sink *sink = (struct str_sink *) info->client_data;
+  sink->len = sink->capa - info->dest->free_in_buffer;
 }
 
-static mrb_value
-canvas_L(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double x, y;
-  CANVAS_DEFAULT_DECL_INITS;
+/* Writes surface as JPEG to either filename or sink, see encode_png. Alpha
+ * is dropped, since ARGB32 is premultiplied this amounts to compositing over
+ * black. */
+static int
+encode_jpeg(cairo_surface_t *surface, const char *filename, struct str_sink *sink,
+            const struct jpeg_opts *opts, char *error) {
+  struct jpeg_compress_struct info;
+  struct jpeg_error_handler err;
+  struct jpeg_destination_mgr dest;
+  JSAMPROW rows[JPEG_SCANLINE_BATCH];
+  FILE *file = NULL;
+  cairo_surface_t *src = surface_for_encoding(surface);
+  cairo_format_t format = cairo_image_surface_get_format(src);
+  int w = cairo_image_surface_get_width(src);
+  int h = cairo_image_surface_get_height(src);
+  int stride = cairo_image_surface_get_stride(src);
+  unsigned char *data = cairo_image_surface_get_data(src);
+  unsigned char *buffer = NULL;
+  int i;
 
-  mrb_get_args(mrb, "ff", &x, &y);
-  cairo_line_to(cr, x, y);
+  if(data == NULL) {
+    cairo_surface_destroy(src);
+    return ENCODE_NO_MEMORY;
+  }
 
-  return self;
-}
+#ifndef JPEG_CAIRO_COLOR_SPACE
+  if(format != CAIRO_FORMAT_A8) {
+    buffer = (unsigned char *) malloc((size_t) w * 3 * JPEG_SCANLINE_BATCH);
+    if(buffer == NULL) {
+      cairo_surface_destroy(src);
+      return ENCODE_NO_MEMORY;
+    }
+  }
+#endif
 
-static mrb_value
-canvas_h(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double x;
-  CANVAS_DEFAULT_DECL_INITS;
+  if(filename != NULL) {
+    file = fopen(filename, "wb");
+    if(file == NULL) {
+      free(buffer);
+      cairo_surface_destroy(src);
+      return ENCODE_WRITE_ERROR;
+    }
+  }
 
-  mrb_get_args(mrb, "f", &x);
+  info.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpeg_error_exit;
 
-  cairo_rel_line_to(cr, x, 0);
-  return self;
-}
+  if(setjmp(err.jmp)) {
+    char msg[JMSG_LENGTH_MAX];
 
-static mrb_value
-canvas_H(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double x, cx, cy;
-  CANVAS_DEFAULT_DECL_INITS;
+    (*info.err->format_message)((j_common_ptr) &info, msg);
+    snprintf(error, ERROR_MSG_LEN, "jpeg error: %s", msg);
+    jpeg_destroy_compress(&info);
+    free(buffer);
+    cairo_surface_destroy(src);
+    if(file != NULL) {
+      fclose(file);
+    }
+    return ENCODE_CODEC_ERROR;
+  }
 
-  mrb_get_args(mrb, "f", &x);
+  jpeg_create_compress(&info);
 
-  cairo_get_current_point(cr, &cx, &cy);
-  cairo_line_to(cr, x, cy);
-  return self;
-}
+  if(file != NULL) {
+    jpeg_stdio_dest(&info, file);
+  } else {
+    dest.init_destination = jpeg_sink_init_destination;
+    dest.empty_output_buffer = jpeg_sink_empty_output_buffer;
+    dest.term_destination = jpeg_sink_term_destination;
+    info.client_data = sink;
+    info.dest = &dest;
+  }
 
-static mrb_value
-canvas_v(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double y;
-  CANVAS_DEFAULT_DECL_INITS;
+  info.image_width = w;
+  info.image_height = h;
 
-  mrb_get_args(mrb, "f", &y);
+  if(format == CAIRO_FORMAT_A8) {
+    info.input_components = 1;
+    info.in_color_space = JCS_GRAYSCALE;
+  } else {
+#ifdef JPEG_CAIRO_COLOR_SPACE
+    info.input_components = 4;
+    info.in_color_space = JPEG_CAIRO_COLOR_SPACE;
+#else
+    info.input_components = 3;
+    info.in_color_space = JCS_RGB;
+#endif
+  }
 
-  cairo_rel_line_to(cr, 0, y);
-  return self;
-}
+  jpeg_set_defaults(&info);
+  jpeg_set_quality(&info, opts->quality, TRUE);
 
-static mrb_value
-canvas_V(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double y, cx, cy;
-  CANVAS_DEFAULT_DECL_INITS;
+  if(info.jpeg_color_space == JCS_YCbCr) {
+    info.comp_info[0].h_samp_factor = opts->subsampling == 444 ? 1 : 2;
+    info.comp_info[0].v_samp_factor = opts->subsampling == 420 ? 2 : 1;
+  }
 
-  mrb_get_args(mrb, "f", &y);
+  if(opts->progressive) {
+    jpeg_simple_progression(&info);
+  }
 
-  cairo_get_current_point(cr, &cx, &cy);
-  cairo_line_to(cr, cx, y);
-  return self;
-}
+  jpeg_start_compress(&info, TRUE);
 
-static mrb_value
-canvas_c(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double a, b, c, d, e, f;
-  CANVAS_DEFAULT_DECL_INITS;
+  while(info.next_scanline < info.image_height) {
+    int y = info.next_scanline;
+    int n = MIN(JPEG_SCANLINE_BATCH, h - y);
 
-  mrb_get_args(mrb, "ffffff", &a, &b, &c, &d, &e, &f);
+    for(i = 0; i < n; i++) {
+      unsigned char *line = data + (size_t) (y + i) * stride;
+      if(buffer != NULL) {
+        rows[i] = buffer + (size_t) i * w * 3;
+        swizzle_xrgb32_to_rgb(rows[i], line, w);
+      } else {
+        rows[i] = line;
+      }
+    }
+    jpeg_write_scanlines(&info, rows, n);
+  }
 
-  cairo_rel_curve_to(cr, a, b, c, d, e, f);
-  return self;
-}
+  jpeg_finish_compress(&info);
+  jpeg_destroy_compress(&info);
 
-static mrb_value
-canvas_C(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double a, b, c, d, e, f;
-  CANVAS_DEFAULT_DECL_INITS;
+  free(buffer);
+  cairo_surface_destroy(src);
 
-  mrb_get_args(mrb, "ffffff", &a, &b, &c, &d, &e, &f);
+  if(file != NULL && fclose(file) != 0) {
+    return ENCODE_WRITE_ERROR;
+  }
+  return ENCODE_OK;
+}
 
-  cairo_curve_to(cr, a, b, c, d, e, f);
-  return self;
+/* Same as png_size_hint, an eighth of the RGB data */
+static size_t
+jpeg_size_hint(cairo_surface_t *surface) {
+  return (size_t) cairo_image_surface_get_width(surface) *
+         cairo_image_surface_get_height(surface) * 3 / 8 + 4096;
 }
 
 static mrb_value
-canvas_a(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double a, b, c, d, e, f;
-  double cx, cy, x, y;
-  int argc;
-  CANVAS_DEFAULT_DECL_INITS;
+surface_to_jpeg(mrb_state *mrb, cairo_surface_t *surface, const char *filename, mrb_value opts) {
+  struct jpeg_opts jpeg_opts;
+  char error[ERROR_MSG_LEN];
 
-  argc = mrb_get_args(mrb, "fffff|f", &a, &b, &c, &d, &e, &f);
+  jpeg_parse_opts(mrb, opts, &jpeg_opts);
 
+  if(filename != NULL) {
+    raise_encode_status(mrb, encode_jpeg(surface, filename, NULL, &jpeg_opts, error), error);
+    return mrb_true_value();
+  } else {
+    struct str_sink sink;
+    int status;
 
-  cairo_get_current_point(cr, &cx, &cy);
-  x = cx + a;
-  y = cy + b;
+    if(!str_sink_init(&sink, jpeg_size_hint(surface))) {
+      raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
+    }
+    status = encode_jpeg(surface, NULL, &sink, &jpeg_opts, error);
+    if(status != ENCODE_OK) {
+      str_sink_free(&sink);
+      raise_encode_status(mrb, status, error);
+    }
+    return str_sink_finish(mrb, &sink);
+  }
+}
 
-  if(argc > 5 && f > 0) {
-    cairo_arc_negative(cr,
-                       x,
-                       y,
-                       c,
-                       d,
-                       e);
-  } else {
-    cairo_arc(cr,
-              x,
-              y,
-              c,
-              d,
-              e);
+/* Parses the ([filename], [opts]) arguments of the #to_* encoders */
+static void
+get_encode_args(mrb_state *mrb, char **filename, mrb_value *opts) {
+  mrb_value arg = mrb_nil_value();
+
+  *filename = NULL;
+  *opts = mrb_nil_value();
+
+  mrb_get_args(mrb, "|oH", &arg, opts);
+
+  if(mrb_hash_p(arg)) {
+    *opts = arg;
+  } else if(mrb_string_p(arg)) {
+    *filename = mrb_str_to_cstr(mrb, arg);
+  } else if(!mrb_nil_p(arg)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "filename must be a String");
   }
-  return self;
 }
 
 static mrb_value
-canvas_A(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double a, b, c, d, e;
-  mrb_bool neg = FALSE;
-  double x, y;
-  int argc;
-  CANVAS_DEFAULT_DECL_INITS;
+image_to_png(mrb_state *mrb, mrb_value self) {
+  waah_image_t *image;
+  cairo_surface_t *surface;
+  char *filename;
+  mrb_value opts;
+  Data_Get_Struct(mrb, self, &_waah_image_type_info, image);
 
-  argc = mrb_get_args(mrb, "fffff|b", &a, &b, &c, &d, &e, &neg);
+  get_encode_args(mrb, &filename, &opts);
 
-  x = a;
-  y = b;
+  surface = image_surface(mrb, image);
+  if(surface == NULL) {
+    return mrb_nil_value();
+  }
 
-  if(argc > 5 && neg) {
-    cairo_arc_negative(cr,
-                       x,
-                       y,
-                       c,
-                       d,
-                       e);
-  } else {
-    cairo_arc(cr,
-              x,
-              y,
-              c,
-              d,
-              e);
+  return surface_to_png(mrb, surface, filename, opts);
+}
+
+static mrb_value
+image_to_jpeg(mrb_state *mrb, mrb_value self) {
+  waah_image_t *image;
+  cairo_surface_t *surface;
+  char *filename;
+  mrb_value opts;
+  Data_Get_Struct(mrb, self, &_waah_image_type_info, image);
+
+  get_encode_args(mrb, &filename, &opts);
+
+  surface = image_surface(mrb, image);
+  if(surface == NULL) {
+    return mrb_nil_value();
   }
-  return self;
+
+  return surface_to_jpeg(mrb, surface, filename, opts);
 }
 
 static mrb_value
-canvas_z(mrb_state *mrb, mrb_value self) {
+canvas_to_png(mrb_state *mrb, mrb_value self) {
   CANVAS_DEFAULT_DECLS;
+  char *filename;
+  mrb_value opts;
   CANVAS_DEFAULT_DECL_INITS;
 
-  cairo_close_path(cr);
-  return self;
+  canvas_check_image(mrb, canvas);
+  get_encode_args(mrb, &filename, &opts);
+
+  return surface_to_png(mrb, canvas->surface, filename, opts);
 }
 
 static mrb_value
-canvas_fill(mrb_state *mrb, mrb_value self) {
+canvas_to_jpeg(mrb_state *mrb, mrb_value self) {
   CANVAS_DEFAULT_DECLS;
-  mrb_bool preserve = FALSE;
+  char *filename;
+  mrb_value opts;
   CANVAS_DEFAULT_DECL_INITS;
 
-  mrb_get_args(mrb, "|b", &preserve);
-  if(!preserve) {
-    cairo_fill(cr);
+  canvas_check_image(mrb, canvas);
+  get_encode_args(mrb, &filename, &opts);
+
+  return surface_to_jpeg(mrb, canvas->surface, filename, opts);
+}
+
+/* Background encoding for Canvas#encode_async. A job owns a private copy of
+ * the pixels, so the canvas can be drawn to right away. It is encoded into
+ * malloc'd memory by one of the encoder threads and turned into a String
+ * once the interpreter asks the Future for its value. */
+enum encode_format {
+  ENCODE_PNG,
+  ENCODE_JPEG
+};
+
+/* Jobs queued or being encoded at once, across all interpreters. Bounds
+ * the memory held by pixel copies and output; encode_async blocks while
+ * the limit is reached. */
+#define ENCODE_MAX_PENDING 8
+#define ENCODE_MAX_THREADS 4
+
+struct encode_job {
+  struct encode_job *next;
+  cairo_surface_t *surface;
+  int format;
+  union {
+    struct png_opts png;
+    struct jpeg_opts jpeg;
+  } opts;
+  struct str_sink sink;
+  int status;
+  char error[ERROR_MSG_LEN];
+  int done;
+  /* Held by the Future and, until done, by the encoder */
+  int refs;
+};
+
+static void
+encode_job_free(struct encode_job *job) {
+  if(job->surface != NULL) {
+    cairo_surface_destroy(job->surface);
+  }
+  str_sink_free(&job->sink);
+  free(job);
+}
+
+static void
+encode_job_run(struct encode_job *job) {
+  size_t capa = job->format == ENCODE_PNG ? png_size_hint(job->surface) : jpeg_size_hint(job->surface);
+
+  if(!str_sink_init(&job->sink, capa)) {
+    job->status = ENCODE_NO_MEMORY;
+  } else if(job->format == ENCODE_PNG) {
+    job->status = encode_png(job->surface, NULL, &job->sink, &job->opts.png, job->error);
   } else {
-    cairo_fill_preserve(cr);
+    job->status = encode_jpeg(job->surface, NULL, &job->sink, &job->opts.jpeg, job->error);
   }
 
-  return self;
+  /* Only the output is needed from here on */
+  cairo_surface_destroy(job->surface);
+  job->surface = NULL;
 }
 
-static mrb_value
-canvas_stroke(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_bool preserve = FALSE;
-  CANVAS_DEFAULT_DECL_INITS;
+#ifdef WAAH_HAVE_THREADS
+static struct {
+  pthread_mutex_t lock;
+  /* Signalled when a job is queued */
+  pthread_cond_t work;
+  /* Broadcast when a job is done */
+  pthread_cond_t done;
+  struct encode_job *head;
+  struct encode_job *tail;
+  /* Queued or running jobs */
+  int pending;
+  int n_threads;
+} encode_pool = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  NULL, NULL, 0, 0
+};
+
+static void *
+encode_worker(void *arg) {
+  pthread_mutex_lock(&encode_pool.lock);
+  for(;;) {
+    struct encode_job *job;
+
+    while(encode_pool.head == NULL) {
+      pthread_cond_wait(&encode_pool.work, &encode_pool.lock);
+    }
+    job = encode_pool.head;
+    encode_pool.head = job->next;
+    if(encode_pool.head == NULL) {
+      encode_pool.tail = NULL;
+    }
+    pthread_mutex_unlock(&encode_pool.lock);
 
-  mrb_get_args(mrb, "|b", &preserve);
-  if(!preserve) {
-    cairo_stroke(cr);
-  } else {
-    cairo_stroke_preserve(cr);
+    encode_job_run(job);
+
+    pthread_mutex_lock(&encode_pool.lock);
+    job->done = TRUE;
+    encode_pool.pending--;
+    pthread_cond_broadcast(&encode_pool.done);
+    if(--job->refs == 0) {
+      encode_job_free(job);
+    }
   }
+  return NULL;
+}
 
-  return self;
+static int
+encode_max_threads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : MIN(n, ENCODE_MAX_THREADS);
 }
 
-static mrb_value
-canvas_clear(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  CANVAS_DEFAULT_DECL_INITS;
+/* Queues job, waiting while ENCODE_MAX_PENDING jobs are pending. Returns
+ * FALSE if there is no encoder thread to run it. */
+static int
+encode_submit(struct encode_job *job) {
+  pthread_mutex_lock(&encode_pool.lock);
 
-  cairo_paint(cr);
+  while(encode_pool.pending >= ENCODE_MAX_PENDING) {
+    pthread_cond_wait(&encode_pool.done, &encode_pool.lock);
+  }
 
-  return self;
+  /* Threads are started as they are needed and kept afterwards */
+  if(encode_pool.n_threads <= encode_pool.pending &&
+     encode_pool.n_threads < encode_max_threads()) {
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, encode_worker, NULL) == 0) {
+      pthread_detach(thread);
+      encode_pool.n_threads++;
+    }
+  }
+
+  if(encode_pool.n_threads == 0) {
+    pthread_mutex_unlock(&encode_pool.lock);
+    return FALSE;
+  }
+
+  job->refs = 2;
+  job->next = NULL;
+  if(encode_pool.tail != NULL) {
+    encode_pool.tail->next = job;
+  } else {
+    encode_pool.head = job;
+  }
+  encode_pool.tail = job;
+  encode_pool.pending++;
+  pthread_cond_signal(&encode_pool.work);
+
+  pthread_mutex_unlock(&encode_pool.lock);
+  return TRUE;
 }
 
-static mrb_value
-canvas_push(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_value blk;
-  CANVAS_DEFAULT_DECL_INITS;
+#define ENCODE_LOCK() pthread_mutex_lock(&encode_pool.lock)
+#define ENCODE_UNLOCK() pthread_mutex_unlock(&encode_pool.lock)
+#else
+#define ENCODE_LOCK()
+#define ENCODE_UNLOCK()
+#endif
 
-  mrb_get_args(mrb, "&", &blk);
+static void
+future_free(mrb_state *mrb, void *ptr) {
+  struct encode_job *job = (struct encode_job *) ptr;
+  int refs;
 
-  cairo_save(cr);
+  ENCODE_LOCK();
+  refs = --job->refs;
+  ENCODE_UNLOCK();
 
-  if(!mrb_nil_p(blk)) {
-    mrb_funcall_with_block(mrb, self, id_instance_eval, 0, NULL, blk);
-    cairo_restore(cr);
+  if(refs == 0) {
+    encode_job_free(job);
   }
+}
 
-  return self;
+static struct mrb_data_type _waah_future_type_info = {"Future", future_free};
+
+static void
+future_wait_job(struct encode_job *job) {
+#ifdef WAAH_HAVE_THREADS
+  pthread_mutex_lock(&encode_pool.lock);
+  while(!job->done) {
+    pthread_cond_wait(&encode_pool.done, &encode_pool.lock);
+  }
+  pthread_mutex_unlock(&encode_pool.lock);
+#endif
 }
 
 static mrb_value
-canvas_translate(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  double x, y;
-  mrb_value block;
-  CANVAS_DEFAULT_DECL_INITS;
+future_done_p(mrb_state *mrb, mrb_value self) {
+  struct encode_job *job;
+  int done;
+  Data_Get_Struct(mrb, self, &_waah_future_type_info, job);
 
-  mrb_get_args(mrb, "ff&", &x, &y, &block);
+  ENCODE_LOCK();
+  done = job->done;
+  ENCODE_UNLOCK();
+
+  return mrb_bool_value(done);
+}
+
+static mrb_value
+future_wait(mrb_state *mrb, mrb_value self) {
+  struct encode_job *job;
+  Data_Get_Struct(mrb, self, &_waah_future_type_info, job);
+
+  future_wait_job(job);
 
-  cairo_translate(cr, x, y);
-  if(!mrb_nil_p(block)) {
-    mrb_funcall_with_block(mrb, self, id_instance_eval, 0, NULL, block);
-    cairo_translate(cr, -x, -y);
-  }
   return self;
 }
 
+/* Waits for the job and returns the encoded data. Errors are raised here,
+ * on every call. */
 static mrb_value
-canvas_scale(mrb_state *mrb, mrb_value self) {
+future_value(mrb_state *mrb, mrb_value self) {
+  struct encode_job *job;
+  mrb_sym id_value = mrb_intern_lit(mrb, "__value__");
+  mrb_value value;
+  Data_Get_Struct(mrb, self, &_waah_future_type_info, job);
+
+  future_wait_job(job);
+
+  raise_encode_status(mrb, job->status, job->error);
+
+  /* The output is copied once, the job's buffer isn't needed after that */
+  value = mrb_iv_get(mrb, self, id_value);
+  if(mrb_nil_p(value)) {
+    value = mrb_str_new(mrb, (const char *) job->sink.buf, job->sink.len);
+    mrb_iv_set(mrb, self, id_value, value);
+    str_sink_free(&job->sink);
+  }
+
+  return value;
+}
+
+static mrb_value
+canvas_encode_async(mrb_state *mrb, mrb_value self) {
   CANVAS_DEFAULT_DECLS;
-  double x, y;
-  mrb_value block;
+  mrb_sym format = 0;
+  mrb_value opts = mrb_nil_value();
+  struct encode_job *job;
+  mrb_value future;
   CANVAS_DEFAULT_DECL_INITS;
 
-  mrb_get_args(mrb, "ff&", &x, &y, &block);
+  canvas_check_image(mrb, canvas);
+  mrb_get_args(mrb, "|nH", &format, &opts);
 
-  if(!mrb_nil_p(block)) {
-    cairo_save(cr);
+  job = (struct encode_job *) calloc(1, sizeof(struct encode_job));
+  if(job == NULL) {
+    raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
+  }
+  job->refs = 1;
+  /* Owned by the Future from here on, so raising doesn't leak it */
+  future = mrb_obj_value(Data_Wrap_Struct(mrb, waah_state(mrb)->cFuture, &_waah_future_type_info, job));
+
+  if(format == 0 || format == waah_state(mrb)->id_png) {
+    job->format = ENCODE_PNG;
+    png_parse_opts(mrb, opts, &job->opts.png);
+  } else if(format == waah_state(mrb)->id_jpeg) {
+    job->format = ENCODE_JPEG;
+    jpeg_parse_opts(mrb, opts, &job->opts.jpeg);
+  } else {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "format must be :png or :jpeg");
   }
 
-  cairo_scale(cr, x, y);
+  job->surface = surface_copy(canvas->surface);
+  if(cairo_surface_status(job->surface) != CAIRO_STATUS_SUCCESS) {
+    raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
+  }
 
-  if(!mrb_nil_p(block)) {
-    mrb_funcall_with_block(mrb, self, id_instance_eval, 0, NULL, block);
-    cairo_restore(cr);
+#ifdef WAAH_HAVE_THREADS
+  if(encode_submit(job)) {
+    return future;
   }
-  return self;
+#endif
+
+  /* No threads, encode right here */
+  encode_job_run(job);
+  job->done = TRUE;
+
+  return future;
 }
 
-static mrb_value
-canvas_clip(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_bool preserve = FALSE;
-  CANVAS_DEFAULT_DECL_INITS;
+/* Optional (x, y, w, h) arguments of #mark_dirty */
+static void
+surface_mark_dirty(mrb_state *mrb, cairo_surface_t *surface) {
+  mrb_int x, y, w, h;
 
-  mrb_get_args(mrb, "|b", &preserve);
-  if(!preserve) {
-    cairo_clip(cr);
+  if(mrb_get_args(mrb, "|iiii", &x, &y, &w, &h) == 4) {
+    cairo_surface_mark_dirty_rectangle(surface, x, y, w, h);
   } else {
-    cairo_clip_preserve(cr);
+    cairo_surface_mark_dirty(surface);
   }
-  return self;
 }
 
 static mrb_value
-canvas_rotate(mrb_state *mrb, mrb_value self) {
+canvas_pixels(mrb_state *mrb, mrb_value self) {
   CANVAS_DEFAULT_DECLS;
-  double r;
-  mrb_value block;
   CANVAS_DEFAULT_DECL_INITS;
 
-  mrb_get_args(mrb, "f&", &r, &block);
+  canvas_check_image(mrb, canvas);
 
-  cairo_rotate(cr, r);
-  if(!mrb_nil_p(block)) {
-    mrb_funcall_with_block(mrb, self, id_instance_eval, 0, NULL, block);
-    cairo_rotate(cr, -r);
-  }
-  return self;
+  /* The view may be written to by native code */
+  _waah_canvas_detach_snapshots(canvas);
+
+  return pixels_new(mrb, canvas->surface);
 }
 
 static mrb_value
-canvas_pop(mrb_state *mrb, mrb_value self) {
+canvas_mark_dirty(mrb_state *mrb, mrb_value self) {
   CANVAS_DEFAULT_DECLS;
   CANVAS_DEFAULT_DECL_INITS;
 
-  cairo_restore(cr);
+  canvas_check_image(mrb, canvas);
+  surface_mark_dirty(mrb, canvas->surface);
 
   return self;
 }
 
-cairo_status_t cairo_write_to_mrb_str (void *user_data,
-                                       const unsigned char *data,
-                                       unsigned int length) {
-  mrb_value buf = *((mrb_value *)(((void **)user_data)[0]));
-  mrb_state *mrb = (mrb_state *) ((void **)user_data)[1];
+static mrb_value
+image_pixels(mrb_state *mrb, mrb_value self) {
+  waah_image_t *image;
+  Data_Get_Struct(mrb, self, &_waah_image_type_info, image);
 
-  mrb_str_cat(mrb, buf, (const char *)data, length);
+  /* The view must not change when the canvas is drawn to */
+  if(image->snapshot_of != NULL) {
+    _waah_canvas_detach_snapshots(image->snapshot_of);
+  }
 
-  return CAIRO_STATUS_SUCCESS;
+  /* The view keeps a lazy image decoded, but changes made through it are
+   * lost once the image is evicted after the view is gone */
+  return pixels_new(mrb, image_surface(mrb, image));
 }
 
+static mrb_value
+image_mark_dirty(mrb_state *mrb, mrb_value self) {
+  waah_image_t *image;
+  Data_Get_Struct(mrb, self, &_waah_image_type_info, image);
+
+  surface_mark_dirty(mrb, image_surface(mrb, image));
 
+  return self;
+}
+
+/* Image.from_pixels(data, w, h, stride, format)
+ * data is either a String, which is copied, or a C pointer, which is used
+ * in place and must outlive the image and its Pixels views. */
 static mrb_value
-canvas_snapshot(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  mrb_value mrb_image;
+image_from_pixels(mrb_state *mrb, mrb_value self) {
   waah_image_t *image;
-  cairo_t *image_cr;
-  CANVAS_DEFAULT_DECL_INITS;
+  mrb_value mrb_image;
+  mrb_value data;
+  unsigned char *pixels;
+  mrb_int w, h, stride;
+  mrb_sym sym_format;
+  cairo_format_t format;
+  size_t len;
+
+  mrb_get_args(mrb, "oiiin", &data, &w, &h, &stride, &sym_format);
+  format = format_from_sym(mrb, sym_format);
+
+  if(w <= 0 || h <= 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid size");
+  }
+  if(stride < cairo_format_stride_for_width(format, w) || stride % 4 != 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid stride");
+  }
+  len = (size_t) stride * h;
 
   mrb_image = image_new(mrb, &image);
 
-  image->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, canvas->width, canvas->height);
-  image_cr = cairo_create(image->surface);
-  cairo_set_source_surface(image_cr, canvas->surface, 0, 0);
-  cairo_paint(image_cr);
-  cairo_destroy(image_cr);
+  switch(mrb_type(data)) {
+    case MRB_TT_STRING:
+      if((size_t) RSTRING_LEN(data) < len) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "data too short");
+      }
+      pixels = (unsigned char *) malloc(len);
+      if(pixels == NULL) {
+        raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
+      }
+      memcpy(pixels, RSTRING_PTR(data), len);
+      image->surface = surface_owning_pixels(pixels, format, w, h, stride);
+      if(image->surface == NULL) {
+        raise_cairo_status(mrb, CAIRO_STATUS_NO_MEMORY);
+      }
+      break;
+    case MRB_TT_CPTR:
+      image->surface = cairo_image_surface_create_for_data(mrb_cptr(data), format, w, h, stride);
+      break;
+    default:
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "data must be a String or a C pointer");
+  }
+
+  if(raise_cairo_status(mrb, cairo_surface_status(image->surface))) {
+    return mrb_nil_value();
+  }
 
   return mrb_image;
 }
 
 static mrb_value
-canvas_width(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  CANVAS_DEFAULT_DECL_INITS;
+pixels_width(mrb_state *mrb, mrb_value self) {
+  waah_pixels_t *pixels;
+  Data_Get_Struct(mrb, self, &_waah_pixels_type_info, pixels);
 
-  return mrb_fixnum_value(canvas->width);
+  return mrb_fixnum_value(cairo_image_surface_get_width(pixels->surface));
 }
 
 static mrb_value
-canvas_height(mrb_state *mrb, mrb_value self) {
-  CANVAS_DEFAULT_DECLS;
-  CANVAS_DEFAULT_DECL_INITS;
+pixels_height(mrb_state *mrb, mrb_value self) {
+  waah_pixels_t *pixels;
+  Data_Get_Struct(mrb, self, &_waah_pixels_type_info, pixels);
 
-  return mrb_fixnum_value(canvas->height);
+  return mrb_fixnum_value(cairo_image_surface_get_height(pixels->surface));
 }
 
+static mrb_value
+pixels_stride(mrb_state *mrb, mrb_value self) {
+  waah_pixels_t *pixels;
+  Data_Get_Struct(mrb, self, &_waah_pixels_type_info, pixels);
+
+  return mrb_fixnum_value(cairo_image_surface_get_stride(pixels->surface));
+}
 
 static mrb_value
-image_to_png(mrb_state *mrb, mrb_value self) {
-  waah_image_t *image;
-  cairo_status_t status;
-  mrb_value retval;
-  char *filename;
-  Data_Get_Struct(mrb, self, &_waah_image_type_info, image);
+pixels_format(mrb_state *mrb, mrb_value self) {
+  waah_pixels_t *pixels;
+  Data_Get_Struct(mrb, self, &_waah_pixels_type_info, pixels);
 
-  if(image->surface == NULL) {
-    return mrb_nil_value();
-  }
+  return format_to_sym(mrb, cairo_image_surface_get_format(pixels->surface));
+}
 
-  if(mrb_get_args(mrb, "|z", &filename) > 0) {
-    status = cairo_surface_write_to_png(image->surface, filename);
-    retval = mrb_true_value();
-  } else {
-    void *data[2];
-    retval = mrb_str_buf_new(mrb, 64);
-    data[0] = &retval;
-    data[1] = mrb;
-    status = cairo_surface_write_to_png_stream(image->surface,
-                                               cairo_write_to_mrb_str,
-                                               data);
-  }
+static mrb_value
+pixels_bytesize(mrb_state *mrb, mrb_value self) {
+  waah_pixels_t *pixels;
+  Data_Get_Struct(mrb, self, &_waah_pixels_type_info, pixels);
 
-  if(raise_cairo_status(mrb, status)) {
-    return mrb_nil_value();
+  return mrb_fixnum_value((mrb_int) cairo_image_surface_get_stride(pixels->surface) *
+                          cairo_image_surface_get_height(pixels->surface));
+}
+
+/* Pointer to the first pixel, valid as long as this object is alive */
+static mrb_value
+pixels_ptr(mrb_state *mrb, mrb_value self) {
+  waah_pixels_t *pixels;
+  Data_Get_Struct(mrb, self, &_waah_pixels_type_info, pixels);
+
+  return mrb_cptr_value(mrb, cairo_image_surface_get_data(pixels->surface));
+}
+
+static mrb_value
+pixels_to_s(mrb_state *mrb, mrb_value self) {
+  waah_pixels_t *pixels;
+  Data_Get_Struct(mrb, self, &_waah_pixels_type_info, pixels);
+
+  cairo_surface_flush(pixels->surface);
+  return mrb_str_new(mrb, (const char *) cairo_image_surface_get_data(pixels->surface),
+                     (size_t) cairo_image_surface_get_stride(pixels->surface) *
+                     cairo_image_surface_get_height(pixels->surface));
+}
+
+static mrb_value
+image_s_cache_limit(mrb_state *mrb, mrb_value self) {
+  return mrb_fixnum_value(waah_state(mrb)->image_cache->limit);
+}
+
+/* Maximum number of bytes held by decoded lazy images */
+static mrb_value
+image_s_set_cache_limit(mrb_state *mrb, mrb_value self) {
+  waah_image_cache_t *cache = waah_state(mrb)->image_cache;
+  mrb_int limit;
+
+  mrb_get_args(mrb, "i", &limit);
+  if(limit < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "limit must not be negative");
   }
 
-  return retval;
+  cache->limit = limit;
+  image_cache_trim(mrb, cache, NULL);
+
+  return mrb_fixnum_value(limit);
+}
+
+static mrb_value
+image_s_cache_stats(mrb_state *mrb, mrb_value self) {
+  mrb_value stats = mrb_hash_new(mrb);
+  waah_state_t *state = waah_state(mrb);
+  waah_image_cache_t *cache = state->image_cache;
+
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_limit), mrb_fixnum_value(cache->limit));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_bytes), mrb_fixnum_value(cache->bytes));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_images), mrb_fixnum_value(cache->images));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_hits), mrb_fixnum_value(cache->hits));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_misses), mrb_fixnum_value(cache->misses));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(state->id_evictions), mrb_fixnum_value(cache->evictions));
+
+  return stats;
 }
 
 static mrb_value
@@ -1397,6 +7776,9 @@ image_width(mrb_state *mrb, mrb_value self) {
   waah_image_t *image;
   Data_Get_Struct(mrb, self, &_waah_image_type_info, image);
 
+  if(image->cache != NULL) {
+    return mrb_fixnum_value(image->width);
+  }
   return mrb_fixnum_value(cairo_image_surface_get_width(image->surface));
 }
 
@@ -1405,13 +7787,34 @@ image_height(mrb_state *mrb, mrb_value self) {
   waah_image_t *image;
   Data_Get_Struct(mrb, self, &_waah_image_type_info, image);
 
+  if(image->cache != NULL) {
+    return mrb_fixnum_value(image->height);
+  }
   return mrb_fixnum_value(cairo_image_surface_get_height(image->surface));
 }
 
+static mrb_value
+image_gray_p(mrb_state *mrb, mrb_value self) {
+  waah_image_t *image;
+  Data_Get_Struct(mrb, self, &_waah_image_type_info, image);
+
+  /* Only known once decoded */
+  image_surface(mrb, image);
+
+  return mrb_bool_value(image->gray);
+}
+
 void
 mrb_waah_canvas_gem_init(mrb_state *mrb) {
 
-  FT_Init_FreeType(&ft_lib);
+  waah_state_t *state;
+#ifdef WAAH_HAVE_THREADS
+  static pthread_once_t unpremultiply_once = PTHREAD_ONCE_INIT;
+
+  pthread_once(&unpremultiply_once, init_unpremultiply_table);
+#else
+  init_unpremultiply_table();
+#endif
 
   mWaah = mrb_define_module(mrb, "Waah");
 
@@ -1430,7 +7833,25 @@ mrb_waah_canvas_gem_init(mrb_state *mrb) {
   cPath = mrb_define_class_under(mrb, mWaah, "Path", mrb->object_class);
   MRB_SET_INSTANCE_TT(cPath, MRB_TT_DATA);
 
-  mrb_define_method(mrb, cCanvas, "initialize", canvas_initialize, MRB_ARGS_REQ(2));
+  cPixels = mrb_define_class_under(mrb, mWaah, "Pixels", mrb->object_class);
+  MRB_SET_INSTANCE_TT(cPixels, MRB_TT_DATA);
+
+  cPicture = mrb_define_class_under(mrb, mWaah, "Picture", mrb->object_class);
+  MRB_SET_INSTANCE_TT(cPicture, MRB_TT_DATA);
+
+  cFuture = mrb_define_class_under(mrb, mWaah, "Future", mrb->object_class);
+  MRB_SET_INSTANCE_TT(cFuture, MRB_TT_DATA);
+
+  cTextRun = mrb_define_class_under(mrb, mWaah, "TextRun", mrb->object_class);
+  MRB_SET_INSTANCE_TT(cTextRun, MRB_TT_DATA);
+
+  mCommands = mrb_define_module_under(mrb, mWaah, "Commands");
+
+  mrb_define_method(mrb, cCanvas, "initialize", canvas_initialize, MRB_ARGS_REQ(2) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cCanvas, "reset", canvas_reset, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, cCanvas, "pool_limit", canvas_s_pool_limit, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, cCanvas, "pool_limit=", canvas_s_set_pool_limit, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, cCanvas, "pool_stats", canvas_s_pool_stats, MRB_ARGS_NONE());
 
   mrb_define_method(mrb, cCanvas, "color", canvas_color, MRB_ARGS_REQ(3) | MRB_ARGS_OPT(1));
   mrb_define_method(mrb, cCanvas, "image", canvas_image, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
@@ -1441,7 +7862,14 @@ mrb_waah_canvas_gem_init(mrb_state *mrb) {
   mrb_define_method(mrb, cCanvas, "rect", canvas_rect, MRB_ARGS_REQ(4));
   mrb_alias_method(mrb, cCanvas, mrb_intern_cstr(mrb, "rectangle"), mrb_intern_cstr(mrb, "rect"));
   mrb_define_method(mrb, cCanvas, "rounded_rect", canvas_rounded_rect, MRB_ARGS_REQ(5));
+  mrb_define_method(mrb, cCanvas, "rects", canvas_rects, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cCanvas, "circles", canvas_circles, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cCanvas, "lines", canvas_lines, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cCanvas, "polyline", canvas_polyline, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cCanvas, "execute", canvas_execute, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, cCanvas, "picture", canvas_picture, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
   mrb_define_method(mrb, cCanvas, "path", canvas_path, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cCanvas, "copy_path", canvas_copy_path, MRB_ARGS_NONE());
   mrb_define_method(mrb, cCanvas, "path_extents", canvas_path_extents, MRB_ARGS_NONE());
   mrb_define_method(mrb, cCanvas, "z", canvas_z, MRB_ARGS_NONE());
   mrb_define_method(mrb, cCanvas, "m", canvas_m, MRB_ARGS_REQ(2));
@@ -1456,13 +7884,20 @@ mrb_waah_canvas_gem_init(mrb_state *mrb) {
   mrb_define_method(mrb, cCanvas, "C", canvas_C, MRB_ARGS_REQ(6));
   mrb_define_method(mrb, cCanvas, "a", canvas_a, MRB_ARGS_REQ(5)| MRB_ARGS_OPT(1));
   mrb_define_method(mrb, cCanvas, "A", canvas_A, MRB_ARGS_REQ(5) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cCanvas, "svg_path", canvas_svg_path, MRB_ARGS_REQ(1));
 
   mrb_define_method(mrb, cCanvas, "text", canvas_text, MRB_ARGS_REQ(3));
   mrb_define_method(mrb, cCanvas, "text_extents", canvas_text_extents, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cCanvas, "text_extents_many", canvas_text_extents_many, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cCanvas, "text_box", canvas_text_box, MRB_ARGS_REQ(5) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cCanvas, "text_run", canvas_text_run, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, cCanvas, "draw_text", canvas_draw_text, MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, cCanvas, "font_options", canvas_font_options, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, cCanvas, "font_size", canvas_font_size, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, cCanvas, "font", canvas_font, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
 
   mrb_define_method(mrb, cCanvas, "fill", canvas_fill, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cCanvas, "mask", canvas_mask, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
   mrb_define_method(mrb, cCanvas, "stroke", canvas_stroke, MRB_ARGS_OPT(1));
   mrb_define_method(mrb, cCanvas, "line_width", canvas_line_width, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, cCanvas, "line_cap", canvas_line_cap, MRB_ARGS_REQ(1));
@@ -1474,52 +7909,168 @@ mrb_waah_canvas_gem_init(mrb_state *mrb) {
   mrb_define_method(mrb, cCanvas, "clip", canvas_clip, MRB_ARGS_OPT(1));
   mrb_define_method(mrb, cCanvas, "scale", canvas_scale, MRB_ARGS_REQ(2) | MRB_ARGS_BLOCK());
   mrb_define_method(mrb, cCanvas, "rotate", canvas_rotate, MRB_ARGS_REQ(1) | MRB_ARGS_BLOCK());
-  mrb_define_method(mrb, cCanvas,  "snapshot", canvas_snapshot, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cCanvas,  "snapshot", canvas_snapshot, MRB_ARGS_OPT(1));
   mrb_define_method(mrb, cCanvas, "width", canvas_width, MRB_ARGS_NONE());
   mrb_define_method(mrb, cCanvas, "height", canvas_height, MRB_ARGS_NONE());
-
-  mrb_define_class_method(mrb, cImage, "load", image_load, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cCanvas, "pixels", canvas_pixels, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cCanvas, "mark_dirty", canvas_mark_dirty, MRB_ARGS_OPT(4));
+  mrb_define_method(mrb, cCanvas, "to_png", canvas_to_png, MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, cCanvas, "to_jpeg", canvas_to_jpeg, MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, cCanvas, "encode_async", canvas_encode_async, MRB_ARGS_OPT(2));
+
+  mrb_define_class_method(mrb, cImage, "load", image_load, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_class_method(mrb, cImage, "decode", image_decode, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
   mrb_undef_class_method(mrb, cImage, "new");
-  mrb_define_method(mrb, cImage, "to_png", image_to_png, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cImage, "to_png", image_to_png, MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, cImage, "to_jpeg", image_to_jpeg, MRB_ARGS_OPT(2));
+  mrb_define_class_method(mrb, cImage, "from_pixels", image_from_pixels, MRB_ARGS_REQ(5));
+  mrb_define_class_method(mrb, cImage, "cache_limit", image_s_cache_limit, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, cImage, "cache_limit=", image_s_set_cache_limit, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, cImage, "cache_stats", image_s_cache_stats, MRB_ARGS_NONE());
   mrb_define_method(mrb, cImage, "width", image_width, MRB_ARGS_NONE());
   mrb_define_method(mrb, cImage, "height", image_height, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cImage, "gray?", image_gray_p, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cImage, "pixels", image_pixels, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cImage, "mark_dirty", image_mark_dirty, MRB_ARGS_OPT(4));
+
+  mrb_undef_class_method(mrb, cPixels, "new");
+  mrb_define_method(mrb, cPixels, "width", pixels_width, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cPixels, "height", pixels_height, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cPixels, "stride", pixels_stride, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cPixels, "format", pixels_format, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cPixels, "bytesize", pixels_bytesize, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cPixels, "ptr", pixels_ptr, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cPixels, "to_s", pixels_to_s, MRB_ARGS_NONE());
+
+  mrb_define_class_method(mrb, cPicture, "record", picture_record, MRB_ARGS_REQ(2) | MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, cPicture, "width", picture_width, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cPicture, "height", picture_height, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cPicture, "ink_extents", picture_ink_extents, MRB_ARGS_NONE());
+
+  mrb_undef_class_method(mrb, cFuture, "new");
+  mrb_define_method(mrb, cFuture, "done?", future_done_p, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cFuture, "wait", future_wait, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cFuture, "value", future_value, MRB_ARGS_NONE());
+
+  mrb_define_method(mrb, cTextRun, "initialize", text_run_initialize, MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, cTextRun, "width", text_run_width, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cTextRun, "extents", text_run_extents, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cTextRun, "glyph_count", text_run_glyph_count, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cTextRun, "text", text_run_text, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, cTextRun, "cache_stats", text_run_s_cache_stats, MRB_ARGS_NONE());
+
+  mrb_define_module_function(mrb, mCommands, "validate", commands_validate, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_module_function(mrb, mCommands, "disassemble", commands_disassemble, MRB_ARGS_REQ(1));
+  mrb_define_module_function(mrb, mCommands, "stats", commands_s_stats, MRB_ARGS_NONE());
+  {
+    /* Opcodes as constants, e.g. Waah::Commands::MOVE_TO */
+    int op;
+    for(op = 0; op < 256; op++) {
+      char name[32];
+      size_t i;
+      if(cmd_ops[op].name == NULL) {
+        continue;
+      }
+      for(i = 0; cmd_ops[op].name[i] != '\0' && i < sizeof(name) - 1; i++) {
+        name[i] = toupper((unsigned char) cmd_ops[op].name[i]);
+      }
+      name[i] = '\0';
+      mrb_define_const(mrb, mCommands, name, mrb_fixnum_value(op));
+    }
+  }
 
   mrb_define_class_method(mrb, cFont, "load", font_load, MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb, cFont, "find", font_find, MRB_ARGS_REQ(1));
-  mrb_define_class_method(mrb, cFont, "list", font_list, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, cFont, "list", font_list, MRB_ARGS_OPT(1));
+  mrb_define_class_method(mrb, cFont, "families", font_families, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, cFont, "preload", font_preload, MRB_ARGS_NONE());
   mrb_undef_class_method(mrb, cFont, "new");
   mrb_define_method(mrb, cFont, "name", font_name, MRB_ARGS_NONE());
   mrb_define_method(mrb, cFont, "family", font_family, MRB_ARGS_NONE());
   mrb_define_method(mrb, cFont, "style", font_style, MRB_ARGS_NONE());
 
   mrb_define_method(mrb, cPath, "initialize", path_initialize, MRB_ARGS_NONE());
-
-  /*mrb_define_method(mrb, cPath, "move_to", path_initialize, MRB_ARGS_REQ(2));
-  mrb_define_method(mrb, cPath, "line_to", path_initialize, MRB_ARGS_REQ(2));
-  mrb_define_method(mrb, cPath, "curve_to", path_initialize, MRB_ARGS_REQ(2));
-  mrb_define_method(mrb, cPath, "i", path_initialize, MRB_ARGS_REQ(2));
-   */
+  mrb_define_method(mrb, cPath, "ellipse", canvas_ellipse, MRB_ARGS_REQ(4));
+  mrb_define_method(mrb, cPath, "circle", canvas_circle, MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, cPath, "rect", canvas_rect, MRB_ARGS_REQ(4));
+  mrb_alias_method(mrb, cPath, mrb_intern_cstr(mrb, "rectangle"), mrb_intern_cstr(mrb, "rect"));
+  mrb_define_method(mrb, cPath, "rounded_rect", canvas_rounded_rect, MRB_ARGS_REQ(5));
+  mrb_define_method(mrb, cPath, "z", canvas_z, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cPath, "m", canvas_m, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, cPath, "M", canvas_M, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, cPath, "l", canvas_l, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, cPath, "L", canvas_L, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, cPath, "h", canvas_h, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cPath, "H", canvas_H, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cPath, "v", canvas_v, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cPath, "V", canvas_V, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cPath, "c", canvas_c, MRB_ARGS_REQ(6));
+  mrb_define_method(mrb, cPath, "C", canvas_C, MRB_ARGS_REQ(6));
+  mrb_define_method(mrb, cPath, "a", canvas_a, MRB_ARGS_REQ(5)| MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cPath, "A", canvas_A, MRB_ARGS_REQ(5) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cPath, "svg_path", canvas_svg_path, MRB_ARGS_REQ(1));
+  mrb_alias_method(mrb, cPath, mrb_intern_cstr(mrb, "move_to"), mrb_intern_cstr(mrb, "M"));
+  mrb_alias_method(mrb, cPath, mrb_intern_cstr(mrb, "line_to"), mrb_intern_cstr(mrb, "L"));
+  mrb_alias_method(mrb, cPath, mrb_intern_cstr(mrb, "curve_to"), mrb_intern_cstr(mrb, "C"));
+  mrb_alias_method(mrb, cPath, mrb_intern_cstr(mrb, "close"), mrb_intern_cstr(mrb, "z"));
+  mrb_define_method(mrb, cPath, "clear", path_clear, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cPath, "extents", path_extents, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cPath, "translate", path_translate, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, cPath, "scale", path_scale, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, cPath, "rotate", path_rotate, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cPath, "transform", path_transform, MRB_ARGS_REQ(6));
 
   mrb_define_class_method(mrb, cPattern, "linear", pattern_linear, MRB_ARGS_REQ(4));
   mrb_define_class_method(mrb, cPattern, "radial", pattern_radial, MRB_ARGS_REQ(6));
   mrb_undef_class_method(mrb, cPattern, "new");
   mrb_define_method(mrb, cPattern, "color_stop", pattern_color_stop, MRB_ARGS_REQ(4) | MRB_ARGS_OPT(1));
 
-  id_instance_eval = mrb_intern_lit(mrb, "instance_eval");
-  id_normal = mrb_intern_lit(mrb, "normal");
-  id_italic = mrb_intern_lit(mrb, "italic");
-  id_oblique = mrb_intern_lit(mrb, "oblique");
-  id_bold = mrb_intern_lit(mrb, "bold");
 
-  id_round = mrb_intern_lit(mrb, "round");
-  id_square = mrb_intern_lit(mrb, "square");
-  id_butt = mrb_intern_lit(mrb, "butt");
-  id_miter = mrb_intern_lit(mrb, "miter");
-  id_bevel = mrb_intern_lit(mrb, "bevel");
+
+
+
+
+  state = (waah_state_t *) mrb_calloc(mrb, sizeof(waah_state_t), 1);
+  mrb_iv_set(mrb, mrb_obj_value(mWaah), mrb_intern_lit(mrb, "__state__"),
+             mrb_obj_value(Data_Wrap_Struct(mrb, mrb->object_class, &_waah_state_type_info, state)));
+
+  state->ft_lib = (waah_ft_lib_t *) malloc(sizeof(waah_ft_lib_t));
+  if(state->ft_lib == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "no memory");
+  }
+  state->ft_lib->refs = 1;
+  if(FT_Init_FreeType(&state->ft_lib->lib) != FT_Err_Ok) {
+    free(state->ft_lib);
+    state->ft_lib = NULL;
+    mrb_raise(mrb, E_RUNTIME_ERROR, "FreeType initialization failed");
+  }
+
+  state->image_cache = (waah_image_cache_t *) calloc(1, sizeof(waah_image_cache_t));
+  if(state->image_cache == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "no memory");
+  }
+  state->image_cache->limit = IMAGE_CACHE_DEFAULT_LIMIT;
+  state->image_cache->refs = 1;
+
+  state->mWaah = mWaah;
+  state->cCanvas = cCanvas;
+  state->cImage = cImage;
+  state->cFont = cFont;
+  state->cPath = cPath;
+  state->cPattern = cPattern;
+  state->cPixels = cPixels;
+  state->cPicture = cPicture;
+  state->cFuture = cFuture;
+  state->cTextRun = cTextRun;
+  state->mCommands = mCommands;
+#define X(name) state->id_##name = mrb_intern_lit(mrb, #name);
+  WAAH_SYMBOLS(X)
+#undef X
 }
 
 void
 mrb_waah_canvas_gem_final(mrb_state* mrb) {
-  //FT_Done_FreeType(ft_lib);
-  /* finalizer */
+  /* The state itself is freed with the other objects, this only
+   * invalidates pointers to it cached by waah_state() */
+  __sync_fetch_and_add(&state_epoch, 1);
 }
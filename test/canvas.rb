@@ -158,3 +158,652 @@ assert('Font#find') do
   font = Waah::Font.find("Sans Serif")
   assert_not_equal nil, font
 end
+
+assert('Font.list filters') do
+  Waah::Font.preload
+  families = Waah::Font.families
+  assert_kind_of Array, families
+  assert_equal families.size, families.uniq.size
+
+  family = families.first
+  fonts = Waah::Font.list family: family.upcase
+  assert_not_equal [], fonts
+  fonts.each { |f| assert_equal family.downcase, f.family.downcase }
+
+  style = fonts.map(&:style).compact.first
+  Waah::Font.list(family: family, style: style).each { |f| assert_equal style, f.style } if style
+  assert_equal [], Waah::Font.list(family: "No Such Family")
+  assert_raise(ArgumentError) { Waah::Font.list family: 1 }
+end
+
+assert('Font.find memoized') do
+  a = Waah::Font.find("Sans Serif")
+  b = Waah::Font.find("Sans Serif")
+  assert_equal a.name, b.name
+end
+
+assert('Font.load shared faces') do
+  render = lambda do |font|
+    c = Waah::Canvas.new 100, 40
+    c.font font
+    c.font_size 20.0
+    c.text 5.0, 30.0, "Shared"
+    c.fill
+    c.pixels.to_s
+  end
+
+  a = Waah::Font.load "../../test/Tuffy.ttf"
+  b = Waah::Font.load "../../test/Tuffy.ttf"
+  assert_equal 'Tuffy', b.name
+  assert_equal render.call(a), render.call(b)
+  assert_raise(ArgumentError) { Waah::Font.load "../../test/missing.ttf" }
+end
+
+assert('Waah::TextRun') do
+  font = Waah::Font.load "../../test/Tuffy.ttf"
+  run = Waah::TextRun.new font, 20.0, "Ruby rules"
+  assert_equal "Ruby rules", run.text
+  assert_equal 10, run.glyph_count
+  assert_true run.width > 0
+
+  c = Waah::Canvas.new 200, 40
+  c.font font
+  c.font_size 20.0
+  assert_true (c.text_extents("Ruby rules")[4] - run.width).abs < 1.0
+
+  # Shaped once
+  hits = Waah::TextRun.cache_stats[:hits]
+  again = Waah::TextRun.new font, 20.0, "Ruby rules"
+  assert_equal hits + 1, Waah::TextRun.cache_stats[:hits]
+  assert_equal run.extents, again.extents
+
+  empty = c.pixels.to_s
+  c.move_to 0, 0
+  c.text_run run, 5.0, 30.0
+  assert_not_equal empty, c.pixels.to_s
+
+  assert_true Waah::TextRun.new("Sans Serif", 12.0, "abc").width > 0
+  assert_raise(ArgumentError) { Waah::TextRun.new font, 0.0, "abc" }
+  assert_raise(ArgumentError) { Waah::TextRun.new font, 12.0, "ab\xff" }
+  assert_raise(TypeError) { c.text_run "abc" }
+
+  # Drawn for the canvas' transformation, like draw_text
+  scaled = Waah::Canvas.new 200, 40
+  scaled.font font
+  scaled.font_size 10.0
+  scaled.scale(2, 2) { scaled.draw_text 2.5, 15.0, "R" }
+  r = Waah::Canvas.new 200, 40
+  r.scale(2, 2) { r.text_run Waah::TextRun.new(font, 10.0, "R"), 2.5, 15.0 }
+  assert_equal scaled.pixels.to_s, r.pixels.to_s
+end
+
+assert('Canvas#draw_text') do
+  font = Waah::Font.load "../../test/Tuffy.ttf"
+  c = Waah::Canvas.new 200, 40
+  c.font font
+  c.font_size 20.0
+  empty = c.pixels.to_s
+
+  c.rect 1, 2, 3, 4
+  c.draw_text 5.0, 30.0, "Ruby rules"
+  assert_not_equal empty, c.pixels.to_s
+  # The path is left alone
+  assert_equal [1.0, 2.0, 3.0, 4.0], c.path_extents
+
+  c.font_options antialias: :none, hinting: :full, hint_metrics: false
+  c.draw_text 5.0, 30.0, "Ruby rules"
+  assert_raise(ArgumentError) { c.font_options antialias: :blurry }
+  assert_raise(ArgumentError) { c.font_options hinting: 1 }
+
+  # TextRuns are drawn with the canvas' options too
+  run = Waah::TextRun.new font, 20.0, "R"
+  smooth = Waah::Canvas.new 40, 40
+  smooth.text_run run, 5.0, 30.0
+  aliased = Waah::Canvas.new 40, 40
+  aliased.font_options antialias: :none
+  aliased.text_run run, 5.0, 30.0
+  assert_not_equal smooth.pixels.to_s, aliased.pixels.to_s
+
+  ops = Waah::Commands
+  d = Waah::Canvas.new 200, 40
+  d.font font
+  d.font_size 20.0
+  d.execute ops::DRAW_TEXT.chr + "\x00\x00\xa0\x40" + "\x00\x00\xf0\x41" +
+            "\x0b\x00\x00\x00Ruby rules\x00"
+  e = Waah::Canvas.new 200, 40
+  e.font font
+  e.font_size 20.0
+  e.draw_text 5.0, 30.0, "Ruby rules"
+  assert_equal e.pixels.to_s, d.pixels.to_s
+end
+
+assert('Canvas#text_box') do
+  font = Waah::Font.load "../../test/Tuffy.ttf"
+  c = Waah::Canvas.new 200, 200
+  c.font font
+  c.font_size 20.0
+  empty = c.pixels.to_s
+
+  lines = c.text_box 10, 10, 120, 180, "The sky is the limit\nRuby rules"
+  assert_not_equal empty, c.pixels.to_s
+  assert_true lines.size >= 3
+  lines.each { |line| assert_true line[2] <= 120 }
+  assert_equal 0, lines.first[3]
+  assert_equal 10.0, lines.first[0]
+  assert_true lines[1][1] > lines[0][1]
+  assert_equal "Ruby rules".size, lines.last[4]
+
+  right = c.text_box(10, 10, 120, 180, "abc", align: :right).first
+  assert_equal 130, (right[0] + right[2]).round
+
+  # Only as many lines as fit, the last one shortened
+  one = c.text_box 0, 0, 120, 30, "The sky is the limit", ellipsis: true
+  assert_equal 1, one.size
+  assert_true one.first[2] <= 120
+  assert_equal [], c.text_box(0, 0, 120, 5, "The sky")
+
+  assert_raise(ArgumentError) { c.text_box 0, 0, 0, 10, "abc" }
+  assert_raise(ArgumentError) { c.text_box 0, 0, 10, 10, "abc", align: :middle }
+end
+
+assert('Canvas#text_extents_many') do
+  c = Waah::Canvas.new 100, 40
+  c.font_size 20.0
+  words = ["The sky", "is", "the limit"]
+
+  packed = c.text_extents_many words
+  assert_equal words.size * 6 * 4, packed.bytesize
+  assert_equal words.size * 6 * 8, c.text_extents_many(words, double: true).bytesize
+  assert_equal c.text_extents("is")[4], c.text_extents_many(["is"], double: true).unpack('d*')[4]
+  assert_equal "", c.text_extents_many([])
+  assert_raise(TypeError) { c.text_extents_many [1] }
+end
+
+assert('Image.load with max size') do
+  img = Waah::Image.load '../../test/bg.jpg', max_width: 100
+  assert_equal 100, img.width
+  assert_equal 89, img.height
+
+  img = Waah::Image.load '../../test/bg.jpg', max_width: 1000, max_height: 40
+  assert_equal 45, img.width
+  assert_equal 40, img.height
+
+  img = Waah::Image.load '../../test/bg.png', max_width: 100, max_height: 100
+  assert_equal 100, img.width
+  assert_equal 89, img.height
+end
+
+assert('Image.decode') do
+  png = Waah::Image.load('../../test/bg.png').to_png
+  img = Waah::Image.decode png
+  assert_equal 347, img.width
+  assert_equal 310, img.height
+
+  img = Waah::Image.decode png, max_width: 100
+  assert_equal 100, img.width
+
+  assert_raise(ArgumentError) { Waah::Image.decode "not an image" }
+  assert_raise(RuntimeError) { Waah::Image.decode "\xff\xd8\xff\xe0 truncated" }
+end
+
+assert('Image#to_png options') do
+  img = Waah::Image.load '../../test/bg.jpg'
+
+  default = img.to_png
+  fast = img.to_png fast: true
+  stored = img.to_png level: 0, filter: :none
+
+  [default, fast, stored].each do |png|
+    decoded = Waah::Image.decode png
+    assert_equal 347, decoded.width
+    assert_equal 310, decoded.height
+  end
+  assert_true stored.size > default.size
+
+  assert_raise(ArgumentError) { img.to_png filter: :bogus }
+  assert_raise(ArgumentError) { img.to_png level: 10 }
+  assert_raise(ArgumentError) { img.to_png level: -1 }
+end
+
+assert('Canvas#to_jpeg') do
+  c = Waah::Canvas.new 64, 48
+  c.color 0xff, 0, 0
+  c.rect 0, 0, 64, 48
+  c.fill
+
+  [{}, {quality: 50, subsampling: 444}, {progressive: true}].each do |opts|
+    jpeg = c.to_jpeg opts
+    img = Waah::Image.decode jpeg
+    assert_equal 64, img.width
+    assert_equal 48, img.height
+  end
+
+  img = Waah::Image.load '../../test/bg.jpg'
+  assert_equal 347, Waah::Image.decode(img.to_jpeg(quality: 90)).width
+
+  assert_raise(ArgumentError) { c.to_jpeg quality: 0 }
+  assert_raise(ArgumentError) { c.to_jpeg subsampling: 411 }
+end
+
+assert('Canvas#to_jpeg output larger than the initial buffer') do
+  # Noise doesn't compress, so the output buffer has to grow while encoding
+  seed = 1
+  noise = ''
+  (128 * 128 * 4).times do
+    seed = (seed * 1103515245 + 12345) & 0x7fffffff
+    noise << ((seed >> 16) & 0xff).chr
+  end
+  img = Waah::Image.from_pixels noise, 128, 128, 512, :rgb24
+
+  jpeg = img.to_jpeg quality: 100, subsampling: 444
+  assert_true jpeg.bytesize > 128 * 128 * 3 / 4 + 4096
+  assert_equal 128, Waah::Image.decode(jpeg).width
+end
+
+assert('Canvas#encode_async') do
+  c = Waah::Canvas.new 64, 48
+  c.color 0xff, 0, 0
+  c.circle 32, 24, 16
+  c.fill
+
+  png = c.to_png
+  jpeg = c.to_jpeg quality: 90
+  png_future = c.encode_async
+  jpeg_future = c.encode_async :jpeg, quality: 90
+
+  # Pending encodes work on a copy
+  c.color 0, 0, 0xff
+  c.rect 0, 0, 64, 48
+  c.fill
+
+  assert_equal png, png_future.value
+  assert_equal jpeg, jpeg_future.wait.value
+  assert_true png_future.done?
+
+  # More jobs than the queue holds
+  futures = Array.new(20) { c.encode_async :png, fast: true }
+  futures.each do |future|
+    assert_equal 64, Waah::Image.decode(future.value).width
+  end
+
+  assert_raise(ArgumentError) { c.encode_async :gif }
+  assert_raise(ArgumentError) { c.encode_async :png, level: 10 }
+end
+
+assert('Canvas#reset') do
+  blank = Waah::Canvas.new(256, 256).to_png
+  c = Waah::Canvas.new 256, 256
+  c.color 0xff, 0, 0
+  c.translate 10, 10
+  c.rect 0, 0, 100, 100
+  c.fill
+  snapshot = c.snapshot
+  drawn = snapshot.to_png
+
+  c.reset
+  assert_equal blank, c.to_png
+  assert_equal drawn, snapshot.to_png
+
+  # The drawing state is reset, too
+  c.rect 0, 0, 100, 100
+  c.fill
+  fresh = Waah::Canvas.new 256, 256
+  fresh.rect 0, 0, 100, 100
+  fresh.fill
+  assert_equal fresh.to_png, c.to_png
+end
+
+assert('Canvas surface pool') do
+  limit = Waah::Canvas.pool_limit
+  Waah::Canvas.pool_limit = 16 * 1024 * 1024
+  blank = Waah::Canvas.new(256, 256).to_png
+
+  Array.new(4) do
+    c = Waah::Canvas.new 256, 256
+    c.color 0xff, 0, 0
+    c.rect 0, 0, 256, 256
+    c.fill
+  end
+  GC.start
+  hits = Waah::Canvas.pool_stats[:hits]
+
+  # Pooled pixels are cleared before reuse
+  4.times do
+    assert_equal blank, Waah::Canvas.new(256, 256).to_png
+  end
+  assert_true Waah::Canvas.pool_stats[:hits] > hits
+
+  Waah::Canvas.pool_limit = 0
+  assert_equal 0, Waah::Canvas.pool_stats[:bytes]
+  assert_raise(ArgumentError) { Waah::Canvas.pool_limit = -1 }
+  Waah::Canvas.pool_limit = limit
+end
+
+assert('Canvas formats') do
+  [:argb32, :rgb24, :a8, :a1, :rgb16_565, :rgb30].each do |format|
+    c = Waah::Canvas.new 40, 30, format: format
+    c.rect 0, 0, 20, 30
+    c.fill
+    assert_equal format, c.pixels.format
+    assert_equal format, c.snapshot.pixels.format
+
+    [c.to_png, c.to_jpeg].each do |data|
+      img = Waah::Image.decode data
+      assert_equal 40, img.width
+      assert_equal 30, img.height
+    end
+  end
+
+  c = Waah::Canvas.new 40, 30
+  assert_equal 40, c.pixels.stride / 4
+  assert_equal 40, Waah::Canvas.new(40, 30, format: :a8).pixels.bytesize / 30
+  assert_equal :rgb24, c.snapshot(format: :rgb24).pixels.format
+  assert_equal :argb32, c.snapshot(format: :argb32).pixels.format
+
+  assert_raise(ArgumentError) { Waah::Canvas.new 40, 30, format: :bogus }
+  assert_raise(ArgumentError) { c.snapshot format: :bogus }
+end
+
+assert('Canvas#mask') do
+  mask = Waah::Canvas.new 40, 30, format: :a8
+  mask.rect 0, 0, 20, 30
+  mask.fill
+
+  c = Waah::Canvas.new 40, 30, format: :rgb24
+  c.color 0xff, 0xff, 0xff
+  c.mask mask
+
+  bytes = c.pixels.to_s.bytes
+  assert_equal [0xff, 0xff, 0xff], bytes[0, 3]
+  assert_equal [0, 0, 0], bytes[39 * 4, 3]
+
+  # Images work as masks, too
+  c.color 0xff, 0, 0
+  c.mask mask.snapshot, 20, 0
+  assert_equal 0xff, c.pixels.to_s.bytes[39 * 4 + 2]
+
+  assert_raise(ArgumentError) { mask.mask mask }
+  assert_raise(TypeError) { c.mask "mask" }
+end
+
+assert('Grayscale images') do
+  src = Waah::Canvas.new 40, 30, format: :a8
+  src.color 0, 0, 0, 0x80
+  src.rect 0, 0, 20, 30
+  src.fill
+
+  [src.to_png, src.to_jpeg(quality: 100)].each do |data|
+    img = Waah::Image.decode data
+    assert_true img.gray?
+    assert_equal :a8, img.pixels.format
+
+    # Drawn as gray, not as alpha
+    c = Waah::Canvas.new 40, 30, format: :rgb24
+    c.color 0xff, 0, 0
+    c.rect 0, 0, 40, 30
+    c.fill
+    c.image img
+    c.rect 0, 0, 40, 30
+    c.fill
+    bytes = c.pixels.to_s.bytes
+    assert_true (bytes[0] - 0x80).abs <= 2
+    assert_equal bytes[0], bytes[2]
+    assert_true bytes[39 * 4 + 2] <= 2
+  end
+
+  assert_false Waah::Image.load('../../test/bg.jpg').gray?
+  assert_false src.snapshot.gray?
+end
+
+assert('Image lazy loading') do
+  limit = Waah::Image.cache_limit
+  eager = Waah::Image.load '../../test/bg.jpg'
+  img = Waah::Image.load '../../test/bg.jpg', lazy: true
+
+  # Size comes from the header
+  misses = Waah::Image.cache_stats[:misses]
+  assert_equal 347, img.width
+  assert_equal 310, img.height
+  assert_equal misses, Waah::Image.cache_stats[:misses]
+
+  draw = lambda do |image|
+    c = Waah::Canvas.new 347, 310
+    c.image image
+    # Release the source, so the image is no longer in use
+    c.color 0, 0, 0
+    c.pixels.to_s
+  end
+
+  pixels = draw.call(img)
+  assert_equal misses + 1, Waah::Image.cache_stats[:misses]
+  assert_equal draw.call(eager), pixels
+  hits = Waah::Image.cache_stats[:hits]
+  draw.call(img)
+  assert_equal hits + 1, Waah::Image.cache_stats[:hits]
+
+  # Evicted pixels are decoded again
+  evictions = Waah::Image.cache_stats[:evictions]
+  Waah::Image.cache_limit = 0
+  assert_equal evictions + 1, Waah::Image.cache_stats[:evictions]
+  assert_equal 0, Waah::Image.cache_stats[:bytes]
+  assert_equal pixels, draw.call(img)
+  assert_equal misses + 2, Waah::Image.cache_stats[:misses]
+
+  Waah::Image.cache_limit = limit
+  png = eager.to_png
+  img = Waah::Image.decode png, lazy: true, max_width: 100
+  assert_equal 100, img.width
+  assert_equal 89, img.height
+  assert_equal 100, img.pixels.width
+
+  assert_raise(ArgumentError) { Waah::Image.cache_limit = -1 }
+  Waah::Image.cache_limit = limit
+
+  # Decoding fails past the header, every time
+  broken = Waah::Image.decode png[0, png.bytesize / 2], lazy: true
+  assert_equal 347, broken.width
+  stats = Waah::Image.cache_stats
+  assert_raise(RuntimeError) { broken.pixels }
+  assert_raise(RuntimeError) { broken.pixels }
+  assert_equal stats[:misses] + 2, Waah::Image.cache_stats[:misses]
+  assert_equal stats[:hits], Waah::Image.cache_stats[:hits]
+  assert_equal stats[:bytes], Waah::Image.cache_stats[:bytes]
+
+  # Sizes cairo can't create are rejected from the header
+  ihdr = "\x89PNG\r\n\x1a\n\x00\x00\x00\x0dIHDR"
+  ["\x00\x00\x00\x00", "\x00\x00\x80\x00", "\x80\x00\x00\x01"].each do |size|
+    assert_raise(RuntimeError) do
+      Waah::Image.decode ihdr + size + "\x00\x00\x00\x10\x08\x06\x00\x00\x00", lazy: true
+    end
+  end
+end
+
+assert('Canvas#snapshot copy-on-write') do
+  c = Waah::Canvas.new 32, 32
+  c.color 0xff, 0, 0
+  c.rect 0, 0, 32, 32
+  c.fill
+
+  before = c.snapshot
+  png = before.to_png
+  assert_equal png, c.to_png
+
+  c.color 0, 0, 0xff
+  c.rect 0, 0, 32, 32
+  c.fill
+
+  assert_equal png, before.to_png
+  assert_not_equal png, c.to_png
+  assert_equal c.to_png, c.snapshot.to_png
+end
+
+assert('Canvas#image of its own snapshot') do
+  c = Waah::Canvas.new 32, 32
+  c.color 0xff, 0, 0
+  c.rect 0, 0, 16, 32
+  c.fill
+
+  snapshot = c.snapshot
+  png = snapshot.to_png
+  c.image snapshot, 16, 0
+  c.rect 0, 0, 32, 32
+  c.fill
+
+  expected = Waah::Canvas.new 32, 32
+  expected.color 0xff, 0, 0
+  expected.rect 0, 0, 32, 32
+  expected.fill
+
+  assert_equal expected.to_png, c.to_png
+  assert_equal png, snapshot.to_png
+end
+
+assert('Canvas#pixels') do
+  c = Waah::Canvas.new 10, 5
+  c.color 0xff, 0, 0
+  c.rect 0, 0, 10, 5
+  c.fill
+
+  px = c.pixels
+  assert_equal 10, px.width
+  assert_equal 5, px.height
+  assert_equal :argb32, px.format
+  assert_equal 40, px.stride
+  assert_equal 200, px.bytesize
+  assert_equal 200, px.to_s.size
+
+  img = Waah::Image.from_pixels px.to_s, px.width, px.height, px.stride, px.format
+  assert_equal 10, img.width
+  assert_equal px.to_s, img.pixels.to_s
+
+  img = Waah::Image.from_pixels px.ptr, px.width, px.height, px.stride, px.format
+  assert_equal px.to_s, img.pixels.to_s
+
+  assert_raise(ArgumentError) { Waah::Image.from_pixels "", 10, 5, 40, :argb32 }
+  assert_raise(ArgumentError) { Waah::Image.from_pixels px.to_s, 10, 5, 4, :argb32 }
+  assert_raise(ArgumentError) { Waah::Image.from_pixels px.to_s, 10, 5, 40, :bogus }
+end
+
+assert('Image#pixels outliving the image') do
+  expected = Waah::Image.load('../../test/bg.jpg').pixels.to_s
+
+  # Decoded pixels belong to the surface, which the view keeps
+  px = Waah::Image.load('../../test/bg.jpg').pixels
+  copy = Waah::Image.from_pixels(expected, px.width, px.height, px.stride, px.format).pixels
+  GC.start
+  assert_equal expected, px.to_s
+  assert_equal expected, copy.to_s
+end
+
+assert('Canvas batched primitives') do
+  c = Waah::Canvas.new 64, 64
+  c.rects [0, 0, 10, 10, 20, 20, 10, 10.5]
+  assert_equal [0.0, 0.0, 30.0, 30.5], c.path_extents
+  c.fill
+
+  c.rect 1, 2, 3, 4
+  c.circles [32, 32, 4, 48, 48, 4], fill: true, each: true
+  assert_equal [1.0, 2.0, 3.0, 4.0], c.path_extents
+  assert_raise(TypeError) { c.circles [32, 32, 4, 48, 48, nil], fill: true, each: true }
+  assert_equal [1.0, 2.0, 3.0, 4.0], c.path_extents
+  c.fill
+  c.lines [0, 0, 63, 63, 63, 0, 0, 63], stroke: true
+  c.polyline [1, 1, 10, 1, 10, 10], close: true, fill: true, stroke: true
+
+  if [].respond_to?(:pack)
+    c.rects [1, 2, 3, 4].pack('f*')
+    assert_equal [1.0, 2.0, 3.0, 4.0], c.path_extents
+    c.rects [1, 2, 3, 4].pack('d*'), double: true, fill: true
+  end
+
+  assert_raise(ArgumentError) { c.rects [0, 0, 10] }
+  assert_raise(ArgumentError) { c.rects "abc" }
+  assert_raise(TypeError) { c.circles 10 }
+end
+
+assert('Canvas#execute') do
+  ten = "\x00\x00\x20\x41"    # 10.0f little endian
+  twenty = "\x00\x00\xa0\x41" # 20.0f
+  ops = Waah::Commands
+
+  buf = ops::PUSH.chr +
+        ops::RECT.chr + ten + ten + twenty + twenty +
+        ops::POP.chr
+  c = Waah::Canvas.new 64, 64
+  c.execute buf
+  assert_equal [10.0, 10.0, 20.0, 20.0], c.path_extents
+
+  p = Waah::Path.new.M(0, 0).L(10, 10)
+  c.execute ops::NEW_PATH.chr + ops::PATH.chr + "\x00\x00\x00\x00" + ops::STROKE.chr, [p]
+
+  assert_true ops.validate(buf)
+  assert_equal "00000000  push\n00000001  rect 10 10 20 20\n00000012  pop\n", ops.disassemble(buf)
+
+  assert_raise(ArgumentError) { c.execute ops::POP.chr }
+  assert_raise(ArgumentError) { c.execute ops::PUSH.chr + ops::PUSH.chr + ops::POP.chr }
+  assert_raise(ArgumentError) { ops.validate ops::PUSH.chr }
+  assert_raise(ArgumentError) { c.execute ops::RECT.chr + ten }
+  assert_raise(ArgumentError) { c.execute "\xff" }
+  assert_raise(ArgumentError) { c.execute ops::PATH.chr + "\x00\x00\x00\x00", [] }
+  assert_raise(ArgumentError) { c.execute ops::IMAGE.chr + "\x00\x00\x00\x00" + ten + ten, [p] }
+  assert_true ops.disassemble(ops::FILL.chr + "\xff").include?("unknown opcode")
+end
+
+assert('Waah::Picture') do
+  pic = Waah::Picture.record(32, 32) do
+    color 0xff, 0, 0
+    rect 4, 4, 8, 8
+    fill
+  end
+  assert_equal 32.0, pic.width
+  assert_equal [4.0, 4.0, 8.0, 8.0], pic.ink_extents
+
+  c = Waah::Canvas.new 64, 64
+  c.picture pic, 10, 10
+  c.scale(2, 2) { c.picture pic }
+  assert_equal 64, c.snapshot.width
+
+  c.execute Waah::Commands::PICTURE.chr + "\x00\x00\x00\x00" + "\x00\x00\x20\x41" * 2, [pic]
+
+  assert_raise(RuntimeError) { Waah::Picture.record(8, 8) { snapshot } }
+
+  kept = nil
+  Waah::Picture.record(8, 8) { kept = self }
+  assert_raise(RuntimeError) { kept.rect 0, 0, 4, 4 }
+  assert_raise(RuntimeError) { kept.fill }
+  assert_raise(ArgumentError) { Waah::Picture.record(8, 8) }
+end
+
+assert('Canvas#execute with threads') do
+  ops = Waah::Commands
+  f = {
+    0 => "\x00\x00\x00\x00", 0.5 => "\x00\x00\x00\x3f", 1 => "\x00\x00\x80\x3f",
+    10 => "\x00\x00\x20\x41", 30 => "\x00\x00\xf0\x41", 64 => "\x00\x00\x80\x42",
+    100 => "\x00\x00\xc8\x42", 255 => "\x00\x00\x7f\x43"
+  }
+  buf = ops::COLOR.chr + f[255] + f[0] + f[0] + f[1] +
+        ops::CIRCLE.chr + f[64] + f[64] + f[30] + ops::FILL.chr +
+        ops::COLOR.chr + f[0] + f[0] + f[255] + f[0.5] +
+        ops::ROTATE.chr + f[0.5] +
+        ops::RECT.chr + f[10] + f[10] + f[100] + f[30] + ops::FILL_PRESERVE.chr +
+        ops::LINE_WIDTH.chr + f[10] + ops::STROKE.chr
+
+  serial = Waah::Canvas.new 128, 128
+  serial.execute buf
+  before = ops.stats
+  parallel = Waah::Canvas.new 128, 128
+  parallel.execute buf, threads: 4
+
+  assert_equal serial.pixels.to_s, parallel.pixels.to_s
+  assert_equal before[:parallel] + 1, ops.stats[:parallel]
+  assert_equal before[:fallbacks], ops.stats[:fallbacks]
+
+  # Pictures can't be replayed in bands
+  pic = Waah::Picture.record(8, 8) { rect 0, 0, 4, 4; fill }
+  parallel.execute ops::PICTURE.chr + "\x00\x00\x00\x00" + f[10] + f[10], [pic], threads: 4
+  assert_equal before[:parallel] + 1, ops.stats[:parallel]
+  assert_equal before[:fallbacks] + 1, ops.stats[:fallbacks]
+
+  serial.execute buf, threads: 1
+  assert_equal before[:fallbacks] + 1, ops.stats[:fallbacks]
+end
@@ -14,3 +14,46 @@ assert('Canvas#path') do
 
   c.snapshot.to_png "../../test/path1.png"
 end
+
+assert('Path retained') do
+  p = Waah::Path.new
+  p.M(10, 10).L(30, 10).L(30, 30).z
+
+  assert_equal [10.0, 10.0, 20.0, 20.0], p.extents
+
+  c = Waah::Canvas.new 64, 64
+  c.color 0xff, 0, 0
+  3.times do |i|
+    c.translate(i * 20, 0) { c.path p }
+  end
+  assert_equal [10.0, 10.0, 60.0, 20.0], c.path_extents
+
+  copy = c.copy_path
+  assert_equal [10.0, 10.0, 60.0, 20.0], copy.extents
+  c.fill
+
+  p.translate(5, 5).scale(2, 2)
+  assert_equal [30.0, 30.0, 40.0, 40.0], p.extents
+end
+
+assert('Path#svg_path') do
+  p = Waah::Path.new
+  p.svg_path "M3 3 l20 20 h-5v5z"
+  assert_equal [3.0, 3.0, 20.0, 25.0], p.extents
+
+  p = Waah::Path.new.svg_path "M0 0 A5 5 0 0 1 10 0"
+  x, y, w, h = p.extents
+  assert_equal 10.0, w
+  assert_true h > 4.9 && h < 5.1
+
+  p = Waah::Path.new.svg_path "M10 10Q20 0 30 10T50 10S60 0 70 10C70 20,80 20,80 10"
+  assert_equal 10.0, p.extents[0]
+
+  assert_raise(ArgumentError) { Waah::Path.new.svg_path "L10 10" }
+  assert_raise(ArgumentError) { Waah::Path.new.svg_path "M10 x" }
+  assert_raise(ArgumentError) { Waah::Path.new.svg_path "M0 0z 1" }
+  assert_equal [0.0, 0.0, 5.0, 5.0], Waah::Path.new.svg_path("M0 0h5v5zm1 1").extents
+
+  c = Waah::Canvas.new 64, 64
+  c.svg_path("M8 8h48v48h-48z").fill
+end
@@ -0,0 +1,108 @@
+#include <mruby.h>
+#include <mruby/compile.h>
+#include <mruby/string.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+
+/* Every thread runs its own interpreter drawing text and shapes; all of
+ * them have to end up with the same pixels */
+static const char *render_script =
+  "font = Waah::Font.load '../../test/Tuffy.ttf'\n"
+  "c = Waah::Canvas.new 160, 80\n"
+  "50.times do |i|\n"
+  "  c.color 255, 255, 255\n"
+  "  c.clear\n"
+  "  c.font font\n"
+  "  c.font_size 12 + i % 8\n"
+  "  c.color 0, 0, 0\n"
+  "  c.text 4, 40, \"Waah #{i}\"\n"
+  "  c.fill\n"
+  "  c.font 'Sans'\n"
+  "  c.text 4, 70, \"#{i}\"\n"
+  "  c.fill\n"
+  "  c.circle 120, 40, 10 + i % 20\n"
+  "  c.stroke\n"
+  "  c.snapshot.to_png\n"
+  "end\n"
+  "c.pixels.to_s\n";
+
+struct render_result {
+  char *pixels;
+  size_t len;
+};
+
+static void *
+render_thread(void *arg) {
+  struct render_result *result = (struct render_result *) arg;
+  mrb_state *mrb = mrb_open();
+  mrb_value pixels;
+
+  if(mrb == NULL) {
+    return NULL;
+  }
+
+  pixels = mrb_load_string(mrb, render_script);
+  if(mrb->exc == NULL && mrb_string_p(pixels)) {
+    result->len = RSTRING_LEN(pixels);
+    result->pixels = malloc(result->len);
+    if(result->pixels != NULL) {
+      memcpy(result->pixels, RSTRING_PTR(pixels), result->len);
+    }
+  }
+
+  mrb_close(mrb);
+  return NULL;
+}
+
+static mrb_value
+render_in_parallel(mrb_state *mrb, mrb_value self) {
+  mrb_int n_threads, i;
+  pthread_t *threads;
+  struct render_result *results;
+  mrb_bool ok = TRUE;
+
+  mrb_get_args(mrb, "i", &n_threads);
+
+  threads = mrb_malloc(mrb, sizeof(pthread_t) * n_threads);
+  results = mrb_calloc(mrb, n_threads, sizeof(struct render_result));
+
+  for(i = 0; i < n_threads; i++) {
+    if(pthread_create(&threads[i], NULL, render_thread, &results[i]) != 0) {
+      n_threads = i;
+      ok = FALSE;
+      break;
+    }
+  }
+
+  for(i = 0; i < n_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for(i = 0; i < n_threads; i++) {
+    if(results[i].pixels == NULL ||
+       results[i].len != results[0].len ||
+       memcmp(results[i].pixels, results[0].pixels, results[0].len) != 0) {
+      ok = FALSE;
+    }
+    free(results[i].pixels);
+  }
+
+  mrb_free(mrb, threads);
+  mrb_free(mrb, results);
+
+  return mrb_bool_value(ok);
+}
+#endif
+
+void
+mrb_waah_canvas_gem_test(mrb_state *mrb) {
+  struct RClass *m = mrb_define_module(mrb, "WaahTest");
+
+#ifndef _WIN32
+  mrb_define_module_function(mrb, m, "render_in_parallel", render_in_parallel, MRB_ARGS_REQ(1));
+#endif
+}
@@ -0,0 +1,5 @@
+assert('Interpreters rendering in parallel') do
+  skip unless WaahTest.respond_to?(:render_in_parallel)
+
+  assert_true WaahTest.render_in_parallel(8)
+end